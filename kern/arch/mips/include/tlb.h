@@ -60,13 +60,22 @@ void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
+/*
+ * tlb_setasid: load the address space ID that TLB lookups are matched
+ *        against into the PID field of c0_entryhi. tlb_random,
+ *        tlb_write, tlb_read, and tlb_probe all clobber c0_entryhi,
+ *        so this must be redone after using them.
+ */
+void tlb_setasid(uint32_t asid);
+
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * The MIPS has support for a 6-bit address space ID, kept in TLBHI_PID.
+ * An entry only matches when its PID equals the PID currently loaded
+ * in c0_entryhi, so entries belonging to different address spaces can
+ * live in the TLB at once. TLBLO_GLOBAL is left always zero, as are
+ * the bits that aren't assigned a meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -78,7 +87,7 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -88,6 +97,7 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 /*      TLBLO_GLOBAL  0x00000100 */
 
 #define TLBLO_TO_PPAGE(tlblo) ((tlblo & TLBLO_PPAGE) >> 12)
+#define ASID_TO_TLBHI(asid)   (((asid) << 6) & TLBHI_PID)
 
 /*
  * Values for completely invalid TLB entries. The TLB entry index should
@@ -103,5 +113,12 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 #define NUM_TLB  64
 
+/*
+ * Number of address space IDs the TLB can tell apart. ASID 0 is what
+ * the invalid entries and the kernel use, so it is never handed out.
+ */
+
+#define NUM_ASIDS 64
+
 
 #endif /* _MIPS_TLB_H_ */
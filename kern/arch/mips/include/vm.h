@@ -135,19 +135,28 @@ paddr_t ram_getfirstfree(void);
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown carries a batch of up to TLBSHOOTDOWN_ENTRIES mappings, or
+ * asks for a flush. A cpu queues up to TLBSHOOTDOWN_MAX shootdowns; past
+ * that, or when a batch doesn't fit, they are coalesced into a flush of
+ * the whole TLB.
  */
 
+#define TLBSHOOTDOWN_ENTRIES 8
+
 struct tlbshootdown {
     /*
     * Change this to what you need for your VM design.
     */
     struct cpu* tlbs_cpu;   /* which cpu's tlb to shoot down */
-    vaddr_t tlbs_vaddr;     /* virtual address to shoot down */
+    unsigned tlbs_count;    /* number of mappings to shoot down */
+    vaddr_t tlbs_vaddrs[TLBSHOOTDOWN_ENTRIES]; /* their virtual addresses */
+    uint32_t tlbs_asids[TLBSHOOTDOWN_ENTRIES]; /* their address space ids */
+    uint32_t tlbs_asid;     /* address space id to flush */
+    bool tlbs_flush_asid;   /* whether to flush every entry of tlbs_asid */
     bool tlbs_flush_all;    /* whether to flush the tlb */
 };
 
-#define TLBSHOOTDOWN_MAX 16
+#define TLBSHOOTDOWN_MAX 8
 
 
 #endif /* _MIPS_VM_H_ */
@@ -103,6 +103,8 @@ syscall(struct trapframe *tf)
 	retval = 0;
     off_t lretval = 0; /* for lseek only */
     int whence; /* for lseek only */
+    int fd; /* for mmap only */
+    off_t mmap_offset; /* for mmap only */
 
 	switch (callno) {
 	    case SYS_reboot:
@@ -193,6 +195,30 @@ syscall(struct trapframe *tf)
         err = sys_sbrk((int) tf->tf_a0, &retval);
         break;
 
+        case SYS_mmap:
+        /* fd is the fifth argument; the 64-bit offset is aligned after it */
+        err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(int));
+        if (err)  break;
+        err = copyin((const_userptr_t)(tf->tf_sp + 24), &mmap_offset,
+                sizeof(off_t));
+        if (err)  break;
+        err = sys_mmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+                (int)tf->tf_a2, (int)tf->tf_a3, fd, mmap_offset, &retval);
+        break;
+
+        case SYS_munmap:
+        err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+        break;
+
+        case SYS_madvise:
+        err = sys_madvise((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+                (int)tf->tf_a2);
+        break;
+
+        case SYS_memstat:
+        err = sys_memstat((pid_t)tf->tf_a0, (userptr_t)tf->tf_a1);
+        break;
+
         case SYS_chdir:
         err = sys_chdir((const_userptr_t)tf->tf_a0);
         break;
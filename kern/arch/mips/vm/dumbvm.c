@@ -133,6 +133,16 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+void
+vm_tlbshootdown_queue(struct tlbshootdown *queue, unsigned *num,
+		      const struct tlbshootdown *ts)
+{
+	(void)queue;
+	(void)num;
+	(void)ts;
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -40,21 +40,49 @@
 #include <pagetable.h>
 #include <vm.h>
 #include <coremap.h>
+#include <textcache.h>
 #include <wchan.h>
 #include <paging.h>
 #include <kern/signal.h>
 #include <syscall.h>
 #include <swap.h>
 #include <vmstats.h>
+#include <clock.h>
 
 /* Kernel structures */
 struct coremap *k_coremap;
 struct swap_tracker *k_swap_tracker;
 struct vmstats k_vmstats;
+struct asid_tracker k_asid_tracker;
 
 /* False until swap is initialized */
 unsigned k_can_swap;
 
+/*
+ * Drops the coremap's count of tlb entries for the page in a tlb entry
+ * that is about to be overwritten, waking up anyone waiting for the
+ * page to leave every tlb. Assumes no coremap stripe lock is held.
+ */
+static
+void
+tlb_forget(uint32_t entrylo)
+{
+    if ((entrylo & TLBLO_VALID) != TLBLO_VALID)  return;
+    int ppn = TLBLO_TO_PPAGE(entrylo);
+    KASSERT(ppn < k_coremap->cm_num_pages);
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    spinlock_acquire(CM_LOCK(ppn));
+    if (cme->cme_tlb > 0) {
+        cme->cme_tlb--;
+        if (cme->cme_tlb == 0) {
+            wchan_wakeall(CM_STRIPE(ppn)->cs_tlb_wchan, CM_LOCK(ppn));
+        }
+    }
+    spinlock_release(CM_LOCK(ppn));
+    KASSERT(curcpu->c_tlb_entries > 0);
+    curcpu->c_tlb_entries--;
+}
+
 void
 vm_bootstrap(void)
 {
@@ -74,7 +102,41 @@ vm_bootstrap(void)
     k_coremap->cm_num_kpages = 0;
     k_coremap->cm_num_dirty = 0;
     k_coremap->cm_clock_head = 0;
+    k_coremap->cm_rmap_free = NULL;
+    k_coremap->cm_num_free = 0;
+    for (int i = 0; i < CM_FREE_WORDS; i++) {
+        k_coremap->cm_free_map[i] = 0;
+    }
+    for (int i = 0; i < CM_SUMMARY_WORDS; i++) {
+        k_coremap->cm_free_summary[i] = 0;
+    }
+    for (int i = 0; i < CM_ORDER_MAP_WORDS; i++) {
+        k_coremap->cm_order_map[i] = 0;
+    }
+    unsigned base = 0;
+    for (int o = 0; o <= CM_MAX_ORDER; o++) {
+        /* order 0 is the free map, and has no place here */
+        k_coremap->cm_order_base[o] = base;
+        k_coremap->cm_order_free[o] = 0;
+        if (o > 0)  base += CM_ORDER_WORDS(o);
+    }
+    KASSERT(base <= CM_ORDER_MAP_WORDS);
     spinlock_init(&k_coremap->cm_lock);
+    spinlock_init(&k_coremap->cm_free_lock);
+    spinlock_init(&k_coremap->cm_zero_lock);
+    k_coremap->cm_num_zero = 0;
+    k_coremap->cm_zero_wchan = NULL;
+    for (int i = 0; i < CM_STRIPES; i++) {
+        spinlock_init(&k_coremap->cm_stripes[i].cs_lock);
+    }
+
+    /* asid 0 is never handed out, and no cpu starts in generation 1 */
+    spinlock_init(&k_asid_tracker.at_lock);
+    k_asid_tracker.at_next = 1;
+    k_asid_tracker.at_generation = 1;
+
+    textcache_init();
+
     paddr_t first_free = ram_getfirstfree();
     /* mark stolen kernel pages */
     int first_free_index = PADDR_TO_CM_INDEX(first_free);
@@ -83,8 +145,15 @@ vm_bootstrap(void)
         cme->cme_as = NULL;
         cme->cme_vaddr = (vaddr_t) CM_INDEX_TO_KVADDR(i);
         cme->cme_swap_location = 0;
-        cme->cme_owner_cpu = NULL;
+        cme->cme_rmap = NULL;
+        cme->cme_vnode = NULL;
+        cme->cme_shm = NULL;
+        cme->cme_shm_index = 0;
+        cme->cme_refcount = 0;
         cme->cme_dirty = 0;
+        cme->cme_readahead = 0;
+        cme->cme_referenced = 0;
+        cme->cme_age = 0;
         cme->cme_tlb = 0;
         cme->cme_busy = 0;
         cme->cme_kernel = (i == 0) ? 0 : 1;
@@ -99,8 +168,15 @@ vm_bootstrap(void)
         cme->cme_as = NULL;
         cme->cme_vaddr = 0;
         cme->cme_swap_location = 0;
-        cme->cme_owner_cpu = NULL;
+        cme->cme_rmap = NULL;
+        cme->cme_vnode = NULL;
+        cme->cme_shm = NULL;
+        cme->cme_shm_index = 0;
+        cme->cme_refcount = 0;
         cme->cme_dirty = 0;
+        cme->cme_readahead = 0;
+        cme->cme_referenced = 0;
+        cme->cme_age = 0;
         cme->cme_tlb = 0;
         cme->cme_busy = 0;
         cme->cme_kernel = 0;
@@ -113,8 +189,15 @@ vm_bootstrap(void)
         cme->cme_as = NULL;
         cme->cme_vaddr = 0;
         cme->cme_swap_location = 0;
-        cme->cme_owner_cpu = NULL;
+        cme->cme_rmap = NULL;
+        cme->cme_vnode = NULL;
+        cme->cme_shm = NULL;
+        cme->cme_shm_index = 0;
+        cme->cme_refcount = 0;
         cme->cme_dirty = 0;
+        cme->cme_readahead = 0;
+        cme->cme_referenced = 0;
+        cme->cme_age = 0;
         cme->cme_tlb = 0;
         cme->cme_busy = 0;
         cme->cme_kernel = 0;
@@ -126,18 +209,105 @@ vm_bootstrap(void)
     if (k_coremap->cm_num_pages - k_coremap->cm_num_kpages < MIN_USER_PAGES) {
         panic("kernel takes too much memory");
     }
+
+    /* everything the kernel didn't take starts out free */
+    for (int i = first_free_index; i < last_existing_index; i++) {
+        cm_free_page(i);
+    }
     
     /* at this point kmalloc should work, so we can initialize
-     * the kernel coremap's wchan
+     * the kernel coremap's wchans
      */
-    k_coremap->cm_wchan = wchan_create("kernel_wchan");
-    k_coremap->cm_tlb_wchan = wchan_create("kernel_tlb_wchan");
-    if (k_coremap->cm_wchan == NULL || k_coremap->cm_tlb_wchan == NULL) {
+    for (int i = 0; i < CM_STRIPES; i++) {
+        struct cm_stripe *cs = &k_coremap->cm_stripes[i];
+        cs->cs_wchan = wchan_create("kernel_wchan");
+        cs->cs_tlb_wchan = wchan_create("kernel_tlb_wchan");
+        if (cs->cs_wchan == NULL || cs->cs_tlb_wchan == NULL) {
+            panic("out of memory while booting up");
+        }
+    }
+    k_coremap->cm_zero_wchan = wchan_create("zero_pool_wchan");
+    if (k_coremap->cm_zero_wchan == NULL) {
         panic("out of memory while booting up");
     }
     
 }
 
+/*
+ * Refills the TLB for a page that is present and needs nothing done to
+ * it, without the address space lock or busying the frame. Returns
+ * false if vm_fault has to take the slow path: the page isn't in
+ * memory, the fault needs a copy or a permission check to fail, or the
+ * frame is busy.
+ *
+ * Nobody else changes our PTEs unless they hold the frame busy, and
+ * evictions busy the frame before they look at cme_tlb, so a PTE that
+ * still points at an unbusied frame under its lock is safe to load.
+ */
+static
+bool
+vm_fault_fast(struct addrspace *as, int faulttype, vaddr_t faultaddress)
+{
+    struct pgtable *pde = as->as_pd[VADDR_TO_PT(faultaddress)];
+    if (pde == NULL) {
+        return false;
+    }
+    struct pt_entry *pte = &(pde->pt_ptes[VADDR_TO_PTE(faultaddress)]);
+    struct pt_entry snap = *pte;
+    if (!snap.pte_present || !snap.pte_valid || snap.pte_zeroed) {
+        return false;
+    }
+    bool write = (faulttype == VM_FAULT_WRITE || faulttype == VM_FAULT_READONLY);
+    if (write && (!snap.pte_writeable || snap.pte_cow)) {
+        return false;
+    }
+    int ppn = snap.pte_ppn;
+    KASSERT(ppn < k_coremap->cm_num_pages);
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+
+    /* Give up the slot we're about to overwrite before taking our
+     * frame's lock, since tlb_forget takes the lock of the frame in it,
+     * which may be in the same stripe or be this very frame */
+    int spl = splhigh();
+    KASSERT(as->as_asid == curcpu->c_asid);
+    uint32_t entryhi, entrylo;
+    int index = tlb_probe(faultaddress | ASID_TO_TLBHI(as->as_asid), 0);
+    if (index < 0) {
+        index = random() % NUM_TLB;
+    }
+    tlb_read(&entryhi, &entrylo, index);
+    tlb_forget(entrylo);
+
+    spinlock_acquire(CM_LOCK(ppn));
+    if (!pte->pte_present || (int)pte->pte_ppn != ppn || cme->cme_busy ||
+        cme->cme_readahead || !page_mapped_by(ppn, as)) {
+        spinlock_release(CM_LOCK(ppn));
+        /* the slot is no longer counted, so it can't keep its entry */
+        tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+        splx(spl);
+        return false;
+    }
+    KASSERT(cme->cme_kpage == 0);
+
+    entryhi = faultaddress | ASID_TO_TLBHI(as->as_asid);
+    entrylo = CM_INDEX_TO_PADDR(ppn) | TLBLO_VALID;
+    if (write) {
+        cm_set_dirty(ppn, true);
+        entrylo |= TLBLO_DIRTY;
+    }
+    tlb_write(entryhi, entrylo, index);
+    tlb_setasid(curcpu->c_asid);
+    curcpu->c_tlb_entries++;
+    cme->cme_tlb++;
+    cme->cme_referenced = 1;
+    cme->cme_age = 0;
+    spinlock_release(CM_LOCK(ppn));
+    splx(spl);
+
+    k_vmstats.vms_tlb_fast_refills++;
+    return true;
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress) {
     
@@ -157,63 +327,67 @@ vm_fault(int faulttype, vaddr_t faultaddress) {
     faultaddress = PAGE_ALIGN(faultaddress);
     struct addrspace *as = curproc->p_addrspace;
     KASSERT(as != NULL);
+    if (vm_fault_fast(as, faulttype, faultaddress)) {
+        as->as_stats.ms_tlb_faults++;
+        return 0;
+    }
+    struct timespec start;
+    gettime(&start);
+    bool paged = false;
     lock_acquire(as->as_lock);
-    if(faultaddress <= STACK_MIN &&
-     faultaddress >= as->as_heap_start + as->as_heap_size) {
+    struct pt_entry *pte;
+    int result = as_fault_pte(as, faultaddress, &pte);
+    if (result) {
         lock_release(as->as_lock);
-        return EFAULT;
+        return result;
     }
-    int pdi = VADDR_TO_PT(faultaddress);
-    struct pgtable *pde = as->as_pd[pdi];
-    if (pde == NULL) {
-        if (!(faultaddress > STACK_MIN && faultaddress <= STACK_MAX)) {
-            lock_release(as->as_lock);
-            return EFAULT;
-        }
-        pde = kmalloc(sizeof(struct pgtable));
-        if (pde == NULL) {
-            panic("EOM in vm_fault");
-        }
-        pgt_init(pde);
-        as->as_pd[VADDR_TO_PT(faultaddress)] = pde;
-    }
-    struct pt_entry *pte = &(pde->pt_ptes[VADDR_TO_PTE(faultaddress)]);
-    
+
     /* YAY synchronization */
-    spinlock_acquire(&k_coremap->cm_lock);
-    int release_ppn = pte_acquire(as, pte);    
-    
+    int ppn = pte_acquire(as, pte);
+
     /* If the page is in swap or was never allocated, raise a page fault */
-    if (!pte->pte_present || 
-        (!pte->pte_valid && faultaddress > STACK_MIN && faultaddress < STACK_MAX)
-        || pte->pte_zeroed) {
+    if (!pte->pte_present || pte->pte_zeroed) {
+        KASSERT(ppn < 0);
         int res = page_fault(faultaddress);
         if (res) {
-            pte_release(as, pte, release_ppn);
             lock_release(as->as_lock);
-            spinlock_release(&k_coremap->cm_lock);
             return res;
-        } 
+        }
+        /* The page comes back busy */
+        ppn = pte->pte_ppn;
+        paged = true;
     }
-    int spl = splhigh();
-    KASSERT(pte->pte_present);
-    KASSERT(pte->pte_ppn < k_coremap->cm_num_pages);
-    int ppn = pte->pte_ppn;
-    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
-    cme->cme_busy = 1;
-    KASSERT(k_coremap->cm_entries[ppn].cme_as == as);
-    KASSERT(k_coremap->cm_entries[ppn].cme_vaddr == faultaddress);
 
     /* Handle READ, WRITE, and READONLY faults */
-    if ((faulttype == VM_FAULT_WRITE || faulttype == VM_FAULT_READONLY)
-        && pte->pte_writeable != 1) {
-        pte_release(as, pte, release_ppn);
+    bool write = (faulttype == VM_FAULT_WRITE || faulttype == VM_FAULT_READONLY);
+    if (write && pte->pte_writeable != 1) {
+        pte_release(as, pte, ppn);
         lock_release(as->as_lock);
-        spinlock_release(&k_coremap->cm_lock);
-        splx(spl);
         return EFAULT;
     }
-    int index = tlb_probe(faultaddress, 0);
+
+    /* Writing to a shared page; get our own copy */
+    if (write && pte->pte_cow) {
+        int res = page_cow_break(faultaddress, pte);
+        if (res) {
+            pte_release(as, pte, ppn);
+            lock_release(as->as_lock);
+            return res;
+        }
+        ppn = pte->pte_ppn;
+        paged = true;
+    }
+
+    int spl = splhigh();
+    KASSERT(pte->pte_present);
+    KASSERT(ppn == (int)pte->pte_ppn);
+    KASSERT(ppn < k_coremap->cm_num_pages);
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    KASSERT(cme->cme_busy);
+    KASSERT(page_mapped_by(ppn, as));
+
+    KASSERT(as->as_asid == curcpu->c_asid);
+    int index = tlb_probe(faultaddress | ASID_TO_TLBHI(as->as_asid), 0);
     if (faulttype == VM_FAULT_READ || faulttype == VM_FAULT_WRITE) {
         KASSERT(index < 0);
     }
@@ -222,31 +396,42 @@ vm_fault(int faulttype, vaddr_t faultaddress) {
     /* Pick a random place in the TLB, evicting another TLB entry sometimes */
     if (index < 0) {
         index = random() % NUM_TLB;
-        uint32_t entryhi, entrylo;
-        tlb_read(&entryhi, &entrylo, index);
-        if ((entrylo & TLBLO_VALID) == TLBLO_VALID) {
-            k_coremap->cm_entries[PADDR_TO_CM_INDEX(entrylo)].cme_tlb = 0;
-            wchan_wakeall(k_coremap->cm_tlb_wchan, &k_coremap->cm_lock);
-        }
     }
-    entryhi = faultaddress;
+    tlb_read(&entryhi, &entrylo, index);
+    tlb_forget(entrylo);
+    entryhi = faultaddress | ASID_TO_TLBHI(as->as_asid);
     entrylo = CM_INDEX_TO_PADDR(ppn) | TLBLO_VALID;
-    if (faulttype == VM_FAULT_WRITE || faulttype == VM_FAULT_READONLY) {
-        if (cme->cme_dirty == 0) {
-            cme->cme_dirty = 1;
-            k_coremap->cm_num_dirty++;
-        }
+    spinlock_acquire(CM_LOCK(ppn));
+    if (write) {
+        cm_set_dirty(ppn, true);
         entrylo |= TLBLO_DIRTY;
     }
     tlb_write(entryhi, entrylo, index);
-    cme->cme_tlb = 1;
+    tlb_setasid(curcpu->c_asid);
+    curcpu->c_tlb_entries++;
+    cme->cme_tlb++;
+    cme->cme_referenced = 1;
+    cme->cme_age = 0;
+    bool readahead_hit = cme->cme_readahead;
+    cme->cme_readahead = 0;
+    spinlock_release(CM_LOCK(ppn));
+
+    /* A page read in ahead of its fault got used; read further ahead */
+    if (readahead_hit) {
+        k_vmstats.vms_readaround_hits++;
+        if (as->as_ra_window < SWAP_CLUSTER) {
+            as->as_ra_window++;
+        }
+    }
 
     /* Clean up */
     KASSERT(pte->pte_padding == 0);
-    cme->cme_busy = 0;
-    wchan_wakeall(k_coremap->cm_wchan, &k_coremap->cm_lock);
-    pte_release(as, pte, release_ppn);
-    spinlock_release(&k_coremap->cm_lock);
+    if (paged) {
+        vmstats_fault_latency(&as->as_stats, &start);
+    } else {
+        as->as_stats.ms_tlb_faults++;
+    }
+    pte_release(as, pte, ppn);
     lock_release(as->as_lock);
     splx(spl);
     return 0;
@@ -256,79 +441,93 @@ vm_fault(int faulttype, vaddr_t faultaddress) {
 vaddr_t
 alloc_kpages(unsigned npages)
 {
+    /* reserve the pages up front so racing allocations can't overshoot */
     spinlock_acquire(&k_coremap->cm_lock);
-
     if (k_coremap->cm_num_pages - (k_coremap->cm_num_kpages + npages) < 
         MIN_USER_PAGES) {
         spinlock_release(&k_coremap->cm_lock);
         return 0;
     }
+    k_coremap->cm_num_kpages += npages;
+    spinlock_release(&k_coremap->cm_lock);
 
     struct cm_entry *cme;
 
     int start_of_block = -1;
-    int cur_block = 0;
-
-    for (int num_tries = 0; num_tries < NUM_TRIES; ++num_tries) {
-        /* look for a block of free pages */
-        cme = &k_coremap->cm_entries[0];
-        uint32_t pages_found = 0;
-        while(cme->cme_exists == 1) {
-            if (cme->cme_kpage == 0 && cme->cme_as == NULL && !cme->cme_busy) {
-                if (pages_found == 0)  start_of_block = cur_block;
-                pages_found++;
-                if (pages_found == npages)  break;
-            } else {
-                pages_found = 0;
-                start_of_block = -1;
-            }
-            cur_block++;
-            if (cur_block >= RAM_PAGES)  break;
-            cme = &k_coremap->cm_entries[cur_block];
-        }
-        /* check if block has enough pages */
-        if (pages_found == npages)  break;
+
+    /* A single page can come already zeroed */
+    bool zeroed = false;
+    if (npages == 1) {
+        start_of_block = cm_get_zeroed_page();
+        zeroed = (start_of_block >= 0);
+    }
+
+    for (int num_tries = 0; num_tries < NUM_TRIES && !zeroed; ++num_tries) {
+        /* look for a buddy block of free pages */
+        start_of_block = cm_alloc_block(npages);
+        if (start_of_block >= 0)  break;
 
         /* couldn't find enough pages; use page_get to free user pages */
-        start_of_block = -1;
-        cur_block = 0;
         /* expedite single-page allocations */
         if (npages == 1) {
             start_of_block = page_get(0);
             if (start_of_block >= 0)  break;
         }
-        /* evict some random user pages and try again */
+        /* frames cached on cpus or in the zero pool aren't on the free
+         * map, and would keep any block they're in from being picked;
+         * put them back before evicting anything */
+        else if (num_tries == 0) {
+            cm_drain_caches();
+            cm_drain_zero_pool();
+        }
+        /* evict the user pages in the way of the cheapest block and try
+         * again */
         else {
-            for (unsigned evicts = 0; evicts < npages - pages_found; ++evicts) {
-                int new_ppn = page_get(0);
+            int block = cm_pick_block(npages);
+            if (block < 0)  continue;
+            for (unsigned i = 0; i < npages; ++i) {
+                int new_ppn = page_evict_frame(block + i);
                 if (new_ppn >= 0) {
-                    k_coremap->cm_entries[new_ppn].cme_busy = 0;
+                    cm_unbusy(new_ppn);
+                    cm_free_page(new_ppn);
+                    k_vmstats.vms_kpage_evictions++;
                 }
             }
         }
     }
     if (start_of_block == -1) {
+        spinlock_acquire(&k_coremap->cm_lock);
+        k_coremap->cm_num_kpages -= npages;
         spinlock_release(&k_coremap->cm_lock);
         return 0;
     }
 
     for (uint32_t i = 0; i < npages; i++) {
-        cme = &k_coremap->cm_entries[start_of_block+i];
+        int ppn = start_of_block + i;
+        cme = &k_coremap->cm_entries[ppn];
+        spinlock_acquire(CM_LOCK(ppn));
         cme->cme_as = NULL;
-        cme->cme_vaddr = CM_INDEX_TO_KVADDR(start_of_block+i);
+        cme->cme_vaddr = CM_INDEX_TO_KVADDR(ppn);
         cme->cme_swap_location = 0;
-        cme->cme_owner_cpu = NULL;
+        cme->cme_rmap = NULL;
+        cme->cme_vnode = NULL;
+        cme->cme_shm = NULL;
+        cme->cme_shm_index = 0;
+        cme->cme_refcount = 0;
         cme->cme_dirty = 0;
+        cme->cme_readahead = 0;
+        cme->cme_referenced = 0;
+        cme->cme_age = 0;
         cme->cme_tlb = 0;
         cme->cme_kernel = (i == 0) ? 0 : 1;
         cme->cme_busy = 0;
         cme->cme_kpage = 1; 
+        spinlock_release(CM_LOCK(ppn));
     }
 
-    as_zero_region(CM_INDEX_TO_KVADDR(start_of_block), npages);
-
-    k_coremap->cm_num_kpages += npages;
-    spinlock_release(&k_coremap->cm_lock);
+    if (!zeroed) {
+        as_zero_region(CM_INDEX_TO_KVADDR(start_of_block), npages);
+    }
 
 	return CM_INDEX_TO_KVADDR(start_of_block);
 }
@@ -339,29 +538,40 @@ free_kpages(vaddr_t addr)
     
     KASSERT(addr >= KERNEL_VADDR_START && addr < KERNEL_VADDR_END);
 
-    spinlock_acquire(&k_coremap->cm_lock);
-
-    int ppn = KVADDR_TO_PPN(addr);
+    int first = KVADDR_TO_PPN(addr);
+    int ppn = first;
     struct cm_entry* cme;
     cme = &k_coremap->cm_entries[ppn];
+    spinlock_acquire(CM_LOCK(ppn));
     KASSERT(cme->cme_busy == 0);
     KASSERT(cme->cme_kpage == 1);
     KASSERT(cme->cme_kernel == 0);
     KASSERT(cme->cme_as == NULL);
     cme->cme_kpage = 0;
-    k_coremap->cm_num_kpages--;
+    spinlock_release(CM_LOCK(ppn));
     ppn++;
-    cme = &k_coremap->cm_entries[ppn]; 
-    while(cme->cme_kernel == 1 && cme->cme_kpage == 1) {
+    while (ppn < k_coremap->cm_num_pages) {
+        cme = &k_coremap->cm_entries[ppn];
+        spinlock_acquire(CM_LOCK(ppn));
+        if (cme->cme_kernel != 1 || cme->cme_kpage != 1) {
+            spinlock_release(CM_LOCK(ppn));
+            break;
+        }
         KASSERT(cme->cme_busy == 0);
         KASSERT(cme->cme_as == NULL);
         cme->cme_kpage = 0;
         cme->cme_kernel = 0;
+        spinlock_release(CM_LOCK(ppn));
         ppn++;
-        cme = &k_coremap->cm_entries[ppn];
-        k_coremap->cm_num_kpages--;
     }
 
+    /* Give the whole block back at once, so it coalesces with its free
+     * buddies */
+    int freed = ppn - first;
+    cm_free_block(first, freed);
+
+    spinlock_acquire(&k_coremap->cm_lock);
+    k_coremap->cm_num_kpages -= freed;
     spinlock_release(&k_coremap->cm_lock);
 }
 
@@ -374,41 +584,98 @@ void vm_tlbshootdown(const struct tlbshootdown *t) {
     /* This is the target cpu */
     else {
         k_vmstats.vms_tlb_shootdowns++;
+        int spl = splhigh();
+        /*
+         * A tlb that hasn't been flushed since the asids last ran out
+         * may hold entries tagged with asids their address spaces have
+         * since given up, which probing by the current asid would miss
+         * and leave counted in cme_tlb forever. Flush all of it. This
+         * leaves c_asid_gen alone: until as_activate flushes, entries
+         * still go in under whatever old asid the cpu has loaded.
+         */
+        bool stale = curcpu->c_asid_gen != k_asid_tracker.at_generation;
         /* Flush all entries */
-        unsigned acquired = 0;
-        if (!spinlock_do_i_hold(&k_coremap->cm_lock)) {
-            spinlock_acquire(&k_coremap->cm_lock);
-            acquired = 1;
+        if (t->tlbs_flush_all || stale) {
+            for (int i = 0; i < NUM_TLB; ++i) {
+                uint32_t entryhi, entrylo;
+                tlb_read(&entryhi, &entrylo, i);
+                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+                /* Update coremap */
+                tlb_forget(entrylo);
+            }
         }
-        int spl = splhigh();
-        if (t->tlbs_flush_all) {
+        /* Flush every entry of one address space */
+        else if (t->tlbs_flush_asid) {
             for (int i = 0; i < NUM_TLB; ++i) {
                 uint32_t entryhi, entrylo;
                 tlb_read(&entryhi, &entrylo, i);
+                if ((entryhi & TLBHI_PID) != ASID_TO_TLBHI(t->tlbs_asid) ||
+                    (entrylo & TLBLO_VALID) != TLBLO_VALID) {
+                    continue;
+                }
                 tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
                 /* Update coremap */
-                KASSERT(TLBLO_TO_PPAGE(entrylo) < (unsigned)k_coremap->cm_num_pages);
-                k_coremap->cm_entries[TLBLO_TO_PPAGE(entrylo)].cme_tlb = 0;
+                tlb_forget(entrylo);
             }
         }
-        /* Flush specified entry */
+        /* Flush specified entries */
         else {
-            int index = tlb_probe((int)t->tlbs_vaddr, 0);
-            if (index < 0)  goto cleanup;
-            uint32_t entryhi, entrylo;
-            tlb_read(&entryhi, &entrylo, index);
-            KASSERT(k_coremap->cm_entries[TLBLO_TO_PPAGE(entrylo)].cme_tlb == 1);
-            tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
-            /* Update coremap */
-            KASSERT(TLBLO_TO_PPAGE(entrylo) < (unsigned)k_coremap->cm_num_pages);
-            k_coremap->cm_entries[TLBLO_TO_PPAGE(entrylo)].cme_tlb = 0;
+            for (unsigned i = 0; i < t->tlbs_count; i++) {
+                int index = tlb_probe(t->tlbs_vaddrs[i] |
+                                      ASID_TO_TLBHI(t->tlbs_asids[i]), 0);
+                if (index < 0) {
+                    continue;
+                }
+                uint32_t entryhi, entrylo;
+                tlb_read(&entryhi, &entrylo, index);
+                tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+                /* Update coremap */
+                tlb_forget(entrylo);
+            }
         }
-        wchan_wakeall(k_coremap->cm_tlb_wchan, &k_coremap->cm_lock);
+        tlb_setasid(curcpu->c_asid);
+        splx(spl);
+    }
+}
+
+void
+vm_tlbshootdown_queue(struct tlbshootdown *queue, unsigned *num,
+    const struct tlbshootdown *t) {
+    k_vmstats.vms_tlb_ipis++;
+    k_vmstats.vms_tlb_ipi_entries += t->tlbs_count;
 
-cleanup:
-        if (acquired == 1) {
-            spinlock_release(&k_coremap->cm_lock);
+    /* A flush already queued covers anything else */
+    if (*num > 0 && queue[*num - 1].tlbs_flush_all) {
+        return;
+    }
+    if (t->tlbs_flush_all) {
+        queue[0] = *t;
+        *num = 1;
+        return;
+    }
+
+    /* Add the mappings to the last batch if they fit */
+    struct tlbshootdown *last = *num > 0 ? &queue[*num - 1] : NULL;
+    if (last != NULL && !last->tlbs_flush_asid && !t->tlbs_flush_asid &&
+        last->tlbs_count + t->tlbs_count <= TLBSHOOTDOWN_ENTRIES) {
+        for (unsigned i = 0; i < t->tlbs_count; i++) {
+            last->tlbs_vaddrs[last->tlbs_count] = t->tlbs_vaddrs[i];
+            last->tlbs_asids[last->tlbs_count] = t->tlbs_asids[i];
+            last->tlbs_count++;
         }
-        splx(spl);
+        return;
     }
-} 
\ No newline at end of file
+
+    if (*num < TLBSHOOTDOWN_MAX) {
+        queue[(*num)++] = *t;
+        return;
+    }
+
+    /* No room; flushing the whole tlb takes care of everything queued */
+    k_vmstats.vms_tlb_coalesced++;
+    queue[0] = *t;
+    queue[0].tlbs_count = 0;
+    queue[0].tlbs_flush_asid = false;
+    queue[0].tlbs_flush_all = true;
+    *num = 1;
+}
@@ -404,14 +404,16 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). The VM system pages mapped files in and out
+ * through sfs_read and sfs_write, so through the buffer cache, and
+ * there is nothing else to set up.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
@@ -41,9 +41,50 @@
 #include <pagetable.h>
 #include <spinlock.h>
 #include <types.h>
+#include <kern/memstat.h>
 
 struct vnode;
+struct shm_object;
 
+/*
+ * A region of the address space: a program segment, the heap, the
+ * stack, or an mmap mapping. Nothing outside a region can be touched.
+ * Page tables are only filled in when a page of a region is first
+ * touched, so untouched parts of the address space cost nothing.
+ *
+ * Pages of a file-backed region are read in the first time they are
+ * touched. Bytes past ar_filesize, or past the end of the file, are
+ * zero. Regions without a file are zero-filled. A shared anonymous
+ * region maps the pages of a shared memory object instead, which it
+ * shares with the copies fork makes of it.
+ *
+ * The list is sorted by address and only changes under the address
+ * space lock. Program segments may share a page with each other; a
+ * page shared this way gets the permissions of all of them.
+ */
+struct as_region {
+    vaddr_t ar_vaddr;               /* where the region starts */
+    size_t ar_memsize;              /* length of the region */
+    size_t ar_filesize;             /* bytes of it that come from the file */
+    struct vnode *ar_vnode;         /* the file, or NULL if anonymous */
+    off_t ar_offset;                /* where the region starts in the file */
+    int ar_kind;                    /* AR_SEGMENT, AR_HEAP, ... */
+    int ar_perms;                   /* AR_READ, AR_WRITE and AR_EXEC bits */
+    bool ar_shared;                 /* whether changes go back to the file */
+    struct shm_object *ar_shm;      /* pages of a shared anonymous region */
+    struct as_region *ar_next;      /* next region up */
+};
+
+/* Kinds of region. The heap grows up through sbrk; nothing else moves. */
+#define AR_SEGMENT  0               /* a segment of the executable */
+#define AR_HEAP     1               /* the heap */
+#define AR_STACK    2               /* the user stack */
+#define AR_MMAP     3               /* a mapping made with mmap */
+
+/* Region permissions, the same bits as the ELF segment flags */
+#define AR_EXEC     0x1
+#define AR_WRITE    0x2
+#define AR_READ     0x4
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -64,12 +105,37 @@ struct addrspace {
 #else
     /* Put stuff here for your VM system */
     struct pgtable *as_pd[PD_SIZE]; /* the page directory of the addrspace */
-    size_t as_heap_size;            /* the current heap size */
-    vaddr_t as_heap_start;          /* start addess of the heap*/
     struct lock *as_lock;           /* lock to protect this struct */
+    uint32_t as_asid;               /* tlb address space id */
+    uint32_t as_asid_gen;           /* generation as_asid was handed out in */
+    struct as_region *as_regions;   /* every region, sorted by address */
+    struct as_region *as_heap;      /* the heap region, once loaded */
+    vaddr_t as_mmap_start;          /* lowest mmap address; heap ends below */
+    unsigned as_ra_window;          /* pages read per swap fault */
+    vaddr_t as_ra_next;             /* page after the last swap-in */
+    struct spinlock as_tlb_lock;    /* protects as_tlb_cpus */
+    uint32_t as_tlb_cpus;           /* cpus whose tlb may hold our entries */
+    struct memstat as_stats;        /* fault and paging counts */
+    struct spinlock as_pin_lock;    /* protects as_pins */
+    unsigned as_pins;               /* readers as_destroy waits for */
+    struct wchan *as_pin_wchan;     /* where as_destroy waits for them */
 #endif
 };
 
+/*
+ * Hands out TLB address space IDs. When a generation runs out of IDs a
+ * new one starts, and each cpu flushes its TLB the next time it
+ * activates an address space. Address spaces holding an ID from an
+ * older generation get a fresh one when they are next activated.
+ */
+struct asid_tracker {
+    struct spinlock at_lock;        /* lock to protect this struct */
+    uint32_t at_next;               /* next unused asid */
+    uint32_t at_generation;         /* current generation */
+};
+
+extern struct asid_tracker k_asid_tracker;
+
 /*
  * Functions in addrspace.c:
  *
@@ -107,6 +173,63 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_file - back the start of a region defined with
+ *                as_define_region with a file. Its pages are read in
+ *                from the file when they are first touched instead of
+ *                being zero-filled.
+ *
+ *    as_fault_pte - find the PTE for a page, filling it in from the
+ *                regions covering the page if it was never touched.
+ *                Fails with EFAULT if no region covers the page.
+ *
+ *    as_heap_end - return the current end of the heap.
+ *
+ *    as_load_page - fill in a physical page for a file-backed page of
+ *                the address space.
+ *
+ *    as_page_vnode - return the executable backing a page of the
+ *                address space, or NULL if the page is not part of a
+ *                program's segments.
+ *
+ *    as_page_shm - return the shared memory object a page of the
+ *                address space belongs to, and the page's index in it,
+ *                or NULL if the page is not in a shared anonymous region.
+ *
+ *    as_define_mmap - map LEN bytes of a file, or of zero-filled memory
+ *                if the vnode is NULL, at an address of the VM system's
+ *                choosing between the heap and the stack. Zero-filled
+ *                memory that is shared stays shared across fork.
+ *
+ *    as_unmap  - unmap every mmap region between VADDR and VADDR+LEN,
+ *                writing shared file pages back to their files.
+ *
+ *    as_release_range - give back the frames and swap blocks of the
+ *                pages between VADDR and VADDR+LEN. The pages stay
+ *                mapped and come back zero-filled, or read from their
+ *                file, when next touched. Pages of shared mappings are
+ *                left alone, since others may still see them.
+ *
+ *    as_tlb_cpus - return the mask of cpu numbers whose TLB may hold
+ *                entries of the address space. A cpu is added when it
+ *                first activates the address space and is never taken
+ *                out, so the mask is only ever too large.
+ *
+ *    as_tlbshootdown - send a shootdown to every cpu in as_tlb_cpus,
+ *                the current one included.
+ *
+ *    as_memstat - fill in the address space's counts, and count the
+ *                pages it has in memory and in swap. Swap-outs are
+ *                counted by whoever evicts the page, without the
+ *                address space lock, so they may come up a little short.
+ *
+ *    as_pin - keep an address space of another process from being
+ *                destroyed until as_unpin. Call it under the process's
+ *                p_lock, having read p_addrspace there; the address
+ *                space is only destroyed after being taken out of
+ *                p_addrspace under that lock.
+ *
+ *    as_unpin - let go of an address space pinned by as_pin.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -125,6 +248,29 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 struct vnode *v, off_t offset,
+                                 size_t filesize);
+int               as_load_page(struct addrspace *as, vaddr_t vaddr, int ppn);
+int               as_fault_pte(struct addrspace *as, vaddr_t vaddr,
+                               struct pt_entry **ret);
+vaddr_t           as_heap_end(struct addrspace *as);
+struct vnode     *as_page_vnode(struct addrspace *as, vaddr_t vaddr);
+struct shm_object *as_page_shm(struct addrspace *as, vaddr_t vaddr,
+                               unsigned *index);
+int               as_define_mmap(struct addrspace *as, size_t len,
+                                 int writeable, struct vnode *v,
+                                 off_t offset, bool shared,
+                                 vaddr_t *ret);
+int               as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_release_range(struct addrspace *as, vaddr_t vaddr,
+                                   size_t len);
+uint32_t          as_tlb_cpus(struct addrspace *as);
+void              as_tlbshootdown(struct addrspace *as,
+                                  struct tlbshootdown *t);
+void              as_memstat(struct addrspace *as, struct memstat *ms);
+void              as_pin(struct addrspace *as);
+void              as_unpin(struct addrspace *as);
 
 /*
  * zeros npages pages starting at the given virtual address
@@ -150,8 +296,8 @@ int pte_acquire(struct addrspace *as, struct pt_entry *pte);
 void pte_release(struct addrspace *as, struct pt_entry *pte, int ppn);
 
 /*
- *  cleans up page table
+ *  cleans up page table at page directory index pdi
  */
-void pgt_destroy(struct pgtable *pgt, struct addrspace *as);
+void pgt_destroy(struct pgtable *pgt, struct addrspace *as, int pdi);
 
 #endif /* _ADDRSPACE_H_ */
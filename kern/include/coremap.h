@@ -37,22 +37,93 @@
 #include <array.h>
 #include <types.h>
 
+struct shm_object;
+
+/*
+ *  Reverse mapping for a page that is shared by more than one address space.
+ *  The first mapping lives in the core map entry itself; the rest are
+ *  chained off of it.
+ */
+struct cm_rmap {
+    struct addrspace *rm_as;    /* address space that shares the page */
+    vaddr_t rm_vaddr;           /* the virtual address in that address space */
+    struct cm_rmap *rm_next;    /* next sharer */
+};
+
 /*
  *  Struct for a core map entry
+ *
+ *  The busy bit is what gives a thread ownership of a frame: only the
+ *  thread that set it may change the entry, or the PTEs that map the
+ *  frame. Every write to an entry, and every read of an entry the reader
+ *  doesn't own, happens under the lock of the entry's stripe.
  */
 struct cm_entry {
     struct addrspace *cme_as;   /* pointer to the address space that owns this page */
     vaddr_t cme_vaddr;          /* the virtual address in the address space */
     int cme_swap_location;      /* location of this page in the swap device */
-    struct cpu *cme_owner_cpu;  /* which cpu the thread which has this PTE runs on */
+    struct cm_rmap *cme_rmap;   /* other address spaces sharing this page */
+    struct vnode *cme_vnode;    /* executable a shared text page came from */
+    struct shm_object *cme_shm; /* shared anonymous object the page is in */
+    unsigned cme_shm_index;     /* which page of the object it is */
+    unsigned cme_refcount:16;   /* number of address spaces mapping this page */
+    unsigned cme_tlb:12;        /* number of tlb entries that map this page */
     unsigned cme_dirty:1;       /* whether page has been written to */
-    unsigned cme_tlb:1;         /* whether page is in tlb */
+    unsigned cme_readahead:1;   /* read in ahead of a fault, not used yet */
+    unsigned cme_referenced:1;  /* whether page was used since the clock passed */
+    unsigned cme_age:3;         /* clock passes since page was last used */
     unsigned cme_busy:1;        /* whether page is busy */
     unsigned cme_kernel:1;      /* whether page is in a contiguous kernel block */
     unsigned cme_kpage:1;       /* whether page belongs to the kernel */
     unsigned cme_exists:1;      /* whether page exists in ram */
 };
 
+/*
+ *  Sizes of the free frame bitmap and of its summary, which has one bit
+ *  for each word of the bitmap that has a free frame in it.
+ */
+#define CM_FREE_WORDS       ((RAM_PAGES + 31) / 32)
+#define CM_SUMMARY_WORDS    ((CM_FREE_WORDS + 31) / 32)
+
+/*
+ *  Most frames kept zeroed ahead of time, for first touches of stack and
+ *  heap pages and for kernel pages.
+ */
+#define CM_ZERO_POOL        32
+
+/*
+ *  Largest order of buddy block kernel allocations are placed in.
+ */
+#define CM_MAX_ORDER        10
+
+/*
+ *  Each order from 1 up has a bitmap with one bit for each aligned block
+ *  of that order, set while every frame in the block is free; order 0 is
+ *  the free map itself. A free frame sets the bit of its block at each
+ *  order whose other half is free too, and a taken frame clears them, so
+ *  blocks split and merge as frames come and go. The maps of all orders
+ *  together have fewer bits than there are frames, plus at most one
+ *  partly used word per order.
+ */
+#define CM_ORDER_WORDS(o)   (((RAM_PAGES >> (o)) + 31) / 32)
+#define CM_ORDER_MAP_WORDS  (CM_FREE_WORDS + CM_MAX_ORDER)
+
+/*
+ *  Frames are split into stripes by frame number, each with its own lock
+ *  and wait channels, so that faults on different frames don't contend.
+ *  A thread holds at most one stripe lock at a time, and never holds one
+ *  while sending tlb shootdowns.
+ */
+#define CM_STRIPES          16
+#define CM_STRIPE(ppn)      (&k_coremap->cm_stripes[(ppn) % CM_STRIPES])
+#define CM_LOCK(ppn)        (&CM_STRIPE(ppn)->cs_lock)
+
+struct cm_stripe {
+    struct spinlock cs_lock;    /* lock protecting the stripe's entries */
+    struct wchan *cs_wchan;     /* wait channel for the stripe's busy bits */
+    struct wchan *cs_tlb_wchan; /* wait channel for the stripe's tlb counts */
+};
+
 /*
  *  Struct of the core map.
  *  The core map is responsible for keeping track of physical pages
@@ -60,18 +131,115 @@ struct cm_entry {
  */
 struct coremap {
     struct cm_entry cm_entries[RAM_PAGES];  /* the core map entries */
-    struct spinlock cm_lock;                /* lock protecting this struct */
-    struct wchan *cm_wchan;                 /* wait channel for core map busy bits */
-    struct wchan *cm_tlb_wchan;             /* wait channel for core map tlb bits */
+    struct cm_stripe cm_stripes[CM_STRIPES]; /* locks for the entries */
+    struct spinlock cm_lock;                /* lock protecting the counts,
+                                               clock head and rmap entries */
     int cm_num_pages;                       /* number of existing pages */
     int cm_num_kpages;                      /* number of existing kernel pages */
     int cm_num_dirty;                       /* number of dirty paged */
     int cm_clock_head;                      /* clock head for paging algo */
+    struct cm_rmap *cm_rmap_free;           /* unused reverse mapping entries */
+    struct spinlock cm_free_lock;           /* lock protecting the free map */
+    uint32_t cm_free_map[CM_FREE_WORDS];    /* one bit for each free frame */
+    uint32_t cm_free_summary[CM_SUMMARY_WORDS]; /* nonempty cm_free_map words */
+    int cm_num_free;                        /* number of free frames */
+    uint32_t cm_order_map[CM_ORDER_MAP_WORDS]; /* free blocks of each order */
+    unsigned cm_order_base[CM_MAX_ORDER + 1]; /* where each order's map starts */
+    int cm_order_free[CM_MAX_ORDER + 1];    /* free blocks of each order */
+    struct spinlock cm_zero_lock;           /* lock protecting the zero pool */
+    int cm_zero_pool[CM_ZERO_POOL];         /* busy frames that are all zeroes */
+    int cm_num_zero;                        /* number of frames in the pool */
+    struct wchan *cm_zero_wchan;            /* where the zeroing thread waits */
 };
 
 /* This is the structure for the kernel coremap*/
 extern struct coremap *k_coremap;
 
+/*
+ *  Functions in coremap.c:
+ *
+ *    cm_unbusy - clear a frame's busy bit and wake up its waiters.
+ *
+ *    cm_set_dirty - mark a frame dirty or clean, keeping count of dirty
+ *                   frames. Assumes the frame's stripe lock is held.
+ *
+ *    cm_clock_tick - return the frame under the clock head, and advance
+ *                    the clock head.
+ *
+ *    cm_free_page - put a frame on the free map. The frame must exist and
+ *                   be neither busy, mapped, nor a kernel page.
+ *
+ *    cm_alloc_block - take npages contiguous frames off the free map,
+ *                     from the start of a buddy block: a block of the
+ *                     smallest power of two frames that holds them,
+ *                     aligned to its size. The smallest free block that
+ *                     isn't half of a larger free one is split, as a
+ *                     buddy allocator would. A single frame is simply
+ *                     the lowest free one. Returns the first frame, or
+ *                     -1 if there is no such block. The frames are left
+ *                     for the caller to set up.
+ *
+ *    cm_free_block - put npages contiguous frames back on the free map
+ *                    at once, where they join whatever free frames are
+ *                    next to them.
+ *
+ *    cm_pick_block - find the buddy block for npages frames that has
+ *                    the fewest user pages to evict, and nothing that
+ *                    can't be evicted. Returns the first frame, or -1.
+ *
+ *    cm_print_fragmentation - print free blocks of each order.
+ *
+ *    cm_get_page - take a frame from this cpu's cache of free frames,
+ *                  refilling the cache from the free map when it is
+ *                  empty. Never looks at frames that are in use.
+ *                  Returns the frame marked busy, or -1.
+ *
+ *    cm_put_page - give an unmapped, busy frame to this cpu's cache,
+ *                  draining part of the cache to the free map when it
+ *                  is full.
+ *
+ *    cm_drain_caches - give the frames in every cpu's cache back to the
+ *                      free map, for when it has run dry and frames
+ *                      are needed that some other cpu is sitting on.
+ *
+ *    cm_get_zeroed_page - take a frame from the pool of zeroed frames,
+ *                         waking the zeroing thread when the pool is
+ *                         half empty. Returns the frame marked busy, or
+ *                         -1 if the pool is empty.
+ *
+ *    cm_take_zeroed_page - the same, for callers that want any free
+ *                          frame and don't need it zeroed. These don't
+ *                          count as hits or misses of the pool.
+ *
+ *    cm_put_zeroed_page - add a zeroed, unmapped, busy frame to the pool.
+ *                         Returns false if the pool is full.
+ *
+ *    cm_zero_wait - sleep until the pool has room.
+ *
+ *    cm_drain_zero_pool - give every frame in the pool back to the free
+ *                         map, for block allocations that need them.
+ *
+ *  Frames in a cpu's cache or in the zero pool stay busy, so nothing
+ *  else touches them. The free map functions must be called without any
+ *  stripe lock held, and take the free map lock themselves.
+ */
+void cm_unbusy(int ppn);
+void cm_set_dirty(int ppn, bool dirty);
+int cm_clock_tick(void);
+void cm_free_page(int ppn);
+int cm_alloc_block(unsigned npages);
+void cm_free_block(int ppn, unsigned npages);
+int cm_pick_block(unsigned npages);
+void cm_print_fragmentation(void);
+int cm_get_page(void);
+void cm_put_page(int ppn);
+void cm_drain_caches(void);
+int cm_get_zeroed_page(void);
+int cm_take_zeroed_page(void);
+bool cm_put_zeroed_page(int ppn);
+void cm_zero_wait(void);
+void cm_drain_zero_pool(void);
+
 
 
 #endif /* _COREMAP_H_ */
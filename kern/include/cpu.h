@@ -36,6 +36,14 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 #include <limits.h>
 
+/*
+ * Each cpu keeps a few free page frames of its own so that most frame
+ * allocations and frees don't touch the coremap's free map. Frames move
+ * between the cache and the free map CPU_FRAME_BATCH at a time, and
+ * other cpus drain the whole cache when the free map runs dry.
+ */
+#define CPU_FRAME_CACHE 16
+#define CPU_FRAME_BATCH 8
 
 /*
  * Per-cpu structure
@@ -62,6 +70,9 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	uint32_t c_asid;		/* ASID loaded in the TLB */
+	uint32_t c_asid_gen;		/* ASID generation of the TLB */
+	unsigned c_tlb_entries;		/* Valid entries in the TLB */
 
 	/*
 	 * Accessed by other cpus.
@@ -71,6 +82,21 @@ struct cpu {
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Accessed by other cpus.
+	 * Protected by the frame cache lock.
+	 */
+	int c_frames[CPU_FRAME_CACHE];	/* Free frames cached on this cpu */
+	unsigned c_numframes;		/* Number of cached frames */
+	struct spinlock c_frame_lock;
+
+	/*
+	 * Accessed by other cpus.
+	 * Protected by the swap map lock.
+	 */
+	int c_swap_next;		/* Next swap block reserved here */
+	unsigned c_swap_left;		/* Swap blocks still reserved here */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -116,6 +142,13 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * cpu_count returns the number of cpus, and cpu_get the cpu with a
+ * given software number, for code that has to visit every cpu.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned software_number);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -159,6 +192,10 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast is like ipi_broadcast but carries TLB
+ * shootdown data.
+ * ipi_tlbshootdown_mask sends TLB shootdown data to the CPUs whose
+ * numbers are set in a mask, except the current one.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -173,6 +210,9 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_mask(uint32_t cpumask,
+			   const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
@@ -30,12 +30,40 @@
 #ifndef _DAEMON_H_
 #define _DAEMON_H_
 
-#define PAGING_DAEMON_THRESHOLD 95
+#include <spinlock.h>
 
-/* Thread that writes pages to swap */
+/* Percentages of user frames: below LOW free frames, faults wake the
+ * daemon, which then frees frames until HIGH of them are free */
+#define PAGING_DAEMON_LOW 5
+#define PAGING_DAEMON_HIGH 10
+
+/* Frames the daemon frees before it lets other threads run */
+#define PAGING_DAEMON_BATCH 16
+
+/*
+ * State for waking the daemon. The fault path can't sleep on a lock
+ * before it knows it needs to evict, so the daemon waits on a wait
+ * channel under a spinlock instead of on a cv.
+ */
+struct paging_daemon {
+    struct spinlock pd_lock;    /* lock protecting pd_kicked */
+    struct wchan *pd_wchan;     /* where the daemon waits; NULL until it runs */
+    bool pd_kicked;             /* whether the daemon has been woken */
+};
+
+extern struct paging_daemon k_paging_daemon;
+
+/* Thread that evicts pages to keep frames free */
 void paging_daemon_thread(void *data1, unsigned long data2);
 
-/* Function for kicking off the daemon proc */
+/* Wakes the daemon if free frames are below the low watermark */
+void daemon_kick(void);
+
+/* Thread that keeps the coremap's pool of zeroed frames full, zeroing
+ * only while its cpu has nothing else to run */
+void zero_thread(void *data1, unsigned long data2);
+
+/* Function for kicking off the daemon proc and its threads */
 void daemon_init(void);
  
 #endif /* _DAEMON_H_ */
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2004, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_MEMSTAT_H_
+#define _KERN_MEMSTAT_H_
+
+/*
+ * Memory use and paging activity of a process, as returned by
+ * memstat().
+ *
+ * A page fault is minor if nothing had to be read in to handle it: a
+ * zero-filled page, a copy-on-write copy, or a page another process
+ * already had in memory. It is major if the page was read in from swap
+ * or from a file. A tlb fault only reloads the tlb for a page that was
+ * already mapped.
+ *
+ * Page faults are also counted by how long they took: bucket i counts
+ * the faults that took less than 16 << (2 * i) microseconds, that is
+ * 16us, 64us, 256us, ... up to 64ms; the last bucket counts the rest.
+ */
+
+#define MS_LATENCY_BUCKETS 8
+
+struct memstat {
+	__u32 ms_resident;      /* pages mapped in memory right now */
+	__u32 ms_swapped;       /* pages only in swap right now */
+	__u32 ms_tlb_faults;    /* faults that only refilled the tlb */
+	__u32 ms_minor_faults;  /* page faults that read nothing in */
+	__u32 ms_major_faults;  /* page faults that read from swap or a file */
+	__u32 ms_swapins;       /* pages read in from swap */
+	__u32 ms_swapouts;      /* pages written out to swap */
+	__u32 ms_latency[MS_LATENCY_BUCKETS]; /* page faults by time taken */
+};
+
+#endif /* _KERN_MEMSTAT_H_ */
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Consts for mmap(), munmap() and madvise(), for libc's <sys/mman.h>.
+ */
+
+/* Protections: PROT_NONE, or any of the others or'd together */
+#define PROT_NONE     0      /* Pages can't be accessed */
+#define PROT_READ     1      /* Pages can be read */
+#define PROT_WRITE    2      /* Pages can be written */
+#define PROT_EXEC     4      /* Pages can be executed */
+
+/* Flags: choose one of these: */
+#define MAP_SHARED    1      /* Changes are shared with the file or children */
+#define MAP_PRIVATE   2      /* Changes are private to the process */
+/* then or in any of these: */
+#define MAP_ANON      4      /* Zero-filled memory instead of a file */
+
+/* Additional related definitions */
+#define MAP_TYPE      3      /* mask for MAP_SHARED/MAP_PRIVATE */
+#define MAP_ANONYMOUS MAP_ANON
+
+/* Advice for madvise() */
+#define MADV_NORMAL   0      /* No special treatment */
+#define MADV_DONTNEED 4      /* Contents can go; the pages read as new again */
+#define MADV_FREE     5      /* Same as MADV_DONTNEED here */
+
+
+#endif /* _KERN_MMAN_H_ */
@@ -59,7 +59,7 @@
 #define SYS_mmap         8
 #define SYS_munmap       9
 #define SYS_mprotect     10
-//#define SYS_madvise    11
+#define SYS_madvise     11
 //#define SYS_mincore    12
 //#define SYS_mlock      13
 //#define SYS_munlock    14
@@ -196,6 +196,7 @@
 #define SYS_sync         118
 #define SYS_reboot       119
 //#define SYS___sysctl   120
+#define SYS_memstat      121
 
 /*CALLEND*/
 
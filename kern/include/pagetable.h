@@ -43,7 +43,9 @@ struct pt_entry {
     unsigned pte_writeable:1;   /* is page writeable */
     unsigned pte_present:1;     /* is page in phys ram */
     unsigned pte_zeroed:1;      /* is page zeroed */
-    unsigned pte_padding:8;     /* padding */
+    unsigned pte_cow:1;         /* is page shared copy-on-write */
+    unsigned pte_file:1;        /* is page still to be read from a file or shm */
+    unsigned pte_padding:6;     /* padding */
 };
 
 /*
@@ -31,6 +31,10 @@
 #define _PAGING_H_
 
 #include <types.h>
+#include <pagetable.h>
+
+struct addrspace;
+struct cm_rmap;
 
 /*
  * Paging-related definitions.
@@ -39,14 +43,26 @@
 #define USE_CLOCK_PAGING
 //#define USE_LAST_CLEAN_PAGING
 
+/* Sharers of a page past which evicting it flushes whole tlbs */
+#define PAGE_EVICT_MAX_SHOOTDOWNS 4
+
+/* Frames past the clock head that eviction looks through for dirty pages
+ * to write out along with its victim */
+#define PAGE_CLUSTER_SCAN 32
+
+/* Clock passes a page can age without being used before its age stops
+ * counting up; it fits in cme_age */
+#define PAGE_AGE_MAX 7
 
-/* Page fault handler. Returns 0 on success. 
+
+/* Page fault handler. Returns 0 on success, with the page busy.
  * 
- * Assumes address space and coremap locks are held. 
+ * Assumes the address space lock is held, and no coremap locks.
  */
 int page_fault(vaddr_t faultaddress);
 
-/* Swaps a page into memory. Returns 0 */
+/* Brings a page into memory, from swap, from the file backing it, or
+ * zero-filled. Returns 0, with the page busy */
 int page_swapin(vaddr_t vaddress);
 
 /* Page eviction handler. Returns a free ppn.
@@ -57,17 +73,103 @@ int page_swapin(vaddr_t vaddress);
  *
  * The returned ppn will always be marked as busy in the coremap.
  * 
- * Assumes address space and coremap locks are held.
+ * Assumes no coremap locks are held.
  */
 int page_get(unsigned from_page_fault);
 
+/* Evicts a page with the page eviction algorithm, writing it to swap if
+ * it's dirty, and returns its ppn marked busy, or -1.
+ *
+ * Assumes no coremap locks are held.
+ */
+int page_evict(unsigned from_page_fault);
+
+/* Evicts the page in a given frame, if it is a user page that can be
+ * evicted, and returns the ppn marked busy; otherwise returns -1.
+ *
+ * Assumes no coremap locks are held.
+ */
+int page_evict_frame(int ppn);
+
 /* Writes a physical page out to swap, and updates corresponding coremap entry.
  * If the page has no swap location, it first finds a free swap location for it.
  * Assumes busy bit is already set high.
  *
- * Returns 0 on success. Assumes address space and coremap locks are held.
- * These locks will be released when writing out the page.
+ * Returns 0 on success. Assumes no coremap locks are held.
  */
 int page_write_out(int ppn);
 
+/* Writes a batch of dirty pages out to swap, as few transfers as possible.
+ * The pages are moved to a contiguous run of fresh swap blocks, giving up
+ * the blocks they had. Assumes the pages are busy, and are not text pages.
+ *
+ * Returns 0 if at least the first page was written; pages swap had no
+ * room for are left dirty. Returns ENOMEM if swap is full. Assumes no
+ * coremap locks are held.
+ */
+int page_write_cluster(const int *ppns, unsigned npages);
+
+/* Breaks copy-on-write sharing of the page mapped at vaddress, giving the
+ * current address space its own copy. If it is the last address space
+ * sharing the page, the page is simply handed over.
+ *
+ * Returns 0 on success. Assumes the address space lock is held, and that
+ * the shared page is busy. The PTE is updated to the new page, which is
+ * returned busy; the shared page is no longer busy.
+ */
+int page_cow_break(vaddr_t vaddress, struct pt_entry *pte);
+
+/* Adds a copy-on-write mapping of a resident page to an address space,
+ * using the given reverse mapping entry.
+ *
+ * Assumes the page is busy.
+ */
+void page_share(int ppn, struct addrspace *as, vaddr_t vaddr,
+    struct cm_rmap *rm);
+
+/* Drops an address space's mapping of a resident page. When no other
+ * address space shares the page, it is freed along with its swap block.
+ *
+ * Assumes the page is busy, and no coremap locks are held.
+ */
+void page_unmap(int ppn, struct addrspace *as, vaddr_t vaddr);
+
+/* Returns whether the address space maps the resident page.
+ *
+ * Assumes the page is busy or its stripe lock is held.
+ */
+bool page_mapped_by(int ppn, struct addrspace *as);
+
+/* Shoots down every tlb entry that maps the page, and waits for the
+ * shootdowns to finish.
+ *
+ * Assumes the page is busy, and no spinlocks are held.
+ */
+void page_tlb_evict(int ppn);
+
+/* Shoots down every tlb entry that maps any of a batch of pages, with one
+ * shootdown per cpu, and waits for the shootdowns to finish.
+ *
+ * Assumes the pages are busy, and no spinlocks are held.
+ */
+void page_tlb_evict_batch(const int *ppns, unsigned npages);
+
+/* Shoots down the tlb entries for a range of an address space's pages,
+ * or every entry of the address space if the range is large, without
+ * waiting for the shootdowns to finish.
+ *
+ * Assumes the address space lock is held.
+ */
+void page_tlb_evict_range(struct addrspace *as, vaddr_t vaddr,
+    unsigned npages);
+
+/* Gets an unused reverse mapping entry. Returns NULL when out of memory.
+ *
+ * Must not be called with the coremap lock held.
+ */
+struct cm_rmap *rmap_create(void);
+
+/* Gives back a reverse mapping entry. */
+void rmap_destroy(struct cm_rmap *rm);
+
 #endif /* _PAGING_H_ */
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <types.h>
+#include <synch.h>
+
+/*
+ * Anonymous memory mapped MAP_SHARED. The pages belong to a shared
+ * memory object rather than to any one address space; every region
+ * mapping the object, in the process that made it and in the children
+ * it forks, sees the same frames.
+ *
+ * An object keeps track of where each of its pages is: in a frame, in
+ * a swap block, or nowhere yet, in which case it is zero-filled on
+ * first touch. A resident page is mapped like any shared frame,
+ * through the coremap entry and its reverse mappings, with cme_shm
+ * set. Evicting it points every PTE that maps it back at the object,
+ * and the object takes over its swap block.
+ *
+ * A page that the last of its mappers unmaps while other regions
+ * still hold the object is written out, and the object takes over its
+ * swap block as on eviction. Only when swap can't take it does the
+ * frame stay in memory, owned by the object alone, until one of the
+ * holders touches the page again or the object goes away.
+ */
+
+struct shm_page {
+    int sp_ppn;                 /* frame holding the page, or 0 */
+    int sp_swap;                /* swap block holding the page, or 0 */
+};
+
+struct shm_object {
+    struct lock *so_lock;       /* lock serializing faults on the pages */
+    unsigned so_npages;         /* length of the object */
+    unsigned so_refs;           /* regions mapping the object */
+    struct shm_page *so_pages;  /* where each page is */
+};
+
+/*
+ * Functions in shm.c:
+ *
+ *    shm_create - make an object of npages pages, none of them touched
+ *                 yet, held by one region. Returns NULL if out of memory.
+ *
+ *    shm_retain - add a region holding the object, as when a process
+ *                 with a mapping forks.
+ *
+ *    shm_release - drop a region's hold on the object, after every page
+ *                  the region mapped has been unmapped. The last one
+ *                  frees the frames and swap blocks the object kept.
+ *
+ *  sp_ppn and sp_swap only change under the object lock, or under the
+ *  stripe lock of the frame in sp_ppn when the frame is evicted or
+ *  freed. The object lock is never taken with a stripe lock or a busy
+ *  frame held.
+ */
+struct shm_object *shm_create(unsigned npages);
+void shm_retain(struct shm_object *so);
+void shm_release(struct shm_object *so);
+
+#endif /* _SHM_H_ */
@@ -35,15 +35,34 @@
 #include <types.h>
 #include <spinlock.h>
 
+/* Most pages moved to or from swap in one transfer */
+#define SWAP_CLUSTER 8
+
 
 /*
- * Data structure for tracking the swap space
+ * Data structure for tracking the swap space. Reads and writes of swap
+ * blocks go through the compressed cache in zcache.h first.
+ *
+ * Swap is split into aligned clusters of SWAP_CLUSTER blocks, and the
+ * number of free blocks in each is kept, so that searches skip full
+ * clusters and wholly free ones can be found without looking at the
+ * bitmap. Cpus reserve wholly free clusters and hand their blocks out
+ * without searching; see cpu.h. Only when no cluster is wholly free
+ * are runs pieced together from the partly free ones, after taking
+ * back the blocks the cpus reserved and haven't used.
  */
 struct swap_tracker {
     struct bitmap *st_bitmap;  /* Bitmap to keep track of used blocks */
+    uint16_t *st_refs;         /* Number of references to each block */
     struct spinlock st_lock;   /* Lock for this structure */
     struct vnode *st_vnode;    /* vnode of the swap device */
     int st_size;               /* number of blocks */
+    uint8_t *st_cluster_free;  /* free blocks in each cluster */
+    int st_nclusters;          /* number of clusters */
+    int st_free_clusters;      /* clusters with every block free */
+    int st_free;               /* free blocks */
+    int st_reserved;           /* blocks reserved by cpus but not used */
+    int st_next;               /* cluster the next search starts at */
 };
 
 
@@ -54,11 +73,27 @@ void swap_init(struct swap_tracker **swap);
 
 
 /*
- * Finds and returns the index of a free block.
+ * Finds and returns the index of a free block, or -1 if swap is full.
  */
 off_t swap_find_free(struct swap_tracker *swap);
 
 
+/*
+ * Finds a run of up to npages contiguous free blocks and takes them.
+ * Returns the index of the first block, and the length of the run in
+ * got; the run is shorter than asked for when swap has no longer one.
+ * Returns -1 if swap is full.
+ */
+off_t swap_find_run(struct swap_tracker *swap, unsigned npages,
+    unsigned *got);
+
+
+/*
+ * Print how full and how fragmented swap is.
+ */
+void swap_print_stats(struct swap_tracker *swap);
+
+
 /*
  * Read from the swap location into the designated ppn.
  */
@@ -72,11 +107,41 @@ int swap_write(int ppn, int swap_location, struct swap_tracker *swap);
 
 
 /*
- * Free up a block in swap space.
+ * Read a run of blocks starting at the swap location into the
+ * designated ppns, in one transfer.
+ */
+int swap_read_run(const int *ppns, unsigned npages, int swap_location,
+    struct swap_tracker *swap);
+
+
+/*
+ * Write the physical pages into a run of blocks starting at the swap
+ * location, in one transfer.
+ */
+int swap_write_run(const int *ppns, unsigned npages, int swap_location,
+    struct swap_tracker *swap);
+
+
+/*
+ * Drop a reference to a block in swap space. The block is freed once
+ * nothing refers to it.
  */
 void swap_destroy_block(int swap_location, struct swap_tracker *swap);
 
 
+/*
+ * Add a reference to a block in swap space.
+ */
+void swap_share_block(int swap_location, struct swap_tracker *swap);
+
+
+/*
+ * Drop a reference to a block only if it is shared. Returns true if a
+ * reference was dropped.
+ */
+bool swap_unshare_block(int swap_location, struct swap_tracker *swap);
+
+
 /* This is the structure for the kernel swap tracker */
 extern struct swap_tracker *k_swap_tracker;
 
@@ -79,6 +79,11 @@ int sys_dup2(int oldfd, int newfd, int *retval);
 int sys_chdir(const_userptr_t pathname);
 int sys__getcwd(userptr_t buf, size_t buflen, int *retval);
 int sys_sbrk(int amount, int *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+             off_t offset, int *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_madvise(userptr_t addr, size_t len, int advice);
+int sys_memstat(pid_t pid, userptr_t buf);
 
 int sys_sync(void);
 int sys_mkdir(userptr_t path, mode_t mode);
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TEXTCACHE_H_
+#define _TEXTCACHE_H_
+
+#include <types.h>
+#include <spinlock.h>
+
+struct vnode;
+
+/*
+ * Cache of the resident pages of executables' read-only segments, so
+ * that every process running a program maps the same frames. A page
+ * is known by the executable's vnode and its virtual address, which
+ * is the same in every process running the program.
+ *
+ * A cached frame is mapped like any shared frame, through the coremap
+ * entry and its reverse mappings, and its cme_vnode is set. It stays
+ * cached as long as something maps it. Evicting it writes nothing to
+ * swap; its PTEs go back to being read in from the file.
+ */
+
+#define TC_BUCKETS 64
+
+struct tc_entry {
+    struct vnode *tce_vnode;    /* the executable */
+    vaddr_t tce_vaddr;          /* virtual address of the page */
+    int tce_ppn;                /* frame holding the page */
+    struct tc_entry *tce_next;  /* next entry in the bucket */
+};
+
+struct textcache {
+    struct spinlock tc_lock;                /* lock protecting the buckets */
+    struct tc_entry *tc_buckets[TC_BUCKETS]; /* hash chains */
+};
+
+extern struct textcache k_textcache;
+
+/*
+ * Functions in textcache.c:
+ *
+ *    textcache_init - set up the empty cache.
+ *
+ *    textcache_get - find the frame holding a page and mark it busy,
+ *                    waiting for it if it is busy. Returns the frame,
+ *                    or -1 if the page isn't cached.
+ *
+ *    textcache_add - cache a busy frame that was just read in. Does
+ *                    nothing if the page is already cached, as when
+ *                    two processes read it in at once, or if there is
+ *                    no memory for the entry; the frame then stays
+ *                    private to the process that read it.
+ *
+ *    textcache_remove - take a busy frame out of the cache, if it is
+ *                       the one cached for its page.
+ *
+ *  The cache lock is never held with a stripe lock.
+ */
+void textcache_init(void);
+int textcache_get(struct vnode *v, vaddr_t vaddr);
+void textcache_add(struct vnode *v, vaddr_t vaddr, int ppn);
+void textcache_remove(int ppn);
+
+#endif /* _TEXTCACHE_H_ */
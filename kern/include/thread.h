@@ -176,6 +176,13 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Return whether no other thread is waiting to run on the current cpu,
+ * so that a background thread can do its work only when the cpu would
+ * otherwise idle. The answer may be stale by the time it's used.
+ */
+bool thread_cpu_idle(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
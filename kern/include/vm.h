@@ -61,4 +61,10 @@ void free_kpages(vaddr_t addr);
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Adds a shootdown to a cpu's queue of *num shootdowns, merging it with
+ * the last one or coalescing the queue into a flush when it can't be
+ * added. Called from ipi_tlbshootdown with the cpu's ipi lock held. */
+void vm_tlbshootdown_queue(struct tlbshootdown *queue, unsigned *num,
+    const struct tlbshootdown *);
+
 #endif /* _VM_H_ */
@@ -32,12 +32,50 @@
 
 #include <types.h>
 
+struct memstat;
+struct timespec;
+
 struct vmstats {
     uint32_t vms_page_faults;       /* number of page faults */
     uint32_t vms_write_page_faults; /* number of page faults that require a sync write */
     uint32_t vms_vm_faults;         /* number of vm faults */
     uint32_t vms_daemon_runs;       /* number of times the daemon ran */
+    uint32_t vms_daemon_frees;      /* frames the daemon freed */
     uint32_t vms_tlb_shootdowns;    /* number of TLB shootdowns */
+    uint32_t vms_tlb_ipis;          /* shootdowns sent to other cpus */
+    uint32_t vms_tlb_ipi_entries;   /* mappings carried by those shootdowns */
+    uint32_t vms_tlb_coalesced;     /* full queues turned into tlb flushes */
+    uint32_t vms_cow_faults;        /* number of copy-on-write page copies */
+    uint32_t vms_fork_swap_shares;  /* swapped pages a fork shared in swap */
+    uint32_t vms_tlb_flushes_avoided; /* context switches that kept the tlb */
+    uint32_t vms_tlb_entries_kept;  /* tlb entries kept across those switches */
+    uint32_t vms_tlb_fast_refills;  /* tlb misses refilled without locking */
+    uint32_t vms_frame_cache_hits;  /* frames taken from a cpu's frame cache */
+    uint32_t vms_frame_cache_refills; /* frame cache refills from the free map */
+    uint32_t vms_frame_cache_drains; /* frame cache drains to the free map */
+    uint32_t vms_file_page_faults;  /* pages read in from executables */
+    uint32_t vms_text_shares;       /* faults that mapped a cached text page */
+    uint32_t vms_text_drops;        /* text pages evicted without a write */
+    uint32_t vms_shm_shares;        /* faults that mapped a resident shared page */
+    uint32_t vms_shm_faults;        /* shared pages read in or zero-filled */
+    uint32_t vms_advise_frees;      /* frames given back through madvise */
+    uint32_t vms_advise_swap_frees; /* swap blocks given back through madvise */
+    uint32_t vms_swap_writes;       /* transfers to the swap device */
+    uint32_t vms_swap_pages_written; /* pages written in those transfers */
+    uint32_t vms_swap_full;         /* swap allocations that found no room */
+    uint32_t vms_zcache_stores;     /* pages kept in the compressed cache */
+    uint32_t vms_zcache_same_filled; /* of those, pages of one repeated word */
+    uint32_t vms_zcache_bytes;      /* compressed bytes of those pages */
+    uint32_t vms_zcache_rejects;    /* pages that didn't compress */
+    uint32_t vms_zcache_hits;       /* swap reads served from the cache */
+    uint32_t vms_zcache_writebacks; /* cached pages written to disk for room */
+    uint32_t vms_readaround_pages;  /* pages read in along with a swap fault */
+    uint32_t vms_readaround_hits;   /* of those, pages that got used */
+    uint32_t vms_readaround_waste;  /* of those, pages dropped unused */
+    uint32_t vms_clock_clean_evictions; /* unused clean pages the clock took */
+    uint32_t vms_zero_pool_hits;    /* frames taken already zeroed */
+    uint32_t vms_zero_pool_misses;  /* zero-fills that found the pool empty */
+    uint32_t vms_kpage_evictions;   /* user pages evicted to make kernel blocks */
 
 };
 
@@ -50,6 +88,12 @@ int vmstats_report(int n, char **a);
 /* reset the stats counter */
 int vmstats_reset(int n, char **a);
 
+/* print every process's memory use and paging counts */
+int vmstats_proc_report(int n, char **a);
+
+/* count a page fault that started at START in a latency histogram */
+void vmstats_fault_latency(struct memstat *ms, const struct timespec *start);
+
 
 extern struct vmstats k_vmstats;
  
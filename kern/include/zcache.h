@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _ZCACHE_H_
+#define _ZCACHE_H_
+
+#include <types.h>
+
+struct lock;
+struct bitmap;
+struct vnode;
+
+/*
+ * Compressed cache in front of the swap device. A page written to swap
+ * is compressed into a pool in memory instead of going to the disk, and
+ * only goes to the disk when the pool needs room for newer pages. A
+ * page full of one repeated word, like a zero-filled one, takes up no
+ * room in the pool at all.
+ *
+ * The cache holds the contents of swap blocks; blocks are still handed
+ * out by the swap tracker. A cached block is known by its swap location
+ * and stays cached until it is freed or written back to the disk.
+ *
+ * Pages are compressed a word at a time against a small dictionary of
+ * recently seen words, which suits the integer data most of our pages
+ * hold. A page that doesn't shrink to ZC_MAX_LEN bytes goes straight to
+ * the disk.
+ */
+
+#define ZC_POOL_FRACTION 16         /* pool is this fraction of memory */
+#define ZC_CHUNK 64                 /* bytes of pool handed out at once */
+#define ZC_MAX_LEN (PAGE_SIZE * 3 / 4) /* longest compressed page kept */
+
+struct zc_entry {
+    int ze_location;                /* swap block, or 0 if unused */
+    unsigned ze_chunk;              /* first chunk of the data */
+    unsigned ze_len;                /* compressed length; 0 if same-filled */
+    uint32_t ze_fill;               /* word a same-filled page repeats */
+    int ze_prev;                    /* next older entry, or -1 */
+    int ze_next;                    /* next newer or free entry, or -1 */
+};
+
+struct zcache {
+    struct lock *zc_lock;           /* lock protecting the cache */
+    char *zc_pool;                  /* compressed pages */
+    struct bitmap *zc_chunks;       /* chunks of the pool in use */
+    unsigned zc_nchunks;            /* chunks in the pool */
+    struct zc_entry *zc_entries;    /* one per cached page */
+    unsigned zc_nentries;           /* size of zc_entries */
+    int zc_free;                    /* list of unused entries */
+    int zc_oldest;                  /* least recently cached page */
+    int zc_newest;                  /* most recently cached page */
+    int *zc_index;                  /* entry of each swap block, or -1 */
+    int zc_nblocks;                 /* size of zc_index */
+    char *zc_buf;                   /* where pages are compressed to */
+    char *zc_page;                  /* where pages are written back from */
+    struct vnode *zc_vnode;         /* the swap device */
+};
+
+extern struct zcache k_zcache;
+
+/*
+ * Functions in zcache.c:
+ *
+ *    zcache_init - set up an empty cache in front of a swap device of
+ *                  NBLOCKS blocks.
+ *
+ *    zcache_store - cache the contents of frame PPN as swap block
+ *                   LOCATION, writing older pages back to the disk to
+ *                   make room. Returns false if the page doesn't
+ *                   compress and has to be written to the disk; any
+ *                   older copy of the block is dropped either way.
+ *
+ *    zcache_load - fill frame PPN from swap block LOCATION. Returns
+ *                  false if the block isn't cached. The block stays
+ *                  cached, since the frame may be evicted again without
+ *                  being written to.
+ *
+ *    zcache_drop - forget swap block LOCATION, which is being freed.
+ *
+ *  The cache lock is a sleep lock, since making room writes to the
+ *  disk; none of these may be called holding a spinlock.
+ */
+void zcache_init(struct vnode *v, int nblocks);
+bool zcache_store(int location, int ppn);
+bool zcache_load(int location, int ppn);
+void zcache_drop(int location);
+
+#endif /* _ZCACHE_H_ */
@@ -45,6 +45,7 @@
 #include <syscall.h>
 #include <test.h>
 #include <vmstats.h>
+#include <coremap.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -479,6 +480,7 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	cm_print_fragmentation();
 
 	return 0;
 }
@@ -567,6 +569,7 @@ static const char *opsmenu[] = {
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
 	"[vmstats] Print the vm stats        ",
+	"[procvm]  Print per-process vm stats",
 	"[debug]   Drop to debugger          ",
 	"[panic]   Intentional panic         ",
 	"[deadlock] Intentional deadlock     ",
@@ -692,6 +695,7 @@ static struct {
     { "vmstats",vmstats_report},
     { "vms",    vmstats_report},
     { "clearvms",vmstats_reset},
+    { "procvm", vmstats_proc_report},
 
 
 #if OPT_SYNCHPROBS
@@ -200,8 +200,10 @@ proc_destroy(struct proc *proc)
 			as_deactivate();
 		}
 		else {
+			spinlock_acquire(&proc->p_lock);
 			as = proc->p_addrspace;
 			proc->p_addrspace = NULL;
+			spinlock_release(&proc->p_lock);
 		}
 		as_destroy(as);
 	}
@@ -165,8 +165,8 @@ sys_execv(const_userptr_t program, userptr_t args) {
     /* Define the user stack in the address space */
     result = as_define_stack(new_as, &stackptr);
     if (result) {
-        as_destroy(new_as);
         switch_as(old_as);
+        as_destroy(new_as);
         cb_release(k_proctable->pt_cb);
         return result;
     }
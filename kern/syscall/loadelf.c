@@ -42,8 +42,8 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Segments are not read in here; load_segment maps each one onto the
+ * file and the VM system pages it in on demand.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -52,6 +52,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -69,20 +70,19 @@
  * FILESIZE may be less than MEMSIZE; if so the remaining portion of
  * the in-memory segment should be zero-filled.
  *
- * Note that uiomove will catch it if someone tries to load an
- * executable whose load address is in kernel space. If you should
- * change this code to not use uiomove, be sure to check for this case
- * explicitly.
+ * Nothing is read here. The segment is recorded as backed by the file,
+ * and each page of it is read in by the VM system the first time the
+ * program touches it. Pages past the end of the file data are zero-
+ * filled on demand like any other fresh page. as_define_region has
+ * already refused load addresses in kernel space.
  */
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
 	     off_t offset, vaddr_t vaddr,
-	     size_t memsize, size_t filesize,
-	     int is_executable)
+	     size_t memsize, size_t filesize)
 {
-	struct iovec iov;
-	struct uio u;
+	struct stat st;
 	int result;
 
 	if (filesize > memsize) {
@@ -90,59 +90,24 @@ load_segment(struct addrspace *as, struct vnode *v,
 		filesize = memsize;
 	}
 
-	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes to 0x%lx\n",
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
-	iov.iov_ubase = (userptr_t)vaddr;
-	iov.iov_len = memsize;		 // length of the memory space
-	u.uio_iov = &iov;
-	u.uio_iovcnt = 1;
-	u.uio_resid = filesize;          // amount to read from the file
-	u.uio_offset = offset;
-	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = as;
-
-	result = VOP_READ(v, &u);
+	/*
+	 * Check now that the file holds the whole segment; faulting
+	 * on a page past its end later would have no good answer.
+	 */
+	result = VOP_STAT(v, &st);
 	if (result) {
 		return result;
 	}
-
-	if (u.uio_resid != 0) {
+	if (offset + (off_t)filesize > st.st_size) {
 		/* short read; problem with executable? */
 		kprintf("ELF: short read on segment - file truncated?\n");
 		return ENOEXEC;
 	}
 
-	/*
-	 * If memsize > filesize, the remaining space should be
-	 * zero-filled. There is no need to do this explicitly,
-	 * because the VM system should provide pages that do not
-	 * contain other processes' data, i.e., are already zeroed.
-	 *
-	 * During development of your VM system, it may have bugs that
-	 * cause it to (maybe only sometimes) not provide zero-filled
-	 * pages, which can cause user programs to fail in strange
-	 * ways. Explicitly zeroing program BSS may help identify such
-	 * bugs, so the following disabled code is provided as a
-	 * diagnostic tool. Note that it must be disabled again before
-	 * you submit your code for grading.
-	 */
-#if 0
-	{
-		size_t fillamt;
-
-		fillamt = memsize - filesize;
-		if (fillamt > 0) {
-			DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n",
-			      (unsigned long) fillamt);
-			u.uio_resid += fillamt;
-			result = uiomovezeros(fillamt, &u);
-		}
-	}
-#endif
-
-	return result;
+	return as_define_file(as, vaddr, v, offset, filesize);
 }
 
 /*
@@ -259,7 +224,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	}
 
 	/*
-	 * Now actually load each segment.
+	 * Now map each segment onto the file.
 	 */
 
 	for (i=0; i<eh.e_phnum; i++) {
@@ -289,8 +254,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		}
 
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
-				      ph.p_memsz, ph.p_filesz,
-				      ph.p_flags & PF_X);
+				      ph.p_memsz, ph.p_filesz);
 		if (result) {
 			return result;
 		}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <limits.h>
+#include <syscall.h>
+#include <current.h>
+#include <proc.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <kern/errno.h>
+#include <kern/memstat.h>
+
+/*
+ * Copies out the memory use and paging counts of a process, or of the
+ * calling process if PID is 0
+ */
+int
+sys_memstat(pid_t pid, userptr_t buf) {
+    if (pid == 0) {
+        pid = curproc->p_pid;
+    }
+    if (pid < PID_MIN || pid >= PID_MAX) {
+        return ESRCH;
+    }
+
+    /* The process table lock keeps the process around while we find
+     * its address space, and the pin keeps the address space from
+     * being destroyed while we look at it */
+    struct memstat ms;
+    lock_acquire(k_proctable->pt_lock);
+    struct proc *p = k_proctable->pt_procs[pid % PROC_MAX];
+    if (p == NULL || p->p_pid != pid) {
+        lock_release(k_proctable->pt_lock);
+        return ESRCH;
+    }
+    spinlock_acquire(&p->p_lock);
+    struct addrspace *as = p->p_addrspace;
+    if (as != NULL) {
+        as_pin(as);
+    }
+    spinlock_release(&p->p_lock);
+    lock_release(k_proctable->pt_lock);
+    if (as == NULL) {
+        return ESRCH;
+    }
+    as_memstat(as, &ms);
+    as_unpin(as);
+
+    return copyout(&ms, buf, sizeof(struct memstat));
+}
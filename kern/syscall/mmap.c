@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <syscall.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <filetable.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+
+/*
+ * Maps a file, or zero-filled memory, into the address space
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+         off_t offset, int *retval) {
+
+    /* The address is only a hint, and we don't take hints */
+    (void) addr;
+
+    if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+        return EINVAL;
+    }
+    int type = flags & MAP_TYPE;
+    if (type != MAP_SHARED && type != MAP_PRIVATE) {
+        return EINVAL;
+    }
+    /* Pages are always readable, so there is no way to map them
+     * PROT_NONE */
+    if (prot == PROT_NONE ||
+        (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+        return EINVAL;
+    }
+    bool shared = (type == MAP_SHARED);
+    bool writeable = (prot & PROT_WRITE) != 0;
+
+    struct vnode *v = NULL;
+    if (!(flags & MAP_ANON)) {
+        struct file_handle *fh = ft_get(fd, curproc);
+        if (fh == NULL)  return EBADF;
+
+        /* The file has to be readable, and writeable if changes to the
+         * mapping go back to it */
+        int accmode = fh->fh_open_flags & O_ACCMODE;
+        if (accmode == O_WRONLY ||
+            (shared && writeable && accmode != O_RDWR)) {
+            return EACCES;
+        }
+        v = fh->fh_file;
+        int err = VOP_MMAP(v);
+        if (err)  return err;
+    }
+
+    vaddr_t vaddr;
+    int err = as_define_mmap(curproc->p_addrspace, len, writeable, v,
+                             offset, shared, &vaddr);
+    if (err)  return err;
+
+    *retval = (int) vaddr;
+    return 0;
+}
+
+/*
+ * Unmaps the mappings in a range of the address space
+ */
+int
+sys_munmap(userptr_t addr, size_t len) {
+    return as_unmap(curproc->p_addrspace, (vaddr_t) addr, len);
+}
+
+/*
+ * Takes advice about how a range of the address space will be used
+ */
+int
+sys_madvise(userptr_t addr, size_t len, int advice) {
+    switch (advice) {
+        case MADV_NORMAL:
+        return 0;
+
+        case MADV_DONTNEED:
+        case MADV_FREE:
+        return as_release_range(curproc->p_addrspace, (vaddr_t) addr, len);
+
+        default:
+        return EINVAL;
+    }
+}
@@ -36,9 +36,11 @@
 #include <kern/errno.h>
 #include <coremap.h>
 #include <swap.h>
+#include <paging.h>
 
 /*
- * Readjusts the current heap size
+ * Readjusts the current heap size. New heap pages are zero-filled when
+ * they are first touched.
  */
 int
 sys_sbrk(int amount, int *retval) {
@@ -47,7 +49,6 @@ sys_sbrk(int amount, int *retval) {
     int ppn = -1;
     struct pgtable *pde;
     struct pt_entry *pte;
-    struct cm_entry *cme;
     vaddr_t vaddr;
 
     if (amount % PAGE_SIZE != 0) {
@@ -56,79 +57,41 @@ sys_sbrk(int amount, int *retval) {
     }
 
     struct addrspace *as = curproc->p_addrspace;
-    KASSERT(as->as_heap_start % PAGE_SIZE == 0);
     lock_acquire(as->as_lock);
+    struct as_region *heap = as->as_heap;
+    KASSERT(heap != NULL);
+    KASSERT(heap->ar_vaddr % PAGE_SIZE == 0);
+    vaddr_t heap_end = heap->ar_vaddr + heap->ar_memsize;
 
     if (amount == 0) {
-        *retval = as->as_heap_start + as->as_heap_size;
+        *retval = heap_end;
         lock_release(as->as_lock);
         return 0;
     }
 
-    if (as->as_heap_start + as->as_heap_size + amount > STACK_MIN && amount > 0) {
+    if (heap_end + amount > as->as_mmap_start && amount > 0) {
         err = ENOMEM;
         goto cleanup1;
     }
 
-    if ((int)as->as_heap_size + amount < 0 && amount < 0) {
+    if ((int)heap->ar_memsize + amount < 0 && amount < 0) {
         err = EINVAL;
         goto cleanup1;
     }
 
-    if (amount > 0) {
-        /* growing the heap */
-        int pages_to_create = amount / PAGE_SIZE;
-        for(int i = 0; i < pages_to_create; i++) {
-            vaddr = as->as_heap_size + as->as_heap_start + i*PAGE_SIZE;        
-            pde = as->as_pd[VADDR_TO_PT(vaddr)];
-            if (pde == NULL) {
-                pde = kmalloc(sizeof(struct pgtable));
-                if (pde == NULL) {
-                    err = ENOMEM;
-                    goto cleanup1;
-                }
-                pgt_init(pde);
-                as->as_pd[VADDR_TO_PT(vaddr)] = pde;
-            }
-            pte = &(pde->pt_ptes[VADDR_TO_PTE(vaddr)]);
-            pte_acquire(as, pte);
-            pte->pte_valid = 0;
-            pte->pte_ppn = 0;
-            pte->pte_writeable = 1;
-            pte->pte_present = 0;
-            pte->pte_zeroed = 1;
-            pte_release(as, pte, ppn);
-        } 
-    } else {
+    if (amount < 0) {
         /* shrinking the heap */
         int pages_to_free = -amount / PAGE_SIZE;
         for(int i = 1; i <= pages_to_free; i++) {
             ppn = -1;
-            vaddr = as->as_heap_size + as->as_heap_start - i*PAGE_SIZE;        
+            vaddr = heap_end - i*PAGE_SIZE;
             pde = as->as_pd[VADDR_TO_PT(vaddr)];
             if (pde == NULL)  continue;
             pte = &(pde->pt_ptes[VADDR_TO_PTE(vaddr)]);
-            pte_acquire(as, pte);
-            if (pte->pte_present) {
-                ppn = pte->pte_ppn;
-                cme = &(k_coremap->cm_entries[pte->pte_ppn]);
-                KASSERT(cme->cme_kpage == 0);
-                if (cme->cme_tlb == 1) {
-                    KASSERT(cme->cme_owner_cpu == curcpu);
-                    struct tlbshootdown tlbs;
-                    tlbs.tlbs_cpu = cme->cme_owner_cpu;
-                    tlbs.tlbs_flush_all = false;
-                    tlbs.tlbs_vaddr = cme->cme_vaddr;
-                    vm_tlbshootdown(&tlbs);
-                }
-                if (cme->cme_swap_location != 0) {
-                    swap_destroy_block(cme->cme_swap_location, k_swap_tracker);
-                }
-                cme->cme_as = NULL;
-                cme->cme_vaddr = 0;
-                cme->cme_swap_location = 0;
-                cme->cme_dirty = 0;
-                cme->cme_kernel = 0;
+            if (!pte->pte_valid)  continue;
+            ppn = pte_acquire(as, pte);
+            if (ppn >= 0) {
+                page_unmap(ppn, as, vaddr);
                 pte->pte_present = 0;
             } else if (pte->pte_zeroed == 0) {
                 swap_destroy_block(pte->pte_ppn, k_swap_tracker);
@@ -139,10 +102,9 @@ sys_sbrk(int amount, int *retval) {
             pte_release(as, pte, ppn);
         }
     }
-    
-    
-    *retval = as->as_heap_start + as->as_heap_size;
-    as->as_heap_size += amount;
+
+    *retval = heap_end;
+    heap->ar_memsize += amount;
     lock_release(as->as_lock);
     return 0;
 
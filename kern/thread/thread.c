@@ -50,7 +50,6 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
-#include <coremap.h>
 
 #include "opt-synchprobs.h"
 
@@ -188,11 +187,19 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_asid = 0;
+	c->c_asid_gen = 0;
+	c->c_tlb_entries = 0;
+	c->c_swap_next = 0;
+	c->c_swap_left = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
 
+	c->c_numframes = 0;
+	spinlock_init(&c->c_frame_lock);
+
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
@@ -437,6 +444,25 @@ cpu_hatch(unsigned software_number)
 	thread_exit();
 }
 
+/*
+ * Return the number of cpus.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Return the cpu with software number SOFTWARE_NUMBER.
+ */
+struct cpu *
+cpu_get(unsigned software_number)
+{
+	KASSERT(software_number < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, software_number);
+}
+
 /*
  * Start up secondary cpus. Called from boot().
  */
@@ -853,6 +879,24 @@ thread_yield(void)
 	thread_switch(S_READY, NULL, NULL);
 }
 
+/*
+ * Check whether the current cpu's run queue is empty.
+ */
+bool
+thread_cpu_idle(void)
+{
+	bool idle;
+	int spl;
+
+	/* Stay on this cpu while looking at its run queue */
+	spl = splhigh();
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	idle = threadlist_isempty(&curcpu->c_runqueue);
+	spinlock_release(&curcpu->c_runqueue_lock);
+	splx(spl);
+	return idle;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -1011,7 +1055,6 @@ thread_consider_migration(void)
 		if (c == curcpu->c_self) {
 			continue;
 		}
-        spinlock_acquire(&k_coremap->cm_lock);
 		spinlock_acquire(&c->c_runqueue_lock);
 		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
@@ -1046,15 +1089,6 @@ thread_consider_migration(void)
 			t->t_cpu = c;
 			threadlist_addtail(&c->c_runqueue, t);
 
-			/* Update the coremap entries */
-			
-			for (int ppn = 0; ppn < k_coremap->cm_num_pages; ++ppn) {
-				if (k_coremap->cm_entries[ppn].cme_owner_cpu == curcpu &&
-					k_coremap->cm_entries[ppn].cme_as == t->t_proc->p_addrspace) {
-					k_coremap->cm_entries[ppn].cme_owner_cpu = c;
-				}
-			}
-
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -1068,7 +1102,6 @@ thread_consider_migration(void)
 				ipi_send(c, IPI_UNIDLE);
 			}
 		}
-		spinlock_release(&k_coremap->cm_lock);
 		spinlock_release(&c->c_runqueue_lock);
 	}
 
@@ -1087,13 +1120,6 @@ thread_consider_migration(void)
 
 	KASSERT(threadlist_isempty(&victims));
 	threadlist_cleanup(&victims);
-
-	/* shoot down the tlbs in this cpu */
-	struct tlbshootdown ts;
-	ts.tlbs_cpu = curcpu;
-	ts.tlbs_vaddr = 0;
-	ts.tlbs_flush_all = true;
-	vm_tlbshootdown(&ts);
 }
 
 
@@ -1282,27 +1308,14 @@ ipi_broadcast(int code)
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	unsigned n;
-
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
-		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
-	}
+	/*
+	 * The VM system merges the request into the queue, and
+	 * coalesces the queue into a flush when it's full.
+	 */
+	vm_tlbshootdown_queue(target->c_shootdown, &target->c_numshootdown,
+			      mapping);
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
@@ -1310,6 +1323,47 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send a TLB shootdown IPI to all CPUs except the current one.
+ */
+void
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i;
+	struct cpu *c;
+	struct tlbshootdown ts;
+
+	ts = *mapping;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ts.tlbs_cpu = c;
+			ipi_tlbshootdown(c, &ts);
+		}
+	}
+}
+
+/*
+ * Send a TLB shootdown IPI to each CPU in a mask of CPU numbers, except
+ * the current one.
+ */
+void
+ipi_tlbshootdown_mask(uint32_t cpumask, const struct tlbshootdown *mapping)
+{
+	unsigned i;
+	struct cpu *c;
+	struct tlbshootdown ts;
+
+	ts = *mapping;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && (cpumask & (1U << c->c_number))) {
+			ts.tlbs_cpu = c;
+			ipi_tlbshootdown(c, &ts);
+		}
+	}
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
@@ -1318,6 +1372,8 @@ interprocessor_interrupt(void)
 {
 	uint32_t bits;
 	unsigned i;
+	struct tlbshootdown shootdowns[TLBSHOOTDOWN_MAX];
+	unsigned numshootdowns = 0;
 
 	spinlock_acquire(&curcpu->c_ipi_lock);
 	bits = curcpu->c_ipi_pending;
@@ -1347,16 +1403,21 @@ interprocessor_interrupt(void)
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		/*
-		 * Note: depending on your VM system locking you might
-		 * need to release the ipi lock while calling
-		 * vm_tlbshootdown.
+		 * vm_tlbshootdown takes coremap locks, which other
+		 * cpus may hold while sending us IPIs. Copy the
+		 * requests out and handle them without the ipi lock.
 		 */
-		for (i=0; i<curcpu->c_numshootdown; i++) {
-			vm_tlbshootdown(&curcpu->c_shootdown[i]);
+		numshootdowns = curcpu->c_numshootdown;
+		for (i=0; i<numshootdowns; i++) {
+			shootdowns[i] = curcpu->c_shootdown[i];
 		}
 		curcpu->c_numshootdown = 0;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	for (i=0; i<numshootdowns; i++) {
+		vm_tlbshootdown(&shootdowns[i]);
+	}
 }
@@ -39,6 +39,15 @@
 #include <coremap.h>
 #include <paging.h>
 #include <clock.h>
+#include <cpu.h>
+#include <spl.h>
+#include <vmstats.h>
+#include <uio.h>
+#include <vnode.h>
+#include <swap.h>
+#include <shm.h>
+#include <kern/stat.h>
+#include <mips/tlb.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -46,6 +55,165 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+/*
+ * Finds the part of the page at VADDR that a region's file covers.
+ * Returns false if it covers none of it.
+ */
+static
+bool
+as_region_part(struct as_region *r, vaddr_t vaddr,
+           vaddr_t *start, vaddr_t *end)
+{
+    *start = r->ar_vaddr > vaddr ? r->ar_vaddr : vaddr;
+    *end = r->ar_vaddr + r->ar_filesize;
+    if (*end > vaddr + PAGE_SIZE)  *end = vaddr + PAGE_SIZE;
+    return *start < *end;
+}
+
+/*
+ * Write physical page PPN back to the file of a shared region at
+ * VADDR. Only bytes that are already in the file are written; a
+ * mapping never makes its file longer.
+ */
+static
+int
+as_store_page(struct as_region *r, vaddr_t vaddr, int ppn)
+{
+    KASSERT(r->ar_shared && r->ar_vnode != NULL);
+    vaddr_t start, end;
+    if (!as_region_part(r, vaddr, &start, &end))  return 0;
+
+    struct stat st;
+    int result = VOP_STAT(r->ar_vnode, &st);
+    if (result)  return result;
+    off_t offset = r->ar_offset + (start - r->ar_vaddr);
+    if (offset >= st.st_size)  return 0;
+    if (offset + (off_t)(end - start) > st.st_size) {
+        end = start + (st.st_size - offset);
+    }
+
+    struct iovec iov;
+    struct uio ku;
+    uio_kinit(&iov, &ku,
+              (void *)(CM_INDEX_TO_KVADDR(ppn) + (start - vaddr)),
+              end - start, offset, UIO_WRITE);
+    return VOP_WRITE(r->ar_vnode, &ku);
+}
+
+/* Makes a region with no file behind it */
+static
+struct as_region *
+as_region_create(vaddr_t vaddr, size_t memsize, int kind, int perms)
+{
+    struct as_region *r = kmalloc(sizeof(struct as_region));
+    if (r == NULL)  return NULL;
+    r->ar_vaddr = vaddr;
+    r->ar_memsize = memsize;
+    r->ar_filesize = 0;
+    r->ar_vnode = NULL;
+    r->ar_offset = 0;
+    r->ar_kind = kind;
+    r->ar_perms = perms;
+    r->ar_shared = false;
+    r->ar_shm = NULL;
+    r->ar_next = NULL;
+    return r;
+}
+
+/* Frees a region, letting go of what backs it */
+static
+void
+as_region_destroy(struct as_region *r)
+{
+    if (r->ar_vnode != NULL) {
+        VOP_DECREF(r->ar_vnode);
+    }
+    if (r->ar_shm != NULL) {
+        shm_release(r->ar_shm);
+    }
+    kfree(r);
+}
+
+/* Puts a region in the address space's list, keeping it sorted */
+static
+void
+as_region_insert(struct addrspace *as, struct as_region *r)
+{
+    KASSERT(lock_do_i_hold(as->as_lock));
+    struct as_region **prev = &as->as_regions;
+    while (*prev != NULL && (*prev)->ar_vaddr < r->ar_vaddr) {
+        prev = &(*prev)->ar_next;
+    }
+    r->ar_next = *prev;
+    *prev = r;
+}
+
+/*
+ * Unmaps every page of an mmap region, writing the pages of a shared
+ * file region back to the file first. Pages that were never touched,
+ * or that were never changed since they were read in, are not written.
+ * Returns the first write error, but unmaps every page regardless.
+ */
+static
+int
+as_unmap_region(struct addrspace *as, struct as_region *r)
+{
+    KASSERT(lock_do_i_hold(as->as_lock));
+    KASSERT(r->ar_kind == AR_MMAP);
+    int result = 0;
+
+    /* Drop the region from every tlb up front, in one shootdown */
+    page_tlb_evict_range(as, r->ar_vaddr, r->ar_memsize / PAGE_SIZE);
+
+    for (vaddr_t page = r->ar_vaddr; page < r->ar_vaddr + r->ar_memsize;
+         page += PAGE_SIZE) {
+        struct pgtable *pgtable = as->as_pd[VADDR_TO_PT(page)];
+        if (pgtable == NULL)  continue;
+        struct pt_entry *pte = &pgtable->pt_ptes[VADDR_TO_PTE(page)];
+        if (!pte->pte_valid)  continue;
+        int ppn = pte_acquire(as, pte);
+        bool swapped = ppn < 0 && !pte->pte_zeroed && !pte->pte_file &&
+                       pte->pte_ppn > 0;
+
+        if (r->ar_shared) {
+            int err = 0;
+            if (ppn >= 0) {
+                struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+                if (cme->cme_dirty || cme->cme_swap_location != 0) {
+                    err = as_store_page(r, page, ppn);
+                }
+            } else if (swapped) {
+                /* bring it back through a spare frame */
+                int tmp = page_get(0);
+                if (tmp < 0) {
+                    err = ENOMEM;
+                } else {
+                    if (swap_read(tmp, pte->pte_ppn, k_swap_tracker)) {
+                        panic("swap read failed");
+                    }
+                    err = as_store_page(r, page, tmp);
+                    cm_put_page(tmp);
+                }
+            }
+            if (err && result == 0)  result = err;
+        }
+
+        if (ppn >= 0) {
+            page_unmap(ppn, as, page);
+            pte->pte_present = 0;
+        } else if (swapped) {
+            swap_destroy_block(pte->pte_ppn, k_swap_tracker);
+        }
+        pte->pte_valid = 0;
+        pte->pte_ppn = 0;
+        pte->pte_zeroed = 0;
+        pte->pte_file = 0;
+        pte->pte_cow = 0;
+        pte_release(as, pte, ppn);
+    }
+    return result;
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -62,14 +230,64 @@ as_create(void)
     for (int i = 0; i < PD_SIZE; i++) {
         as->as_pd[i] = NULL;
     }
-    as->as_heap_size = 0;
-    as->as_heap_start = 0;
     as->as_lock = lock_create("as_lock");
-
+    if (as->as_lock == NULL) {
+        kfree(as);
+        return NULL;
+    }
+    as->as_pin_wchan = wchan_create("as_pin_wchan");
+    if (as->as_pin_wchan == NULL) {
+        lock_destroy(as->as_lock);
+        kfree(as);
+        return NULL;
+    }
+    as->as_asid = 0;
+    as->as_asid_gen = 0;
+    as->as_regions = NULL;
+    as->as_heap = NULL;
+    as->as_mmap_start = STACK_MIN;
+    as->as_ra_window = 1;
+    as->as_ra_next = 0;
+    spinlock_init(&as->as_tlb_lock);
+    as->as_tlb_cpus = 0;
+    bzero(&as->as_stats, sizeof(struct memstat));
+    spinlock_init(&as->as_pin_lock);
+    as->as_pins = 0;
 
 	return as;
 }
 
+/*
+ * Gives the new address space its own list of the old one's regions,
+ * so pages neither has touched yet can still be filled in.
+ */
+static
+int
+as_copy_regions(struct addrspace *old, struct addrspace *newas)
+{
+    struct as_region **tail = &newas->as_regions;
+    for (struct as_region *r = old->as_regions; r != NULL; r = r->ar_next) {
+        struct as_region *copy = kmalloc(sizeof(struct as_region));
+        if (copy == NULL) {
+            return ENOMEM;
+        }
+        *copy = *r;
+        copy->ar_next = NULL;
+        if (copy->ar_vnode != NULL) {
+            VOP_INCREF(copy->ar_vnode);
+        }
+        if (copy->ar_shm != NULL) {
+            shm_retain(copy->ar_shm);
+        }
+        if (r == old->as_heap) {
+            newas->as_heap = copy;
+        }
+        *tail = copy;
+        tail = &copy->ar_next;
+    }
+    return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -84,6 +302,13 @@ as_copy(struct addrspace *old, struct addrspace **ret)
     /* Acquire necessary locks */
     lock_acquire(old->as_lock);
 
+    int result = as_copy_regions(old, newas);
+    if (result) {
+        lock_release(old->as_lock);
+        as_destroy(newas);
+        return result;
+    }
+
     /* Iterate through all page table directories */
     for (int pde_index = 0; pde_index < PD_SIZE; ++pde_index) {
         /* skip over kernel entries */
@@ -101,111 +326,111 @@ as_copy(struct addrspace *old, struct addrspace **ret)
             struct pt_entry *pte = &(pde->pt_ptes[pte_index]);
             if (!pte->pte_valid)  continue;
             KASSERT(!pte->pte_present || pte->pte_ppn < k_coremap->cm_num_pages);
-            int releaseppn = pte_acquire(old, pte);
-
-            /* If the page is only in swap, bring it into memory */
-            spinlock_acquire(&k_coremap->cm_lock);
-            while (!pte->pte_present) {
-                struct addrspace *prev_as = NULL;
-                if (curproc->p_addrspace != old) {
-                    as_deactivate();
-                    prev_as = proc_setas(old);
-                    as_activate();
-                }
-                int err = page_swapin(PDI_PTI_TO_VADDR(pde_index, pte_index));
-                if (prev_as != NULL) {
-                    as_deactivate();
-                    proc_setas(prev_as);
-                    as_activate();
-                }
-                if (err != 0) {
-                    pte_release(old, pte, releaseppn);
-                    spinlock_release(&k_coremap->cm_lock);
-                    lock_release(old->as_lock);
-                    return err;
-                }
-                
-                releaseppn = pte_acquire(old, pte);
-            }
+            vaddr_t vaddr = PDI_PTI_TO_VADDR(pde_index, pte_index);
 
-            /* If the page is zeroed, skip everything */
-            int new_ppn = -1;
-            if (!pte->pte_zeroed) {
-                /* Copy the page into an empty block in memory */
-                new_ppn = page_get(0);
-                KASSERT(new_ppn != 0);
-                KASSERT(new_ppn != pte->pte_ppn);
-                if (new_ppn == -1) {
-                    pte_release(old, pte, releaseppn);
-                    spinlock_release(&k_coremap->cm_lock);
-                    lock_release(old->as_lock);
-                    return ENOMEM;
-                }
-                KASSERT(new_ppn < k_coremap->cm_num_pages);
-                k_coremap->cm_entries[new_ppn].cme_as = newas;
-                k_coremap->cm_entries[new_ppn].cme_vaddr = 
-                    PDI_PTI_TO_VADDR(pde_index, pte_index);
-                k_coremap->cm_entries[new_ppn].cme_swap_location = 0;
-                k_coremap->cm_entries[new_ppn].cme_owner_cpu = curcpu;
-                k_coremap->cm_entries[new_ppn].cme_dirty = 0;
-                k_coremap->cm_entries[new_ppn].cme_tlb = 0;
-                k_coremap->cm_entries[new_ppn].cme_busy = 1;
-                k_coremap->cm_entries[new_ppn].cme_kernel = 0;
-                k_coremap->cm_entries[new_ppn].cme_kpage = 0;
-                k_coremap->cm_entries[new_ppn].cme_exists = 1;
-                spinlock_release(&k_coremap->cm_lock);
-                KASSERT((void *)CM_INDEX_TO_KVADDR(new_ppn) != NULL); 
-                memmove((void *)CM_INDEX_TO_KVADDR(new_ppn),
-                    (const void *)CM_INDEX_TO_KVADDR(pte->pte_ppn),
-                    PAGE_SIZE);
-                spinlock_acquire(&k_coremap->cm_lock);
-            }   
-            spinlock_release(&k_coremap->cm_lock);
-            
             /* Make a new pagetable if necessary */
             struct pgtable *new_pde = newas->as_pd[pde_index];
             if (new_pde == NULL) {
                 new_pde = kmalloc(sizeof(struct pgtable));
                 if (new_pde == NULL) {
-                    pte_release(old, pte, releaseppn);
                     lock_release(old->as_lock);
+                    as_destroy(newas);
                     return ENOMEM;
                 }
                 newas->as_pd[pde_index] = new_pde;
                 pgt_init(new_pde);
             }
 
+            /* Pages that were never touched have nothing to share */
+            struct pt_entry *new_pte = &new_pde->pt_ptes[pte_index];
+            if (pte->pte_zeroed || pte->pte_file) {
+                new_pte->pte_present = 0;
+                new_pte->pte_valid = 1;
+                new_pte->pte_writeable = pte->pte_writeable;
+                new_pte->pte_ppn = 0;
+                new_pte->pte_zeroed = pte->pte_zeroed;
+                new_pte->pte_cow = 0;
+                new_pte->pte_file = pte->pte_file;
+                continue;
+            }
+
+            /* Every other page gets shared, so it needs a reverse mapping */
+            struct cm_rmap *rm = rmap_create();
+            if (rm == NULL) {
+                lock_release(old->as_lock);
+                as_destroy(newas);
+                return ENOMEM;
+            }
+            int releaseppn = pte_acquire(old, pte);
+
+            /* A page that is only in swap is shared through its swap
+             * block instead; each side reads in a copy of its own if it
+             * ever touches the page */
+            if (!pte->pte_present && pte->pte_file) {
+                /* evicted back to its file or shared memory object
+                 * while we waited for it */
+                KASSERT(releaseppn < 0);
+                rmap_destroy(rm);
+                new_pte->pte_present = 0;
+                new_pte->pte_valid = 1;
+                new_pte->pte_writeable = pte->pte_writeable;
+                new_pte->pte_ppn = 0;
+                new_pte->pte_zeroed = 0;
+                new_pte->pte_cow = 0;
+                new_pte->pte_file = 1;
+                continue;
+            }
+            if (!pte->pte_present) {
+                KASSERT(releaseppn < 0 && pte->pte_ppn > 0);
+                rmap_destroy(rm);
+                swap_share_block(pte->pte_ppn, k_swap_tracker);
+                new_pte->pte_present = 0;
+                new_pte->pte_valid = 1;
+                new_pte->pte_writeable = pte->pte_writeable;
+                new_pte->pte_ppn = pte->pte_ppn;
+                new_pte->pte_zeroed = 0;
+                new_pte->pte_cow = 0;
+                new_pte->pte_file = 0;
+                k_vmstats.vms_fork_swap_shares++;
+                continue;
+            }
+            KASSERT(releaseppn == (int)pte->pte_ppn);
+
+            /* Share the page copy-on-write, unless it is shared
+             * anonymous memory, which both sides keep writing to */
+            page_share(pte->pte_ppn, newas, vaddr, rm);
+            if (k_coremap->cm_entries[releaseppn].cme_shm == NULL) {
+                pte->pte_cow = pte->pte_writeable;
+            }
+
             /* Make a new PTE */
-            KASSERT(new_ppn != 0);
-            new_pde->pt_ptes[pte_index].pte_present = !pte->pte_zeroed;
-            new_pde->pt_ptes[pte_index].pte_valid = 1;
-            new_pde->pt_ptes[pte_index].pte_writeable = 1;
-            new_pde->pt_ptes[pte_index].pte_ppn = 
-                pte->pte_zeroed ? 0 : new_ppn;
-            new_pde->pt_ptes[pte_index].pte_zeroed = pte->pte_zeroed;
+            new_pte->pte_present = 1;
+            new_pte->pte_valid = 1;
+            new_pte->pte_writeable = pte->pte_writeable;
+            new_pte->pte_ppn = pte->pte_ppn;
+            new_pte->pte_zeroed = 0;
+            new_pte->pte_cow = pte->pte_cow;
+            new_pte->pte_file = 0;
             
             pte_release(old, pte, releaseppn);
         }
 
     }
 
-    
-    spinlock_acquire(&k_coremap->cm_lock);
-
-    for (int i = 0; i < k_coremap->cm_num_pages; i++) {
-        struct cm_entry *cme = &k_coremap->cm_entries[i];
-        if (cme->cme_as == newas) {
-            cme->cme_busy = 0;
-        }
+    /* The old address space may still hold writeable tlb entries for
+     * pages that are now copy-on-write, here or on any cpu it ran on
+     * before */
+    if (old->as_asid_gen != 0) {
+        struct tlbshootdown tlbs;
+        tlbs.tlbs_count = 0;
+        tlbs.tlbs_asid = old->as_asid;
+        tlbs.tlbs_flush_asid = true;
+        tlbs.tlbs_flush_all = false;
+        as_tlbshootdown(old, &tlbs);
     }
-    
-    wchan_wakeall(k_coremap->cm_wchan, &k_coremap->cm_lock);
-    
-    spinlock_release(&k_coremap->cm_lock);
 
     /* We're done! */
-    newas->as_heap_size = old->as_heap_size;
-    newas->as_heap_start = old->as_heap_start;
+    newas->as_mmap_start = old->as_mmap_start;
     lock_release(old->as_lock);
 	*ret = newas;
 	return 0;
@@ -218,18 +443,55 @@ as_destroy(struct addrspace *as)
 	 * Clean up as needed.
 	 */
 
+    /* The address space is out of its process's p_addrspace, so it
+     * can't be pinned anymore, but whoever pinned it before may still
+     * be reading it */
+    spinlock_acquire(&as->as_pin_lock);
+    while (as->as_pins > 0) {
+        wchan_sleep(as->as_pin_wchan, &as->as_pin_lock);
+    }
+    spinlock_release(&as->as_pin_lock);
+
     lock_acquire(as->as_lock);
 
+    /* Drop whatever tlb entries the address space left behind in one go,
+     * instead of a shootdown for every page it had mapped */
+    if (as->as_asid_gen != 0) {
+        struct tlbshootdown tlbs;
+        tlbs.tlbs_count = 0;
+        tlbs.tlbs_asid = as->as_asid;
+        tlbs.tlbs_flush_asid = true;
+        tlbs.tlbs_flush_all = false;
+        as_tlbshootdown(as, &tlbs);
+    }
+
+    /* write back shared file mappings before their pages go away */
+    for (struct as_region *r = as->as_regions; r != NULL; r = r->ar_next) {
+        if (r->ar_kind == AR_MMAP) {
+            as_unmap_region(as, r);
+        }
+    }
+
     /* clean up page directories */
     for (int i = 0; i < PD_SIZE; i++) {
         if (as->as_pd[i] != NULL) {
             /* clean up page table */
-            pgt_destroy(as->as_pd[i], as);
+            pgt_destroy(as->as_pd[i], as, i);
         }
     }
+
+    /* let go of the files and objects backing the address space */
+    while (as->as_regions != NULL) {
+        struct as_region *r = as->as_regions;
+        as->as_regions = r->ar_next;
+        as_region_destroy(r);
+    }
     
     lock_release(as->as_lock);
     lock_destroy(as->as_lock);
+    spinlock_cleanup(&as->as_tlb_lock);
+    wchan_destroy(as->as_pin_wchan);
+    spinlock_cleanup(&as->as_pin_lock);
 
 	kfree(as);
 }
@@ -251,11 +513,50 @@ as_activate(void)
 	/*
 	 * Write this.
 	 */
-    /* shoot down the current tlb */
-    struct tlbshootdown tlbs;
-    tlbs.tlbs_cpu = curcpu;
-    tlbs.tlbs_flush_all = true;
-    vm_tlbshootdown(&tlbs);
+    int spl = splhigh();
+
+    /* Make sure the address space has an asid from this generation */
+    spinlock_acquire(&k_asid_tracker.at_lock);
+    if (as->as_asid_gen != k_asid_tracker.at_generation) {
+        if (k_asid_tracker.at_next == NUM_ASIDS) {
+            k_asid_tracker.at_generation++;
+            k_asid_tracker.at_next = 1;
+        }
+        as->as_asid = k_asid_tracker.at_next++;
+        as->as_asid_gen = k_asid_tracker.at_generation;
+    }
+    uint32_t generation = as->as_asid_gen;
+    spinlock_release(&k_asid_tracker.at_lock);
+
+    curcpu->c_asid = as->as_asid;
+
+    /* Entries we load from now on are in our tlb; shootdowns for the
+     * address space have to come here too */
+    uint32_t bit = 1U << curcpu->c_number;
+    if ((as->as_tlb_cpus & bit) == 0) {
+        spinlock_acquire(&as->as_tlb_lock);
+        as->as_tlb_cpus |= bit;
+        spinlock_release(&as->as_tlb_lock);
+    }
+
+    /* Our tlb may hold entries tagged with asids that have since been
+     * handed out again; only then does it need to be flushed */
+    if (curcpu->c_asid_gen != generation) {
+        struct tlbshootdown tlbs;
+        tlbs.tlbs_cpu = curcpu->c_self;
+        tlbs.tlbs_count = 0;
+        tlbs.tlbs_asid = 0;
+        tlbs.tlbs_flush_asid = false;
+        tlbs.tlbs_flush_all = true;
+        vm_tlbshootdown(&tlbs);
+        curcpu->c_asid_gen = generation;
+    } else {
+        k_vmstats.vms_tlb_flushes_avoided++;
+        k_vmstats.vms_tlb_entries_kept += curcpu->c_tlb_entries;
+        tlb_setasid(curcpu->c_asid);
+    }
+
+    splx(spl);
 }
 
 void
@@ -271,26 +572,17 @@ as_deactivate(void)
 /*
  * Set up a segment at virtual address VADDR of size MEMSIZE. The
  * segment in memory extends from VADDR up to (but not including)
- * VADDR+MEMSIZE.
+ * VADDR+MEMSIZE. Its pages are filled in when they are first touched.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. The TLB
+ * can't refuse reads or execution, so only WRITEABLE is enforced. A
+ * page shared by two segments is writeable if either of them is.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		 int readable, int writeable, int executable)
 {
-	/* Abby is sad that there are no comments here */
-    (void) readable;
-    (void) executable;
-    writeable = (writeable == 0) ? 0 : 1;
-    int pde;
-    int pti;
-    struct pgtable *pgtable;
-    struct pt_entry *pte;
-    vaddr = PAGE_ALIGN(vaddr);
     if (as == NULL)  return EFAULT;
     if (memsize <= 0)  return EINVAL;
     if ((vaddr >= KERNEL_VADDR_START && vaddr < KERNEL_VADDR_END) ||
@@ -299,58 +591,16 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
             (vaddr < KERNEL_VADDR_START && vaddr+memsize > KERNEL_VADDR_START)) {
         return EINVAL;
     }
-    lock_acquire(as->as_lock);
-    
-    size_t mem_defined = 0;
-    while (mem_defined < memsize) {
-        pde = VADDR_TO_PT(vaddr+mem_defined);
-        pti = VADDR_TO_PTE(vaddr+mem_defined);
-        pgtable = as->as_pd[pde];
-        if (pgtable == NULL) {
-            pgtable = kmalloc(sizeof(struct pgtable));
-            if (pgtable == NULL) {
-                lock_release(as->as_lock);
-                return ENOMEM;
-            }
-            pgt_init(pgtable);
-            as->as_pd[pde] = pgtable;
-        }
-        pte = &(pgtable->pt_ptes[pti]);
-        pte_acquire(as, pte);
-        if (pte->pte_valid == 0) {
-            pte->pte_valid = 1;
-            pte->pte_present = 0;
-            pte->pte_zeroed = 1;
-            pte->pte_writeable = writeable;
-            pte->pte_ppn = 0;
-        } else if (pte->pte_writeable != writeable) {
-            pte->pte_writeable = writeable;
-            struct cm_entry *cme = &k_coremap->cm_entries[pte->pte_ppn];
-            if (cme->cme_tlb == 1) {
-                struct tlbshootdown tlbs;
-                tlbs.tlbs_cpu = cme->cme_owner_cpu;
-                tlbs.tlbs_flush_all = false;
-                tlbs.tlbs_vaddr = cme->cme_vaddr;
-                vm_tlbshootdown(&tlbs);
-                while (cme->cme_tlb) {
-                    wchan_sleep(k_coremap->cm_wchan, &k_coremap->cm_lock);
-                }
-                KASSERT(k_coremap->cm_entries[pte->pte_ppn].cme_tlb == 0);
-            }
-        }
-        int ppn = (pte->pte_present == 1) ? pte->pte_ppn : -1;
-        pte_release(as, pte, ppn);
-        mem_defined += PAGE_SIZE;
-    }
 
-    if(as->as_heap_start < vaddr + mem_defined) {
-        as->as_heap_start = vaddr + mem_defined;
-    }
-    KASSERT(as->as_heap_start % PAGE_SIZE == 0);
+    int perms = (readable ? AR_READ : 0) | (writeable ? AR_WRITE : 0) |
+                (executable ? AR_EXEC : 0);
+    struct as_region *r = as_region_create(vaddr, memsize, AR_SEGMENT, perms);
+    if (r == NULL)  return ENOMEM;
 
+    lock_acquire(as->as_lock);
+    as_region_insert(as, r);
     lock_release(as->as_lock);
     return 0;
-
 }
 
 int
@@ -364,25 +614,47 @@ as_prepare_load(struct addrspace *as)
 	return 0;
 }
 
+/*
+ * The heap starts empty on the first page past the program's segments.
+ */
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
+    lock_acquire(as->as_lock);
+    KASSERT(as->as_heap == NULL);
+    vaddr_t heap_start = 0;
+    for (struct as_region *r = as->as_regions; r != NULL; r = r->ar_next) {
+        vaddr_t end = ROUNDUP(r->ar_vaddr + r->ar_memsize, PAGE_SIZE);
+        if (r->ar_kind == AR_SEGMENT && end > heap_start) {
+            heap_start = end;
+        }
+    }
 
-	(void)as;
-	return 0;
+    struct as_region *r = as_region_create(heap_start, 0, AR_HEAP,
+                                           AR_READ | AR_WRITE);
+    if (r == NULL) {
+        lock_release(as->as_lock);
+        return ENOMEM;
+    }
+    as_region_insert(as, r);
+    as->as_heap = r;
+    lock_release(as->as_lock);
+    return 0;
 }
 
+/*
+ * The stack takes everything from STACK_MIN up. Its pages are
+ * zero-filled as it grows down into them.
+ */
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
-
-	(void)as;
+    struct as_region *r = as_region_create(STACK_MIN, USERSTACK - STACK_MIN,
+                                           AR_STACK, AR_READ | AR_WRITE);
+    if (r == NULL)  return ENOMEM;
+    lock_acquire(as->as_lock);
+    as_region_insert(as, r);
+    lock_release(as->as_lock);
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
@@ -391,6 +663,434 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 }
 
 
+/*
+ * Back the segment defined at VADDR with FILESIZE bytes of the file V,
+ * starting at file offset OFFSET. Must be called before any page of
+ * the segment is touched.
+ */
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+           off_t offset, size_t filesize)
+{
+    if (filesize == 0)  return 0;
+
+    lock_acquire(as->as_lock);
+    struct as_region *r = as->as_regions;
+    while (r != NULL && (r->ar_kind != AR_SEGMENT || r->ar_vaddr != vaddr)) {
+        r = r->ar_next;
+    }
+    if (r == NULL || r->ar_vnode != NULL || filesize > r->ar_memsize) {
+        lock_release(as->as_lock);
+        return EFAULT;
+    }
+
+    r->ar_filesize = filesize;
+    r->ar_vnode = v;
+    r->ar_offset = offset;
+    VOP_INCREF(v);
+
+    lock_release(as->as_lock);
+    return 0;
+}
+
+/*
+ * Fill physical page PPN with the contents of the file-backed page at
+ * VADDR. More than one region may fall in the page; whatever none of
+ * them covers is zero.
+ */
+int
+as_load_page(struct addrspace *as, vaddr_t vaddr, int ppn)
+{
+    KASSERT(lock_do_i_hold(as->as_lock));
+    KASSERT(vaddr % PAGE_SIZE == 0);
+    vaddr_t kvaddr = CM_INDEX_TO_KVADDR(ppn);
+    as_zero_region(kvaddr, 1);
+
+    for (struct as_region *r = as->as_regions; r != NULL; r = r->ar_next) {
+        vaddr_t start, end;
+        if (r->ar_vnode == NULL)  continue;
+        if (!as_region_part(r, vaddr, &start, &end))  continue;
+
+        struct iovec iov;
+        struct uio ku;
+        uio_kinit(&iov, &ku, (void *)(kvaddr + (start - vaddr)), end - start,
+                  r->ar_offset + (start - r->ar_vaddr), UIO_READ);
+        int result = VOP_READ(r->ar_vnode, &ku);
+        if (result)  return result;
+
+        /* an executable shrank since it was loaded; mmap regions may
+         * run past the end of the file, which reads as zeros */
+        if (ku.uio_resid != 0 && r->ar_kind != AR_MMAP)  return EIO;
+    }
+    return 0;
+}
+
+/*
+ * Returns the executable backing the page at VADDR, or NULL.
+ */
+struct vnode *
+as_page_vnode(struct addrspace *as, vaddr_t vaddr)
+{
+    KASSERT(lock_do_i_hold(as->as_lock));
+    for (struct as_region *r = as->as_regions; r != NULL; r = r->ar_next) {
+        vaddr_t start, end;
+        if (r->ar_kind == AR_SEGMENT && as_region_part(r, vaddr, &start, &end)) {
+            return r->ar_vnode;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the shared memory object behind the page at VADDR, or NULL.
+ */
+struct shm_object *
+as_page_shm(struct addrspace *as, vaddr_t vaddr, unsigned *index)
+{
+    KASSERT(lock_do_i_hold(as->as_lock));
+    for (struct as_region *r = as->as_regions; r != NULL; r = r->ar_next) {
+        if (r->ar_shm != NULL && vaddr >= r->ar_vaddr &&
+            vaddr < r->ar_vaddr + r->ar_memsize) {
+            *index = (vaddr - r->ar_vaddr) / PAGE_SIZE;
+            return r->ar_shm;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Finds the PTE for the page at VADDR. A page nobody has touched gets
+ * its PTE from the regions covering it: read from the file if one of
+ * them has file data in the page, zero-filled otherwise, and writeable
+ * if any of them is.
+ */
+int
+as_fault_pte(struct addrspace *as, vaddr_t vaddr, struct pt_entry **ret)
+{
+    KASSERT(lock_do_i_hold(as->as_lock));
+    KASSERT(vaddr % PAGE_SIZE == 0);
+    struct pgtable *pde = as->as_pd[VADDR_TO_PT(vaddr)];
+    if (pde != NULL && pde->pt_ptes[VADDR_TO_PTE(vaddr)].pte_valid) {
+        *ret = &pde->pt_ptes[VADDR_TO_PTE(vaddr)];
+        return 0;
+    }
+
+    bool covered = false;
+    bool file = false;
+    int perms = 0;
+    for (struct as_region *r = as->as_regions;
+         r != NULL && r->ar_vaddr < vaddr + PAGE_SIZE; r = r->ar_next) {
+        vaddr_t start, end;
+        if (r->ar_vaddr + r->ar_memsize <= vaddr)  continue;
+        covered = true;
+        perms |= r->ar_perms;
+        if (r->ar_vnode != NULL && as_region_part(r, vaddr, &start, &end)) {
+            file = true;
+        }
+        if (r->ar_shm != NULL) {
+            file = true;
+        }
+    }
+    if (!covered)  return EFAULT;
+
+    if (pde == NULL) {
+        pde = kmalloc(sizeof(struct pgtable));
+        if (pde == NULL)  return ENOMEM;
+        pgt_init(pde);
+        as->as_pd[VADDR_TO_PT(vaddr)] = pde;
+    }
+    struct pt_entry *pte = &pde->pt_ptes[VADDR_TO_PTE(vaddr)];
+    pte->pte_valid = 1;
+    pte->pte_present = 0;
+    pte->pte_zeroed = !file;
+    pte->pte_file = file;
+    pte->pte_cow = 0;
+    pte->pte_writeable = (perms & AR_WRITE) ? 1 : 0;
+    pte->pte_ppn = 0;
+    *ret = pte;
+    return 0;
+}
+
+vaddr_t
+as_heap_end(struct addrspace *as)
+{
+    if (as->as_heap == NULL)  return 0;
+    return as->as_heap->ar_vaddr + as->as_heap->ar_memsize;
+}
+
+/*
+ * Finds the highest free stretch of LEN bytes between the heap and the
+ * stack. Returns 0 if there is none.
+ */
+static
+vaddr_t
+as_mmap_find(struct addrspace *as, size_t len)
+{
+    vaddr_t heap_end = as_heap_end(as);
+    vaddr_t top = STACK_MIN;
+    bool moved = true;
+    while (moved) {
+        if (top < heap_end || top - heap_end < len)  return 0;
+        moved = false;
+        for (struct as_region *r = as->as_regions; r != NULL;
+             r = r->ar_next) {
+            if (r->ar_kind == AR_MMAP && r->ar_vaddr < top &&
+                r->ar_vaddr + r->ar_memsize > top - len) {
+                top = r->ar_vaddr;
+                moved = true;
+            }
+        }
+    }
+    return top - len;
+}
+
+/* Moves as_mmap_start to the lowest mmap region left */
+static
+void
+as_mmap_update(struct addrspace *as)
+{
+    as->as_mmap_start = STACK_MIN;
+    for (struct as_region *r = as->as_regions; r != NULL; r = r->ar_next) {
+        if (r->ar_kind == AR_MMAP && r->ar_vaddr < as->as_mmap_start) {
+            as->as_mmap_start = r->ar_vaddr;
+        }
+    }
+}
+
+int
+as_define_mmap(struct addrspace *as, size_t len, int writeable,
+           struct vnode *v, off_t offset, bool shared, vaddr_t *ret)
+{
+    len = ROUNDUP(len, PAGE_SIZE);
+    if (len == 0)  return EINVAL;
+
+    struct as_region *r = kmalloc(sizeof(struct as_region));
+    if (r == NULL)  return ENOMEM;
+
+    /* shared zero-filled memory gets an object to hold its pages */
+    r->ar_shm = NULL;
+    if (shared && v == NULL) {
+        r->ar_shm = shm_create(len / PAGE_SIZE);
+        if (r->ar_shm == NULL) {
+            kfree(r);
+            return ENOMEM;
+        }
+    }
+
+    lock_acquire(as->as_lock);
+    vaddr_t vaddr = as_mmap_find(as, len);
+    if (vaddr == 0) {
+        lock_release(as->as_lock);
+        if (r->ar_shm != NULL)  shm_release(r->ar_shm);
+        kfree(r);
+        return ENOMEM;
+    }
+
+    /* file pages are read in on first touch, the rest zero-filled */
+    r->ar_vaddr = vaddr;
+    r->ar_memsize = len;
+    r->ar_filesize = (v == NULL) ? 0 : len;
+    r->ar_vnode = v;
+    r->ar_offset = offset;
+    r->ar_kind = AR_MMAP;
+    r->ar_perms = AR_READ | (writeable ? AR_WRITE : 0);
+    r->ar_shared = shared && v != NULL;
+    if (v != NULL) {
+        VOP_INCREF(v);
+    }
+    as_region_insert(as, r);
+    as_mmap_update(as);
+
+    lock_release(as->as_lock);
+    *ret = vaddr;
+    return 0;
+}
+
+int
+as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    if (vaddr % PAGE_SIZE != 0 || len == 0)  return EINVAL;
+    vaddr_t end = vaddr + ROUNDUP(len, PAGE_SIZE);
+    if (end < vaddr)  return EINVAL;
+
+    lock_acquire(as->as_lock);
+
+    /* refuse to cut a mapping in two */
+    for (struct as_region *r = as->as_regions; r != NULL; r = r->ar_next) {
+        if (r->ar_kind != AR_MMAP)  continue;
+        vaddr_t r_end = r->ar_vaddr + r->ar_memsize;
+        bool overlaps = r->ar_vaddr < end && r_end > vaddr;
+        bool inside = r->ar_vaddr >= vaddr && r_end <= end;
+        if (overlaps && !inside) {
+            lock_release(as->as_lock);
+            return EINVAL;
+        }
+    }
+
+    int result = 0;
+    struct as_region **prev = &as->as_regions;
+    while (*prev != NULL) {
+        struct as_region *r = *prev;
+        if (r->ar_kind != AR_MMAP || r->ar_vaddr < vaddr ||
+            r->ar_vaddr + r->ar_memsize > end) {
+            prev = &r->ar_next;
+            continue;
+        }
+        int err = as_unmap_region(as, r);
+        if (err && result == 0)  result = err;
+        *prev = r->ar_next;
+        as_region_destroy(r);
+    }
+    as_mmap_update(as);
+
+    lock_release(as->as_lock);
+    return result;
+}
+
+/*
+ * Whether the page at VADDR is in a shared mapping, whose contents
+ * have to outlive our copy of them.
+ */
+static
+bool
+as_page_shared(struct addrspace *as, vaddr_t vaddr)
+{
+    for (struct as_region *r = as->as_regions;
+         r != NULL && r->ar_vaddr <= vaddr; r = r->ar_next) {
+        if ((r->ar_shared || r->ar_shm != NULL) &&
+            vaddr < r->ar_vaddr + r->ar_memsize) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Drops the pages between VADDR and VADDR+LEN the way sbrk drops the
+ * top of the heap, but leaves the regions in place. Clearing the PTE
+ * lets as_fault_pte fill it in again on the next touch, so heap and
+ * anonymous pages come back zeroed and private file pages are read
+ * from the file again. Fails with ENOMEM if a page of the range is in
+ * no region.
+ */
+int
+as_release_range(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    if (vaddr % PAGE_SIZE != 0)  return EINVAL;
+    if (len == 0)  return 0;
+    vaddr_t end = vaddr + ROUNDUP(len, PAGE_SIZE);
+    if (end < vaddr)  return EINVAL;
+
+    lock_acquire(as->as_lock);
+
+    /* the regions are sorted, so the covered part only grows upwards */
+    vaddr_t covered = vaddr;
+    for (struct as_region *r = as->as_regions;
+         r != NULL && covered < end; r = r->ar_next) {
+        if (r->ar_vaddr <= covered && r->ar_vaddr + r->ar_memsize > covered) {
+            covered = r->ar_vaddr + r->ar_memsize;
+        }
+    }
+    if (covered < end) {
+        lock_release(as->as_lock);
+        return ENOMEM;
+    }
+
+    /* Drop the range from every tlb up front, in one shootdown */
+    page_tlb_evict_range(as, vaddr, (end - vaddr) / PAGE_SIZE);
+
+    for (vaddr_t page = vaddr; page < end; page += PAGE_SIZE) {
+        struct pgtable *pgtable = as->as_pd[VADDR_TO_PT(page)];
+        if (pgtable == NULL)  continue;
+        struct pt_entry *pte = &pgtable->pt_ptes[VADDR_TO_PTE(page)];
+        if (!pte->pte_valid)  continue;
+        if (as_page_shared(as, page))  continue;
+        int ppn = pte_acquire(as, pte);
+
+        if (ppn >= 0) {
+            page_unmap(ppn, as, page);
+            pte->pte_present = 0;
+            k_vmstats.vms_advise_frees++;
+        } else if (!pte->pte_zeroed && !pte->pte_file && pte->pte_ppn > 0) {
+            swap_destroy_block(pte->pte_ppn, k_swap_tracker);
+            k_vmstats.vms_advise_swap_frees++;
+        }
+        pte->pte_valid = 0;
+        pte->pte_ppn = 0;
+        pte->pte_zeroed = 0;
+        pte->pte_file = 0;
+        pte->pte_cow = 0;
+        pte_release(as, pte, ppn);
+    }
+
+    lock_release(as->as_lock);
+    return 0;
+}
+
+uint32_t
+as_tlb_cpus(struct addrspace *as)
+{
+    spinlock_acquire(&as->as_tlb_lock);
+    uint32_t cpus = as->as_tlb_cpus;
+    spinlock_release(&as->as_tlb_lock);
+    return cpus;
+}
+
+void
+as_tlbshootdown(struct addrspace *as, struct tlbshootdown *t)
+{
+    uint32_t cpus = as_tlb_cpus(as);
+    if (cpus & (1U << curcpu->c_number)) {
+        t->tlbs_cpu = curcpu->c_self;
+        vm_tlbshootdown(t);
+    }
+    ipi_tlbshootdown_mask(cpus, t);
+}
+
+void
+as_memstat(struct addrspace *as, struct memstat *ms)
+{
+    lock_acquire(as->as_lock);
+    *ms = as->as_stats;
+    ms->ms_resident = 0;
+    ms->ms_swapped = 0;
+    for (int i = 0; i < PD_SIZE; i++) {
+        struct pgtable *pde = as->as_pd[i];
+        if (pde == NULL)  continue;
+        for (int j = 0; j < PT_SIZE; j++) {
+            struct pt_entry *pte = &pde->pt_ptes[j];
+            if (!pte->pte_valid)  continue;
+            if (pte->pte_present) {
+                ms->ms_resident++;
+            } else if (!pte->pte_zeroed && !pte->pte_file &&
+                       pte->pte_ppn > 0) {
+                ms->ms_swapped++;
+            }
+        }
+    }
+    lock_release(as->as_lock);
+}
+
+void
+as_pin(struct addrspace *as)
+{
+    spinlock_acquire(&as->as_pin_lock);
+    as->as_pins++;
+    spinlock_release(&as->as_pin_lock);
+}
+
+void
+as_unpin(struct addrspace *as)
+{
+    spinlock_acquire(&as->as_pin_lock);
+    KASSERT(as->as_pins > 0);
+    as->as_pins--;
+    if (as->as_pins == 0) {
+        wchan_wakeall(as->as_pin_wchan, &as->as_pin_lock);
+    }
+    spinlock_release(&as->as_pin_lock);
+}
+
 void
 as_zero_region(vaddr_t vaddr, unsigned npages)
 {
@@ -400,35 +1100,33 @@ as_zero_region(vaddr_t vaddr, unsigned npages)
 int
 pte_acquire(struct addrspace *as, struct pt_entry *pte) {
     KASSERT(lock_do_i_hold(as->as_lock));
-    int retval = -1;
-    if (pte->pte_present == 1) {
-        unsigned acquired = 0;
-        if (!spinlock_do_i_hold(&k_coremap->cm_lock)) {
-            spinlock_acquire(&k_coremap->cm_lock);
-            acquired = 1;
+    while (pte->pte_present == 1) {
+        int ppn = pte->pte_ppn;
+        KASSERT(ppn >= 0 && ppn < k_coremap->cm_num_pages);
+        struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+        spinlock_acquire(CM_LOCK(ppn));
+        /* The page may have been evicted before we got the lock */
+        if (!pte->pte_present || (int)pte->pte_ppn != ppn) {
+            spinlock_release(CM_LOCK(ppn));
+            continue;
         }
-        KASSERT(pte->pte_ppn >= 0 && pte->pte_ppn < k_coremap->cm_num_pages);
-        struct cm_entry *cme = &k_coremap->cm_entries[pte->pte_ppn];
-        KASSERT(cme != NULL);
         KASSERT(cme->cme_kpage == 0);
-        while (cme->cme_busy && pte->pte_present) {
-            wchan_sleep(k_coremap->cm_wchan, &k_coremap->cm_lock);
+        if (cme->cme_busy) {
+            wchan_sleep(CM_STRIPE(ppn)->cs_wchan, CM_LOCK(ppn));
+            spinlock_release(CM_LOCK(ppn));
+            continue;
         }
         /* This assumes single-threaded processes */
-        if (cme->cme_as != as || !pte->pte_present) {
-            if (acquired == 1) {
-                spinlock_release(&k_coremap->cm_lock);
-            }
+        if (!page_mapped_by(ppn, as)) {
+            spinlock_release(CM_LOCK(ppn));
             return -1;
         }
 
         cme->cme_busy = 1;
-        retval = pte->pte_ppn;
-        if (acquired == 1) {
-            spinlock_release(&k_coremap->cm_lock);
-        }
+        spinlock_release(CM_LOCK(ppn));
+        return ppn;
     }
-    return retval;
+    return -1;
 }
 
 void
@@ -436,18 +1134,19 @@ pte_release(struct addrspace *as, struct pt_entry *pte, int ppn) {
     (void) pte;
     KASSERT(lock_do_i_hold(as->as_lock));
     if (ppn >= 0) {
-        unsigned acquired = 0;
-        if (!spinlock_do_i_hold(&k_coremap->cm_lock)) {
-            spinlock_acquire(&k_coremap->cm_lock);
-            acquired = 1;
-        }
         struct cm_entry *cme = &k_coremap->cm_entries[ppn];
-        KASSERT(cme != NULL);
+        spinlock_acquire(CM_LOCK(ppn));
         KASSERT(cme->cme_kpage == 0);
-        cme->cme_busy = 0;
-        wchan_wakeall(k_coremap->cm_wchan, &k_coremap->cm_lock);
-        if (acquired == 1) {
-            spinlock_release(&k_coremap->cm_lock);
+        KASSERT(cme->cme_busy);
+        /* The last mapping of the page went away while we held it; a
+         * page kept by its shared memory object just stops being busy */
+        if (cme->cme_as == NULL && cme->cme_shm == NULL) {
+            spinlock_release(CM_LOCK(ppn));
+            cm_put_page(ppn);
+            return;
         }
+        cme->cme_busy = 0;
+        wchan_wakeall(CM_STRIPE(ppn)->cs_wchan, CM_LOCK(ppn));
+        spinlock_release(CM_LOCK(ppn));
     }
 }
@@ -0,0 +1,533 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/* This file keeps track of the coremap's busy bits and counts, and of
+ * its free frames, both in the coremap's free map and in each cpu's
+ * cache of free frames. */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <coremap.h>
+#include <vmstats.h>
+#include <wchan.h>
+
+/* Index of the lowest set bit in a nonzero word */
+static
+unsigned
+cm_first_bit(uint32_t word) {
+    KASSERT(word != 0);
+    unsigned bit = 0;
+    if ((word & 0xffff) == 0) { word >>= 16; bit += 16; }
+    if ((word & 0xff) == 0)   { word >>= 8;  bit += 8; }
+    if ((word & 0xf) == 0)    { word >>= 4;  bit += 4; }
+    if ((word & 0x3) == 0)    { word >>= 2;  bit += 2; }
+    if ((word & 0x1) == 0)    { bit += 1; }
+    return bit;
+}
+
+void
+cm_unbusy(int ppn) {
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    spinlock_acquire(CM_LOCK(ppn));
+    KASSERT(cme->cme_busy);
+    cme->cme_busy = 0;
+    wchan_wakeall(CM_STRIPE(ppn)->cs_wchan, CM_LOCK(ppn));
+    spinlock_release(CM_LOCK(ppn));
+}
+
+void
+cm_set_dirty(int ppn, bool dirty) {
+    KASSERT(spinlock_do_i_hold(CM_LOCK(ppn)));
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    if (cme->cme_dirty == (dirty ? 1 : 0)) {
+        return;
+    }
+    cme->cme_dirty = dirty ? 1 : 0;
+    spinlock_acquire(&k_coremap->cm_lock);
+    if (dirty) {
+        k_coremap->cm_num_dirty++;
+    } else {
+        k_coremap->cm_num_dirty--;
+    }
+    spinlock_release(&k_coremap->cm_lock);
+}
+
+int
+cm_clock_tick(void) {
+    spinlock_acquire(&k_coremap->cm_lock);
+    int ppn = k_coremap->cm_clock_head;
+    k_coremap->cm_clock_head++;
+    if (k_coremap->cm_clock_head >= k_coremap->cm_num_pages) {
+        k_coremap->cm_clock_head = 0;
+    }
+    spinlock_release(&k_coremap->cm_lock);
+    return ppn;
+}
+
+/* The word of an order's free block map that holds block b's bit */
+static
+uint32_t *
+cm_order_word(unsigned order, unsigned b) {
+    KASSERT(order > 0 && order <= CM_MAX_ORDER);
+    return &k_coremap->cm_order_map[k_coremap->cm_order_base[order] + b / 32];
+}
+
+/* Whether block b of an order is wholly free */
+static
+bool
+cm_block_free(unsigned order, unsigned b) {
+    uint32_t word = order == 0 ? k_coremap->cm_free_map[b / 32] :
+        *cm_order_word(order, b);
+    return (word & ((uint32_t)1 << (b % 32))) != 0;
+}
+
+/* Number of wholly free blocks of an order */
+static
+int
+cm_blocks_free(unsigned order) {
+    return order == 0 ? k_coremap->cm_num_free : k_coremap->cm_order_free[order];
+}
+
+/* Takes a frame off the free map, splitting the free blocks it was in */
+static
+void
+cm_take(int ppn) {
+    int w = ppn / 32;
+    uint32_t mask = (uint32_t)1 << (ppn % 32);
+    KASSERT(k_coremap->cm_free_map[w] & mask);
+    k_coremap->cm_free_map[w] &= ~mask;
+    if (k_coremap->cm_free_map[w] == 0) {
+        k_coremap->cm_free_summary[w / 32] &= ~((uint32_t)1 << (w % 32));
+    }
+    k_coremap->cm_num_free--;
+
+    for (unsigned order = 1; order <= CM_MAX_ORDER; order++) {
+        unsigned b = ppn >> order;
+        if (!cm_block_free(order, b))  break;
+        *cm_order_word(order, b) &= ~((uint32_t)1 << (b % 32));
+        k_coremap->cm_order_free[order]--;
+    }
+}
+
+/* Puts a frame on the free map, merging it with its free buddies */
+static
+void
+cm_give(int ppn) {
+    int w = ppn / 32;
+    uint32_t mask = (uint32_t)1 << (ppn % 32);
+    KASSERT((k_coremap->cm_free_map[w] & mask) == 0);
+    k_coremap->cm_free_map[w] |= mask;
+    k_coremap->cm_free_summary[w / 32] |= (uint32_t)1 << (w % 32);
+    k_coremap->cm_num_free++;
+
+    for (unsigned order = 1; order <= CM_MAX_ORDER; order++) {
+        unsigned b = ppn >> order;
+        if (!cm_block_free(order - 1, 2 * b) ||
+            !cm_block_free(order - 1, 2 * b + 1)) {
+            break;
+        }
+        *cm_order_word(order, b) |= (uint32_t)1 << (b % 32);
+        k_coremap->cm_order_free[order]++;
+    }
+}
+
+/*
+ * Spreads 16 bits out to 32, each bit covering two: bit i of the
+ * result is bit i/2 of x.
+ */
+static
+uint32_t
+cm_spread(uint32_t x) {
+    x &= 0xffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x | (x << 1);
+}
+
+/* Number of free blocks of an order that aren't half of a larger free
+ * block; the blocks a buddy allocator would have on its free list */
+static
+int
+cm_blocks_whole(unsigned order) {
+    if (order == CM_MAX_ORDER)  return cm_blocks_free(order);
+    return cm_blocks_free(order) - 2 * cm_blocks_free(order + 1);
+}
+
+/* Finds a free block of an order that isn't half of a larger free one.
+ * Assumes the free map lock is held and that there is one. */
+static
+unsigned
+cm_find_whole(unsigned order) {
+    unsigned nblocks = k_coremap->cm_num_pages >> order;
+    for (unsigned w = 0; w * 32 < nblocks; w++) {
+        uint32_t word = order == 0 ? k_coremap->cm_free_map[w] :
+            *cm_order_word(order, w * 32);
+        if (word == 0)  continue;
+        if (order < CM_MAX_ORDER) {
+            /* the 16 parents of these 32 blocks */
+            uint32_t parents = *cm_order_word(order + 1, w * 16);
+            word &= ~cm_spread(parents >> ((w % 2) * 16));
+        }
+        if (word != 0) {
+            return w * 32 + cm_first_bit(word);
+        }
+    }
+    panic("coremap free block count is off");
+}
+
+/* Takes the lowest free frame off the free map, or returns -1 */
+static
+int
+cm_take_first(void) {
+    if (k_coremap->cm_num_free == 0) {
+        return -1;
+    }
+    for (int s = 0; s < CM_SUMMARY_WORDS; s++) {
+        if (k_coremap->cm_free_summary[s] == 0)  continue;
+        int w = s * 32 + cm_first_bit(k_coremap->cm_free_summary[s]);
+        int ppn = w * 32 + cm_first_bit(k_coremap->cm_free_map[w]);
+        cm_take(ppn);
+        return ppn;
+    }
+    panic("coremap free count is off");
+}
+
+void
+cm_free_page(int ppn) {
+    KASSERT(ppn > 0 && ppn < k_coremap->cm_num_pages);
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    KASSERT(cme->cme_exists && !cme->cme_kpage);
+    KASSERT(cme->cme_as == NULL && !cme->cme_busy);
+
+    spinlock_acquire(&k_coremap->cm_free_lock);
+    cm_give(ppn);
+    spinlock_release(&k_coremap->cm_free_lock);
+}
+
+int
+cm_get_page(void) {
+    int spl = splhigh();
+    struct cpu *c = curcpu->c_self;
+    spinlock_acquire(&c->c_frame_lock);
+
+    /* Refill the cache from the free map. Frames off the map are left
+     * alone by everyone until they're marked busy, since they have no
+     * address space. */
+    if (c->c_numframes == 0) {
+        spinlock_acquire(&k_coremap->cm_free_lock);
+        while (c->c_numframes < CPU_FRAME_BATCH) {
+            int ppn = cm_take_first();
+            if (ppn < 0)  break;
+            c->c_frames[c->c_numframes++] = ppn;
+        }
+        spinlock_release(&k_coremap->cm_free_lock);
+        for (unsigned i = 0; i < c->c_numframes; i++) {
+            int ppn = c->c_frames[i];
+            spinlock_acquire(CM_LOCK(ppn));
+            k_coremap->cm_entries[ppn].cme_busy = 1;
+            spinlock_release(CM_LOCK(ppn));
+        }
+        if (c->c_numframes == 0) {
+            spinlock_release(&c->c_frame_lock);
+            splx(spl);
+            return -1;
+        }
+        k_vmstats.vms_frame_cache_refills++;
+    } else {
+        k_vmstats.vms_frame_cache_hits++;
+    }
+
+    int ppn = c->c_frames[--c->c_numframes];
+    spinlock_release(&c->c_frame_lock);
+    splx(spl);
+
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    KASSERT(cme->cme_as == NULL && !cme->cme_kpage && cme->cme_busy);
+    return ppn;
+}
+
+void
+cm_put_page(int ppn) {
+    KASSERT(ppn > 0 && ppn < k_coremap->cm_num_pages);
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    KASSERT(cme->cme_exists && !cme->cme_kpage);
+    KASSERT(cme->cme_as == NULL && cme->cme_busy);
+
+    int spl = splhigh();
+    struct cpu *c = curcpu->c_self;
+    spinlock_acquire(&c->c_frame_lock);
+
+    /* Drain the oldest half of a full cache back to the free map */
+    if (c->c_numframes == CPU_FRAME_CACHE) {
+        for (unsigned i = 0; i < CPU_FRAME_BATCH; i++) {
+            int drained = c->c_frames[i];
+            spinlock_acquire(CM_LOCK(drained));
+            k_coremap->cm_entries[drained].cme_busy = 0;
+            spinlock_release(CM_LOCK(drained));
+        }
+        spinlock_acquire(&k_coremap->cm_free_lock);
+        for (unsigned i = 0; i < CPU_FRAME_BATCH; i++) {
+            cm_give(c->c_frames[i]);
+        }
+        spinlock_release(&k_coremap->cm_free_lock);
+        for (unsigned i = CPU_FRAME_BATCH; i < CPU_FRAME_CACHE; i++) {
+            c->c_frames[i - CPU_FRAME_BATCH] = c->c_frames[i];
+        }
+        c->c_numframes -= CPU_FRAME_BATCH;
+        k_vmstats.vms_frame_cache_drains++;
+    }
+
+    c->c_frames[c->c_numframes++] = ppn;
+    spinlock_release(&c->c_frame_lock);
+    splx(spl);
+}
+
+void
+cm_drain_caches(void) {
+    for (unsigned n = 0; n < cpu_count(); n++) {
+        struct cpu *c = cpu_get(n);
+        spinlock_acquire(&c->c_frame_lock);
+        for (unsigned i = 0; i < c->c_numframes; i++) {
+            int ppn = c->c_frames[i];
+            spinlock_acquire(CM_LOCK(ppn));
+            k_coremap->cm_entries[ppn].cme_busy = 0;
+            spinlock_release(CM_LOCK(ppn));
+        }
+        spinlock_acquire(&k_coremap->cm_free_lock);
+        for (unsigned i = 0; i < c->c_numframes; i++) {
+            cm_give(c->c_frames[i]);
+        }
+        spinlock_release(&k_coremap->cm_free_lock);
+        c->c_numframes = 0;
+        spinlock_release(&c->c_frame_lock);
+    }
+}
+
+/* Order of the smallest buddy block that holds npages frames */
+static
+unsigned
+cm_order(unsigned npages) {
+    unsigned order = 0;
+    while (((unsigned)1 << order) < npages) {
+        order++;
+    }
+    return order;
+}
+
+int
+cm_alloc_block(unsigned npages) {
+    KASSERT(npages > 0);
+    unsigned order = cm_order(npages);
+    if (order > CM_MAX_ORDER) {
+        return -1;
+    }
+
+    spinlock_acquire(&k_coremap->cm_free_lock);
+    if (npages == 1) {
+        int ppn = cm_take_first();
+        spinlock_release(&k_coremap->cm_free_lock);
+        return ppn;
+    }
+
+    /* Split the smallest free block there is that's big enough; the
+     * rest of it stays free for smaller allocations */
+    while (order <= CM_MAX_ORDER && cm_blocks_whole(order) == 0) {
+        order++;
+    }
+    if (order > CM_MAX_ORDER) {
+        spinlock_release(&k_coremap->cm_free_lock);
+        return -1;
+    }
+    int start = cm_find_whole(order) << order;
+    for (unsigned i = 0; i < npages; i++) {
+        cm_take(start + i);
+    }
+    spinlock_release(&k_coremap->cm_free_lock);
+    return start;
+}
+
+void
+cm_free_block(int ppn, unsigned npages) {
+    KASSERT(ppn > 0 && ppn + (int)npages <= k_coremap->cm_num_pages);
+    spinlock_acquire(&k_coremap->cm_free_lock);
+    for (unsigned i = 0; i < npages; i++) {
+        KASSERT(k_coremap->cm_entries[ppn + i].cme_as == NULL);
+        KASSERT(!k_coremap->cm_entries[ppn + i].cme_busy);
+        cm_give(ppn + i);
+    }
+    spinlock_release(&k_coremap->cm_free_lock);
+}
+
+int
+cm_pick_block(unsigned npages) {
+    KASSERT(npages > 0);
+    unsigned order = cm_order(npages);
+    if (order > CM_MAX_ORDER) {
+        return -1;
+    }
+    int size = 1 << order;
+
+    int best = -1;
+    unsigned best_used = npages + 1;
+    for (int start = 0; start + size <= k_coremap->cm_num_pages;
+        start += size) {
+        unsigned used = 0;
+        for (unsigned i = 0; i < npages && used < best_used; i++) {
+            struct cm_entry *cme = &k_coremap->cm_entries[start + i];
+            spinlock_acquire(CM_LOCK(start + i));
+            bool evictable = cme->cme_as != NULL && !cme->cme_kpage;
+            bool free = cme->cme_as == NULL && !cme->cme_kpage &&
+                !cme->cme_busy && cme->cme_shm == NULL;
+            spinlock_release(CM_LOCK(start + i));
+            if (!free && !evictable) {
+                used = npages + 1;
+                break;
+            }
+            if (evictable) {
+                used++;
+            }
+        }
+        if (used < best_used) {
+            best = start;
+            best_used = used;
+        }
+    }
+    return best;
+}
+
+void
+cm_print_fragmentation(void) {
+    int blocks[CM_MAX_ORDER + 1];
+    int largest = -1;
+
+    /* Count the blocks a buddy allocator would have on each free list:
+     * free blocks whose buddy isn't free too */
+    spinlock_acquire(&k_coremap->cm_free_lock);
+    int nfree = k_coremap->cm_num_free;
+    for (unsigned order = 0; order <= CM_MAX_ORDER; order++) {
+        blocks[order] = cm_blocks_whole(order);
+        if (blocks[order] > 0) {
+            largest = order;
+        }
+    }
+    spinlock_release(&k_coremap->cm_free_lock);
+
+    kprintf("Free frames: %d\n", nfree);
+    kprintf("Free blocks by order:");
+    for (unsigned order = 0; order <= CM_MAX_ORDER; order++) {
+        kprintf(" %u:%d", order, blocks[order]);
+    }
+    kprintf("\nLargest free block: %d frames\n",
+        largest < 0 ? 0 : 1 << largest);
+}
+
+int
+cm_take_zeroed_page(void) {
+    int ppn = -1;
+    spinlock_acquire(&k_coremap->cm_zero_lock);
+    if (k_coremap->cm_num_zero > 0) {
+        ppn = k_coremap->cm_zero_pool[--k_coremap->cm_num_zero];
+    }
+    if (k_coremap->cm_num_zero <= CM_ZERO_POOL / 2 &&
+        k_coremap->cm_zero_wchan != NULL) {
+        wchan_wakeone(k_coremap->cm_zero_wchan, &k_coremap->cm_zero_lock);
+    }
+    spinlock_release(&k_coremap->cm_zero_lock);
+
+    if (ppn >= 0) {
+        KASSERT(k_coremap->cm_entries[ppn].cme_busy);
+    }
+    return ppn;
+}
+
+int
+cm_get_zeroed_page(void) {
+    int ppn = cm_take_zeroed_page();
+    if (ppn >= 0) {
+        k_vmstats.vms_zero_pool_hits++;
+    } else {
+        k_vmstats.vms_zero_pool_misses++;
+    }
+    return ppn;
+}
+
+void
+cm_drain_zero_pool(void) {
+    int frames[CM_ZERO_POOL];
+    spinlock_acquire(&k_coremap->cm_zero_lock);
+    int num = k_coremap->cm_num_zero;
+    for (int i = 0; i < num; i++) {
+        frames[i] = k_coremap->cm_zero_pool[i];
+    }
+    k_coremap->cm_num_zero = 0;
+    spinlock_release(&k_coremap->cm_zero_lock);
+
+    for (int i = 0; i < num; i++) {
+        spinlock_acquire(CM_LOCK(frames[i]));
+        k_coremap->cm_entries[frames[i]].cme_busy = 0;
+        spinlock_release(CM_LOCK(frames[i]));
+    }
+    spinlock_acquire(&k_coremap->cm_free_lock);
+    for (int i = 0; i < num; i++) {
+        cm_give(frames[i]);
+    }
+    spinlock_release(&k_coremap->cm_free_lock);
+}
+
+bool
+cm_put_zeroed_page(int ppn) {
+    KASSERT(ppn > 0 && ppn < k_coremap->cm_num_pages);
+    KASSERT(k_coremap->cm_entries[ppn].cme_as == NULL);
+    KASSERT(k_coremap->cm_entries[ppn].cme_busy);
+    bool put = false;
+    spinlock_acquire(&k_coremap->cm_zero_lock);
+    if (k_coremap->cm_num_zero < CM_ZERO_POOL) {
+        k_coremap->cm_zero_pool[k_coremap->cm_num_zero++] = ppn;
+        put = true;
+    }
+    spinlock_release(&k_coremap->cm_zero_lock);
+    return put;
+}
+
+void
+cm_zero_wait(void) {
+    spinlock_acquire(&k_coremap->cm_zero_lock);
+    while (k_coremap->cm_num_zero >= CM_ZERO_POOL) {
+        wchan_sleep(k_coremap->cm_zero_wchan, &k_coremap->cm_zero_lock);
+    }
+    spinlock_release(&k_coremap->cm_zero_lock);
+}
@@ -40,8 +40,43 @@
 #include <synch.h>
 #include <daemon.h>
 #include <vmstats.h>
-#include <clock.h>
 #include <syscall.h>
+#include <wchan.h>
+#include <clock.h>
+
+struct paging_daemon k_paging_daemon;
+
+/* Free frames below which faults wake the daemon, and up to which it
+ * frees frames once woken */
+static
+int
+daemon_watermark(int percent) {
+    return (k_coremap->cm_num_pages - k_coremap->cm_num_kpages) *
+        percent / 100;
+}
+
+/* Free frames as the watermarks see them. Frames in the zero pool are
+ * free too, since page_get and alloc_kpages take them back. */
+static
+int
+daemon_free_frames(void) {
+    return k_coremap->cm_num_free + k_coremap->cm_num_zero;
+}
+
+void
+daemon_kick(void) {
+    struct paging_daemon *pd = &k_paging_daemon;
+    if (pd->pd_wchan == NULL ||
+        daemon_free_frames() >= daemon_watermark(PAGING_DAEMON_LOW)) {
+        return;
+    }
+    spinlock_acquire(&pd->pd_lock);
+    if (!pd->pd_kicked) {
+        pd->pd_kicked = true;
+        wchan_wakeone(pd->pd_wchan, &pd->pd_lock);
+    }
+    spinlock_release(&pd->pd_lock);
+}
 
 void
 paging_daemon_thread(void *data1, unsigned long data2)
@@ -49,30 +84,83 @@ paging_daemon_thread(void *data1, unsigned long data2)
     (void) data1;
     (void) data2;
     
-    struct cm_entry *cme;
+    struct paging_daemon *pd = &k_paging_daemon;
     
     while (true) {
-        spinlock_acquire(&k_coremap->cm_lock);
-        if (k_coremap->cm_num_dirty*100/k_coremap->cm_num_pages >= PAGING_DAEMON_THRESHOLD) {
-            k_vmstats.vms_daemon_runs++;
-            for (int i = 0; i < k_coremap->cm_num_pages; i++) {
-                cme = &k_coremap->cm_entries[i];
-                if (cme->cme_exists == 0)  break;
-                if (cme->cme_busy == 1 || cme->cme_dirty == 0 || cme->cme_kpage == 1 || cme->cme_as == NULL) {
-                    continue;
-                }
-                cme->cme_busy = 1;
-                int err = page_write_out(i);
-                cme->cme_busy = 0; 
-                wchan_wakeall(k_coremap->cm_wchan, &k_coremap->cm_lock);
-                if (err) {
-                    spinlock_release(&k_coremap->cm_lock);
-                    panic("Writing daemon failed"); 
+        spinlock_acquire(&pd->pd_lock);
+        while (!pd->pd_kicked) {
+            wchan_sleep(pd->pd_wchan, &pd->pd_lock);
+        }
+        spinlock_release(&pd->pd_lock);
+        k_vmstats.vms_daemon_runs++;
+
+        /* Frames cached on cpus count as free; put them where the
+         * watermark sees them before evicting anything */
+        cm_drain_caches();
+
+        /* Evict pages a batch at a time, letting faulting threads in
+         * between batches, until enough frames are free */
+        int high = daemon_watermark(PAGING_DAEMON_HIGH);
+        while (daemon_free_frames() < high) {
+            int freed = 0;
+            while (freed < PAGING_DAEMON_BATCH &&
+                daemon_free_frames() < high) {
+                int ppn = page_evict(0);
+                if (ppn < 0) {
+                    break;
                 }
+                spinlock_acquire(CM_LOCK(ppn));
+                k_coremap->cm_entries[ppn].cme_busy = 0;
+                spinlock_release(CM_LOCK(ppn));
+                cm_free_page(ppn);
+                freed++;
             }
+            k_vmstats.vms_daemon_frees += freed;
+            if (freed < PAGING_DAEMON_BATCH) {
+                break;
+            }
+            thread_yield();
+        }
+
+        /* Faults that came in while we worked were already answered */
+        spinlock_acquire(&pd->pd_lock);
+        pd->pd_kicked = false;
+        spinlock_release(&pd->pd_lock);
+    }
+}
+
+
+void
+zero_thread(void *data1, unsigned long data2)
+{
+    (void) data1;
+    (void) data2;
+
+    while (true) {
+        cm_zero_wait();
+
+        /* Only zero while nothing else wants to run here; otherwise let
+         * the threads that do go first */
+        if (!thread_cpu_idle()) {
+            thread_yield();
+            continue;
+        }
+
+        /* Leave the last free frames to the faults that need them */
+        if (daemon_free_frames() < daemon_watermark(PAGING_DAEMON_LOW)) {
+            clocksleep(1);
+            continue;
+        }
+        int ppn = cm_get_page();
+        if (ppn < 0) {
+            clocksleep(1);
+            continue;
+        }
+
+        as_zero_region(CM_INDEX_TO_KVADDR(ppn), 1);
+        if (!cm_put_zeroed_page(ppn)) {
+            cm_put_page(ppn);
         }
-        spinlock_release(&k_coremap->cm_lock);
-        clocksleep(1);
     }
 }
 
@@ -81,6 +169,19 @@ void
 daemon_init(void) {
 
     struct proc *daemon_proc;
+    struct paging_daemon *pd = &k_paging_daemon;
+
+    spinlock_init(&pd->pd_lock);
+    pd->pd_kicked = false;
+    struct wchan *wc = wchan_create("paging daemon");
+    if (wc == NULL) {
+        panic("forking paging daemon failed");
+    }
+
+    /* Set before the daemon can run and sleep on it; faults can wake
+     * the daemon from here on, and a kick before it first sleeps is
+     * kept in pd_kicked */
+    pd->pd_wchan = wc;
 
     int res = fork_common(&daemon_proc);
     if (res) {
@@ -92,5 +193,10 @@ daemon_init(void) {
         panic("forking paging daemon failed");
     }
 
+    res = thread_fork("zero thread", daemon_proc, zero_thread, NULL, 0);
+    if (res) {
+        panic("forking zero thread failed");
+    }
+
     return;
 }
@@ -34,6 +34,8 @@
 #include <swap.h>
 #include <cpu.h>
 #include <current.h>
+#include <paging.h>
+#include <addrspace.h>
 
 /*
  * invalidates all page table entries to initialize the pgtable
@@ -43,6 +45,8 @@ pgt_init(struct pgtable *pgt)
 {
     for(int i = 0; i < PT_SIZE; i++) {
         pgt->pt_ptes[i].pte_valid = 0;
+        pgt->pt_ptes[i].pte_cow = 0;
+        pgt->pt_ptes[i].pte_file = 0;
         pgt->pt_ptes[i].pte_padding = 0;
     }
 }
@@ -51,41 +55,21 @@ pgt_init(struct pgtable *pgt)
  *  cleans up page table
  */
 void
-pgt_destroy(struct pgtable *pgt, struct addrspace *as)
+pgt_destroy(struct pgtable *pgt, struct addrspace *as, int pdi)
 {
-    struct cm_entry *cme;
     for (int i = 0; i < PT_SIZE; i++) {
-        if (pgt->pt_ptes[i].pte_valid == 1) {
-            if (pgt->pt_ptes[i].pte_present == 1) {
-                int ret = pte_acquire(as, &pgt->pt_ptes[i]);
-                if (ret == -1) {
-                    KASSERT(!pgt->pt_ptes[i].pte_present);
-                    if (pgt->pt_ptes[i].pte_ppn > 0) {
-                        swap_destroy_block(pgt->pt_ptes[i].pte_ppn, k_swap_tracker);
-                    }
-                    continue;
-                }
-                spinlock_acquire(&k_coremap->cm_lock);
-                cme = &(k_coremap->cm_entries[pgt->pt_ptes[i].pte_ppn]);
-                if (cme->cme_dirty == 1) {
-                    k_coremap->cm_num_dirty--;
-                    cme->cme_dirty = 0;
-                }
-                KASSERT(cme->cme_kernel == 0);
-                
-                cme->cme_tlb = 0;
-                cme->cme_vaddr = 0;
-                cme->cme_as = NULL;
-
-                off_t swap_location = cme->cme_swap_location;
-                spinlock_release(&k_coremap->cm_lock);
-                pte_release(as, &pgt->pt_ptes[i], ret);
-                if (swap_location > 0) {
-                    swap_destroy_block(swap_location, k_swap_tracker);
-                }
+        struct pt_entry *pte = &pgt->pt_ptes[i];
+        if (pte->pte_valid == 1) {
+            int ret = pte_acquire(as, pte);
+            if (ret >= 0) {
+                page_unmap(ret, as, PDI_PTI_TO_VADDR(pdi, i));
+                pte->pte_present = 0;
+                pte->pte_valid = 0;
+                pte_release(as, pte, ret);
             } else {
-                if (pgt->pt_ptes[i].pte_ppn > 0) {
-                    swap_destroy_block(pgt->pt_ptes[i].pte_ppn, k_swap_tracker);
+                KASSERT(!pte->pte_present);
+                if (pte->pte_ppn > 0) {
+                    swap_destroy_block(pte->pte_ppn, k_swap_tracker);
                 }
             }
         }
@@ -48,6 +48,9 @@
 #include <spl.h>
 #include <clock.h>
 #include <vmstats.h>
+#include <textcache.h>
+#include <shm.h>
+#include <daemon.h>
 
 static
 bool
@@ -55,17 +58,213 @@ in_stack(vaddr_t faultaddress) {
     return (faultaddress >= STACK_MIN && faultaddress < STACK_MAX);
 }
 
+/* Finds the PTE that maps a virtual address in an address space */
+static
+struct pt_entry *
+page_pte(struct addrspace *as, vaddr_t vaddr) {
+    struct pgtable *pde = as->as_pd[VADDR_TO_PT(vaddr)];
+    KASSERT(pde != NULL);
+    return &pde->pt_ptes[VADDR_TO_PTE(vaddr)];
+}
+
+/* Starts an empty batch of tlb mappings to shoot down */
+static
+void
+page_tlbs_init(struct tlbshootdown *t) {
+    t->tlbs_cpu = NULL;
+    t->tlbs_count = 0;
+    t->tlbs_asid = 0;
+    t->tlbs_flush_asid = false;
+    t->tlbs_flush_all = false;
+}
+
+/* Adds a mapping to a batch; a batch too big for a shootdown becomes a
+ * flush of the whole tlb */
+static
+void
+page_tlbs_add(struct tlbshootdown *t, vaddr_t vaddr, uint32_t asid) {
+    if (t->tlbs_count == TLBSHOOTDOWN_ENTRIES) {
+        t->tlbs_flush_all = true;
+        return;
+    }
+    t->tlbs_vaddrs[t->tlbs_count] = vaddr;
+    t->tlbs_asids[t->tlbs_count] = asid;
+    t->tlbs_count++;
+}
+
+/* Removes one address space from a shared page's mappings, without
+ * touching any tlb. Assumes the page's stripe lock is held. */
+static
+void
+page_drop_mapping(int ppn, struct addrspace *as, vaddr_t vaddr) {
+    KASSERT(spinlock_do_i_hold(CM_LOCK(ppn)));
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    KASSERT(cme->cme_refcount > 1);
+    struct cm_rmap *rm;
+    if (cme->cme_as == as && cme->cme_vaddr == vaddr) {
+        /* The first sharer takes over; we don't know where it runs */
+        rm = cme->cme_rmap;
+        cme->cme_as = rm->rm_as;
+        cme->cme_vaddr = rm->rm_vaddr;
+        cme->cme_rmap = rm->rm_next;
+    } else {
+        struct cm_rmap **prev = &cme->cme_rmap;
+        while ((*prev)->rm_as != as || (*prev)->rm_vaddr != vaddr) {
+            prev = &(*prev)->rm_next;
+            KASSERT(*prev != NULL);
+        }
+        rm = *prev;
+        *prev = rm->rm_next;
+    }
+    rmap_destroy(rm);
+    cme->cme_refcount--;
+}
+
+/* Points a PTE of a page that is being evicted at wherever the page
+ * can be found again: the executable for a text page, the shared
+ * memory object for a shared anonymous page, swap otherwise */
+static
+void
+page_evict_pte(struct pt_entry *pte, struct cm_entry *cme) {
+    if (cme->cme_vnode != NULL || cme->cme_shm != NULL) {
+        pte->pte_ppn = 0;
+        pte->pte_file = 1;
+    } else {
+        pte->pte_ppn = cme->cme_swap_location;
+    }
+    pte->pte_present = 0;
+    pte->pte_cow = 0;
+    KASSERT(pte->pte_padding == 0);
+}
+
+/* Marks a page busy if it can be evicted, so that we own it. Pages
+ * without an address space are free or on their way to being free. */
+static
+bool
+page_try_busy(int ppn) {
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    bool got = false;
+    spinlock_acquire(CM_LOCK(ppn));
+    if (!cme->cme_kpage && !cme->cme_busy && cme->cme_as != NULL) {
+        cme->cme_busy = 1;
+        got = true;
+    }
+    spinlock_release(CM_LOCK(ppn));
+    return got;
+}
+
+#ifdef USE_CLOCK_PAGING
+/* Runs the clock until it finds a victim, and returns it busy.
+ *
+ * Each pass of the clock over a page clears its referenced bit, giving
+ * a page that was used since the last pass a second chance; a page
+ * with tlb entries counts as used. Pages that weren't used age. The
+ * first unused clean page is taken; failing that, after a sweep over
+ * all of memory, the oldest unused dirty page; and failing that, after
+ * a second sweep, any page that can be evicted. */
+static
+int
+page_clock_victim(void) {
+    int npages = k_coremap->cm_num_pages;
+    int dirty_ppn = -1;
+    unsigned dirty_age = 0;
+    for (int i = 0; ; i++) {
+        if (i == npages && dirty_ppn >= 0) {
+            if (page_try_busy(dirty_ppn)) {
+                return dirty_ppn;
+            }
+            dirty_ppn = -1;
+        }
+
+        int ppn = cm_clock_tick();
+        if (i >= 2 * npages) {
+            if (page_try_busy(ppn)) {
+                return ppn;
+            }
+            continue;
+        }
+
+        struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+        spinlock_acquire(CM_LOCK(ppn));
+        if (cme->cme_kpage || cme->cme_busy || cme->cme_as == NULL) {
+            spinlock_release(CM_LOCK(ppn));
+            continue;
+        }
+        if (cme->cme_referenced || cme->cme_tlb > 0) {
+            cme->cme_referenced = 0;
+            cme->cme_age = 0;
+            spinlock_release(CM_LOCK(ppn));
+            continue;
+        }
+        if (cme->cme_age < PAGE_AGE_MAX) {
+            cme->cme_age++;
+        }
+        if (!cme->cme_dirty &&
+            (cme->cme_swap_location != 0 || cme->cme_vnode != NULL)) {
+            cme->cme_busy = 1;
+            spinlock_release(CM_LOCK(ppn));
+            k_vmstats.vms_clock_clean_evictions++;
+            return ppn;
+        }
+        if (dirty_ppn < 0 || cme->cme_age > dirty_age) {
+            dirty_ppn = ppn;
+            dirty_age = cme->cme_age;
+        }
+        spinlock_release(CM_LOCK(ppn));
+    }
+}
+#endif
+
+/* Marks a page busy if it is a dirty page that can go to swap */
+static
+bool
+page_try_busy_dirty(int ppn) {
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    bool got = false;
+    spinlock_acquire(CM_LOCK(ppn));
+    if (!cme->cme_kpage && !cme->cme_busy && cme->cme_as != NULL &&
+        cme->cme_vnode == NULL && cme->cme_dirty) {
+        cme->cme_busy = 1;
+        got = true;
+    }
+    spinlock_release(CM_LOCK(ppn));
+    return got;
+}
+
+/* Writes out an eviction victim, along with the dirty pages the clock
+ * head is about to reach, so that they go to swap in one transfer. The
+ * extra pages are left clean and no longer busy. */
+static
+int
+page_write_victim(int victim) {
+    int cluster[SWAP_CLUSTER];
+    unsigned n = 0;
+    cluster[n++] = victim;
+    int ppn = victim;
+    for (int i = 0; i < PAGE_CLUSTER_SCAN && n < SWAP_CLUSTER; i++) {
+        if (++ppn >= k_coremap->cm_num_pages)  ppn = 1;
+        if (ppn == victim)  break;
+        if (page_try_busy_dirty(ppn)) {
+            cluster[n++] = ppn;
+        }
+    }
+
+    int err = page_write_cluster(cluster, n);
+    for (unsigned i = 1; i < n; i++) {
+        cm_unbusy(cluster[i]);
+    }
+    return err;
+}
+
 int
 page_fault(vaddr_t faultaddress) {
     k_vmstats.vms_page_faults++;
     struct addrspace *as = curproc->p_addrspace;
     KASSERT(lock_do_i_hold(as->as_lock));
-    KASSERT(spinlock_do_i_hold(&k_coremap->cm_lock));
 
     /* Handle invalid addresses */
     if (faultaddress >= KERNEL_VADDR_START && faultaddress < KERNEL_VADDR_END) {
         lock_release(as->as_lock);
-        spinlock_release(&k_coremap->cm_lock);
         KASSERT(curthread->t_machdep.tm_badfaultfunc == NULL);
         kern__exit(0, SIGSEGV);
     }
@@ -75,7 +274,6 @@ page_fault(vaddr_t faultaddress) {
     KASSERT(pde != NULL);
     if (!pte->pte_zeroed && !in_stack(faultaddress) && pte->pte_present) {
         lock_release(as->as_lock);
-        spinlock_release(&k_coremap->cm_lock);
         KASSERT(curthread->t_machdep.tm_badfaultfunc == NULL);
         kern__exit(0, SIGSEGV);
     }
@@ -88,222 +286,569 @@ page_fault(vaddr_t faultaddress) {
 }
 
 
-int 
-page_swapin(vaddr_t vaddress) {
-    KASSERT(lock_do_i_hold(curproc->p_addrspace->as_lock));
-    KASSERT(spinlock_do_i_hold(&k_coremap->cm_lock));
+/* Brings in a page of an executable's read-only segment, mapping the
+ * frame other processes running the program use if there is one.
+ * Returns 0, with the page busy. */
+static
+int
+page_text_in(vaddr_t vaddress, struct pt_entry *pte, struct vnode *v) {
+    struct addrspace *as = curproc->p_addrspace;
 
-    /* Find a free location */
-    int ppn = page_get(1);
-    if (ppn < 0) {
+    struct cm_rmap *rm = rmap_create();
+    if (rm == NULL) {
         return ENOMEM;
     }
-    KASSERT(vaddress != 0);
-    KASSERT(ppn < k_coremap->cm_num_pages);
-    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
-    KASSERT(cme->cme_as == NULL && !cme->cme_kpage && cme->cme_busy);
-    
-    /* If the page is in swap, bring it into memory */
-    int pdi = VADDR_TO_PT(vaddress);
-    struct pgtable *pde = curproc->p_addrspace->as_pd[pdi];
-    KASSERT(pde != NULL);
-    int pti = VADDR_TO_PTE(vaddress);
-    struct pt_entry *pte = &(pde->pt_ptes[pti]);
-    int swap_location =
-        pte->pte_valid && 
-        !pte->pte_zeroed ?
-        pte->pte_ppn : 0;
-    if (swap_location) {
-        spinlock_release(&k_coremap->cm_lock);
-        if (swap_read(ppn, swap_location, k_swap_tracker)) {
-            panic("swap read failed");
-        }
-        spinlock_acquire(&k_coremap->cm_lock);
+
+    int ppn = textcache_get(v, vaddress);
+    if (ppn >= 0) {
+        page_share(ppn, as, vaddress, rm);
+        k_vmstats.vms_text_shares++;
+        as->as_stats.ms_minor_faults++;
     } else {
-        /* zero out page */
-        as_zero_region(CM_INDEX_TO_KVADDR(ppn), 1);
+        rmap_destroy(rm);
+        ppn = page_get(1);
+        if (ppn < 0) {
+            return ENOMEM;
+        }
+        int err = as_load_page(as, vaddress, ppn);
+        if (err) {
+            cm_put_page(ppn);
+            return err;
+        }
+        k_vmstats.vms_file_page_faults++;
+        as->as_stats.ms_major_faults++;
+
+        struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+        spinlock_acquire(CM_LOCK(ppn));
+        KASSERT(cme->cme_as == NULL && !cme->cme_kpage && cme->cme_busy);
+        cme->cme_as = as;
+        cme->cme_vaddr = vaddress;
+        cme->cme_swap_location = 0;
+        cme->cme_rmap = NULL;
+        cme->cme_vnode = v;
+        cme->cme_shm = NULL;
+        cme->cme_shm_index = 0;
+        cme->cme_refcount = 1;
+        cme->cme_dirty = 0;
+        cme->cme_readahead = 0;
+        cme->cme_referenced = 0;
+        cme->cme_age = 0;
+        cme->cme_tlb = 0;
+        cme->cme_kernel = 0;
+        cme->cme_kpage = 0;
+        cme->cme_exists = 1;
+        spinlock_release(CM_LOCK(ppn));
+
+        textcache_add(v, vaddress, ppn);
     }
 
+    KASSERT(pte->pte_present == 0);
+    KASSERT(pte->pte_padding == 0);
+    pte->pte_ppn = ppn;
+    pte->pte_present = 1;
+    pte->pte_zeroed = 0;
+    pte->pte_cow = 0;
+    pte->pte_file = 0;
+
+    return 0;
+}
+
+/* Maps a frame that was just filled in at a virtual address, with the
+ * swap block it came from, if any. Assumes the address space lock is
+ * held and the frame is busy. */
+static
+void
+page_map_in(int ppn, struct addrspace *as, vaddr_t vaddress,
+    struct pt_entry *pte, int swap_location, bool readahead) {
+    /* The frame keeps our reference to its swap block even if other
+     * address spaces still refer to it too; a dirty page is written to
+     * a block of its own */
+
     /* Update the coremap */
-    cme->cme_as = curproc->p_addrspace;
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    spinlock_acquire(CM_LOCK(ppn));
+    KASSERT(cme->cme_as == NULL && !cme->cme_kpage && cme->cme_busy);
+    cme->cme_as = as;
     cme->cme_vaddr = vaddress;
     cme->cme_swap_location = swap_location;
-    cme->cme_owner_cpu = curcpu;
+    cme->cme_rmap = NULL;
+    cme->cme_vnode = NULL;
+    cme->cme_shm = NULL;
+    cme->cme_shm_index = 0;
+    cme->cme_refcount = 1;
     cme->cme_dirty = 0;
+    cme->cme_readahead = readahead;
+    cme->cme_referenced = 0;
+    cme->cme_age = 0;
     cme->cme_tlb = 0;
-    cme->cme_busy = 0;
     cme->cme_kernel = 0;
     cme->cme_kpage = 0;
     cme->cme_exists = 1;
+    spinlock_release(CM_LOCK(ppn));
 
     /* Update the PTE
      * No need to acquire the PTE here, because we already hold the as_lock
-     * and the page isn't in the coremap yet
+     * and the page is busy
      */
     
     KASSERT(pte->pte_padding == 0);
     KASSERT(pte->pte_present == 0);
     KASSERT(ppn != 0);
     pte->pte_ppn = ppn;
+    if (!pte->pte_valid) {
+        /* new stack and heap pages */
+        pte->pte_writeable = 1;
+    }
     pte->pte_valid = 1;
-    pte->pte_writeable = 1;
     pte->pte_present = 1;
     pte->pte_zeroed = 0;
-
-    wchan_wakeall(k_coremap->cm_wchan, &k_coremap->cm_lock);
-
-    return 0;
+    pte->pte_cow = 0;
+    pte->pte_file = 0;
 }
 
-int 
-page_get(unsigned from_page_fault) {
-    KASSERT(spinlock_do_i_hold(&k_coremap->cm_lock));
-    
-    int clean_ppn = -1;
+/* Picks the pages to read in along with a page faulted in from swap:
+ * the pages after it that are in swap, in the blocks after its block.
+ * Fills in the free frames to read them into after ppns[0], which
+ * holds the faulting page's frame, and returns how many frames there
+ * are in all.
+ *
+ * The window widens when faults come in order, and when pages read
+ * ahead get used; it narrows when they get evicted unused. Frames are
+ * only taken if they are free, so reading ahead never evicts. */
+static
+unsigned
+page_gather_around(struct addrspace *as, vaddr_t vaddress,
+    int swap_location, int *ppns) {
+    KASSERT(lock_do_i_hold(as->as_lock));
+    if (vaddress == as->as_ra_next) {
+        as->as_ra_window *= 2;
+    }
+    if (as->as_ra_window > SWAP_CLUSTER) {
+        as->as_ra_window = SWAP_CLUSTER;
+    }
 
-    #ifdef USE_LAST_CLEAN_PAGING
-    /* Algorithm 1: look for a clean or free page first, if neither
-       exist then evict a random page */
-    for (int i = 0; i < k_coremap->cm_num_pages; ++i) {
-        if (k_coremap->cm_entries[i].cme_as == NULL &&
-            k_coremap->cm_entries[i].cme_kpage == 0 &&
-            k_coremap->cm_entries[i].cme_busy == 0) {
-            /* free page found */
-            k_coremap->cm_entries[i].cme_busy = 1;
-            return i;
-        }
-        else if (k_coremap->cm_entries[i].cme_dirty == 0 &&
-            k_coremap->cm_entries[i].cme_kpage == 0 &&
-            k_coremap->cm_entries[i].cme_busy == 0 &&
-            k_coremap->cm_entries[i].cme_swap_location != 0) {
-            clean_ppn = i;
+    unsigned n = 1;
+    while (n < as->as_ra_window) {
+        vaddr_t v = vaddress + n * PAGE_SIZE;
+        if (v >= KERNEL_VADDR_START) {
+            break;
+        }
+        struct pgtable *pde = as->as_pd[VADDR_TO_PT(v)];
+        if (pde == NULL) {
+            break;
         }
+        struct pt_entry *pte = &pde->pt_ptes[VADDR_TO_PTE(v)];
+        if (!pte->pte_valid || pte->pte_present || pte->pte_zeroed ||
+            pte->pte_file || pte->pte_ppn != (unsigned)(swap_location + n)) {
+            break;
+        }
+        int ppn = cm_get_page();
+        if (ppn < 0) {
+            break;
+        }
+        ppns[n++] = ppn;
     }
+    as->as_ra_next = vaddress + n * PAGE_SIZE;
+    return n;
+}
 
-    /* Clean page found */
-    if (clean_ppn >= 0 && random() % 10 >= 1) {
-        k_coremap->cm_entries[clean_ppn].cme_busy = 1;
+/* Brings in a page of a shared anonymous mapping, mapping the frame
+ * the other processes sharing it use if there is one. Returns 0, with
+ * the page busy. */
+static
+int
+page_shm_in(vaddr_t vaddress, struct pt_entry *pte, struct shm_object *so,
+    unsigned index) {
+    struct addrspace *as = curproc->p_addrspace;
+    struct shm_page *sp = &so->so_pages[index];
+
+    struct cm_rmap *rm = rmap_create();
+    if (rm == NULL) {
+        return ENOMEM;
     }
-    
-    /* No clean or free page found; write out a random non-kernel page */
-    else {
-        do {
-            clean_ppn = random() % k_coremap->cm_num_pages;
-        } while (k_coremap->cm_entries[clean_ppn].cme_kpage ||
-            k_coremap->cm_entries[clean_ppn].cme_busy);
-        k_coremap->cm_entries[clean_ppn].cme_busy = 1;
-        int err = page_write_out(clean_ppn);
-        if (err) {
-            k_coremap->cm_entries[clean_ppn].cme_busy = 0;
-            wchan_wakeall(k_coremap->cm_wchan, &k_coremap->cm_lock);
-            return -1;
+
+    /* The object lock keeps anyone else from bringing the page in, but
+     * not the page from being evicted, so the frame is checked again
+     * once its stripe lock is held */
+    lock_acquire(so->so_lock);
+    int ppn;
+    while (true) {
+        ppn = sp->sp_ppn;
+        if (ppn == 0) {
+            break;
         }
-        if (from_page_fault)  k_vmstats.vms_write_page_faults++;
+        struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+        spinlock_acquire(CM_LOCK(ppn));
+        if (cme->cme_shm != so || cme->cme_shm_index != index) {
+            spinlock_release(CM_LOCK(ppn));
+            continue;
+        }
+        if (cme->cme_busy) {
+            wchan_sleep(CM_STRIPE(ppn)->cs_wchan, CM_LOCK(ppn));
+            spinlock_release(CM_LOCK(ppn));
+            continue;
+        }
+        cme->cme_busy = 1;
+
+        /* A page nobody maps anymore is ours alone */
+        if (cme->cme_as == NULL) {
+            cme->cme_as = as;
+            cme->cme_vaddr = vaddress;
+            cme->cme_rmap = NULL;
+            cme->cme_refcount = 1;
+            cme->cme_referenced = 0;
+            cme->cme_age = 0;
+            spinlock_release(CM_LOCK(ppn));
+            rmap_destroy(rm);
+        } else {
+            spinlock_release(CM_LOCK(ppn));
+            page_share(ppn, as, vaddress, rm);
+        }
+        k_vmstats.vms_shm_shares++;
+        as->as_stats.ms_minor_faults++;
+        break;
     }
 
-    #endif
+    if (ppn == 0) {
+        rmap_destroy(rm);
 
-    #ifdef USE_CLOCK_PAGING
-    /* Algorithm 2: look for a free page first. If one is not found, then
-     * try to find a clean page starting at the current clock head.
-     * If a clean page isn't found, then evict the first evictable
-     * page that the clockhead finds*/
-    
-    /* try to find a free page */
-    for (int i = 0; i < k_coremap->cm_num_pages; ++i) {
-        if (k_coremap->cm_entries[i].cme_as == 0 &&
-            k_coremap->cm_entries[i].cme_kpage == 0 &&
-            k_coremap->cm_entries[i].cme_busy == 0) {
-            /* free page found */
-            k_coremap->cm_entries[i].cme_busy = 1;
-            return i;
+        /* The object's swap block goes to the frame, as for any page
+         * read in from swap */
+        int swap_location = sp->sp_swap;
+        bool zeroed = false;
+        ppn = -1;
+        if (!swap_location) {
+            ppn = cm_get_zeroed_page();
+            zeroed = (ppn >= 0);
         }
+        if (ppn < 0) {
+            ppn = page_get(1);
+        }
+        if (ppn < 0) {
+            lock_release(so->so_lock);
+            return ENOMEM;
+        }
+        if (swap_location) {
+            if (swap_read(ppn, swap_location, k_swap_tracker)) {
+                panic("swap read failed");
+            }
+            as->as_stats.ms_major_faults++;
+            as->as_stats.ms_swapins++;
+        } else {
+            if (!zeroed) {
+                as_zero_region(CM_INDEX_TO_KVADDR(ppn), 1);
+            }
+            as->as_stats.ms_minor_faults++;
+        }
+        page_map_in(ppn, as, vaddress, pte, swap_location, false);
+
+        struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+        spinlock_acquire(CM_LOCK(ppn));
+        cme->cme_shm = so;
+        cme->cme_shm_index = index;
+        sp->sp_swap = 0;
+        sp->sp_ppn = ppn;
+        spinlock_release(CM_LOCK(ppn));
+        k_vmstats.vms_shm_faults++;
+        lock_release(so->so_lock);
+        return 0;
     }
+    lock_release(so->so_lock);
 
-    /* try to get a clean page */
-    for (int i = 0; i < k_coremap->cm_num_pages; ++i) {
-        int clock = k_coremap->cm_clock_head;
-        if (k_coremap->cm_entries[clock].cme_as == NULL &&
-            k_coremap->cm_entries[clock].cme_kpage == 0 &&
-            k_coremap->cm_entries[clock].cme_busy == 0 &&
-            k_coremap->cm_entries[clock].cme_swap_location != 0) {
-            /* clean page found */
-            clean_ppn = clock;
-            break;
+    KASSERT(pte->pte_present == 0);
+    KASSERT(pte->pte_padding == 0);
+    pte->pte_ppn = ppn;
+    pte->pte_present = 1;
+    pte->pte_zeroed = 0;
+    pte->pte_cow = 0;
+    pte->pte_file = 0;
+
+    return 0;
+}
+
+int 
+page_swapin(vaddr_t vaddress) {
+    KASSERT(lock_do_i_hold(curproc->p_addrspace->as_lock));
+
+    /* Pages of shared anonymous mappings belong to their object */
+    struct pt_entry *file_pte = page_pte(curproc->p_addrspace, vaddress);
+    if (file_pte->pte_valid && file_pte->pte_file) {
+        unsigned index;
+        struct shm_object *so =
+            as_page_shm(curproc->p_addrspace, vaddress, &index);
+        if (so != NULL) {
+            return page_shm_in(vaddress, file_pte, so, index);
         }
-        k_coremap->cm_clock_head++;
-        if (k_coremap->cm_clock_head >= k_coremap->cm_num_pages) {
-            k_coremap->cm_clock_head = 0;
+    }
+
+    /* Read-only pages of executables are shared */
+    if (file_pte->pte_valid && file_pte->pte_file &&
+        !file_pte->pte_writeable) {
+        struct vnode *v = as_page_vnode(curproc->p_addrspace, vaddress);
+        if (v != NULL) {
+            return page_text_in(vaddress, file_pte, v);
         }
     }
 
-    /* Clean page found */
-    if (clean_ppn >= 0) {
-        k_coremap->cm_entries[clean_ppn].cme_busy = 1;
+    struct addrspace *as = curproc->p_addrspace;
+    int pdi = VADDR_TO_PT(vaddress);
+    struct pgtable *pde = as->as_pd[pdi];
+    KASSERT(pde != NULL);
+    int pti = VADDR_TO_PTE(vaddress);
+    struct pt_entry *pte = &(pde->pt_ptes[pti]);
+    int swap_location =
+        pte->pte_valid && 
+        !pte->pte_zeroed ?
+        pte->pte_ppn : 0;
+
+    /* Find a free location; a page that starts out zeroed can take one
+     * that already is */
+    int ppn = -1;
+    bool zeroed = false;
+    if (!swap_location && !pte->pte_file) {
+        ppn = cm_get_zeroed_page();
+        zeroed = (ppn >= 0);
+    }
+    if (ppn < 0) {
+        ppn = page_get(1);
+    }
+    if (ppn < 0) {
+        return ENOMEM;
     }
+    KASSERT(vaddress != 0);
+    KASSERT(ppn < k_coremap->cm_num_pages);
+    KASSERT(k_coremap->cm_entries[ppn].cme_as == NULL);
     
-    /* No clean or free page found; write out a non-kernel page */
-    else {
-        do {
-            clean_ppn = k_coremap->cm_clock_head;
-            k_coremap->cm_clock_head++;
-            if (k_coremap->cm_clock_head >= k_coremap->cm_num_pages) {
-                k_coremap->cm_clock_head = 0;
-            }
-        } while (k_coremap->cm_entries[clean_ppn].cme_kpage ||
-            k_coremap->cm_entries[clean_ppn].cme_busy);
-        k_coremap->cm_entries[clean_ppn].cme_busy = 1;
-        int err = page_write_out(clean_ppn);
+    /* If the page is in swap, bring it into memory */
+    if (swap_location) {
+        /* Read the neighbouring pages in with it, if they are next to it
+         * in swap too */
+        int ppns[SWAP_CLUSTER];
+        ppns[0] = ppn;
+        unsigned n = page_gather_around(as, vaddress, swap_location, ppns);
+        if (swap_read_run(ppns, n, swap_location, k_swap_tracker)) {
+            panic("swap read failed");
+        }
+        for (unsigned i = 1; i < n; i++) {
+            vaddr_t v = vaddress + i * PAGE_SIZE;
+            page_map_in(ppns[i], as, v, page_pte(as, v), swap_location + i,
+                true);
+            cm_unbusy(ppns[i]);
+        }
+        k_vmstats.vms_readaround_pages += n - 1;
+        as->as_stats.ms_major_faults++;
+        as->as_stats.ms_swapins += n;
+    } else if (pte->pte_file) {
+        /* first touch of a page backed by the executable */
+        int err = as_load_page(as, vaddress, ppn);
         if (err) {
-            k_coremap->cm_entries[clean_ppn].cme_busy = 0;
-            wchan_wakeall(k_coremap->cm_wchan, &k_coremap->cm_lock);
-            return -1;
+            cm_put_page(ppn);
+            return err;
+        }
+        k_vmstats.vms_file_page_faults++;
+        as->as_stats.ms_major_faults++;
+    } else {
+        /* zero out page */
+        if (!zeroed) {
+            as_zero_region(CM_INDEX_TO_KVADDR(ppn), 1);
+        }
+        as->as_stats.ms_minor_faults++;
+    }
+
+    /* The page stays busy for the caller */
+    page_map_in(ppn, as, vaddress, pte, swap_location, false);
+
+    return 0;
+}
+
+/* Makes sure an eviction victim can be found again once it's gone,
+ * writing it out with its cluster if swap doesn't have it. Assumes the
+ * page is busy. */
+static
+int
+page_clean(int ppn, unsigned from_page_fault) {
+    struct cm_entry *victim = &k_coremap->cm_entries[ppn];
+    if (victim->cme_vnode == NULL &&
+        (victim->cme_dirty || victim->cme_swap_location == 0)) {
+        int err = page_write_victim(ppn);
+        if (err) {
+            return err;
         }
         if (from_page_fault)  k_vmstats.vms_write_page_faults++;
     }
-    #endif
+    return 0;
+}
 
-    /* No free page found; update (possibly newly) cleaned page information */
+/* Unmaps a busy page that swap or its executable has a copy of, from
+ * every address space, leaving the frame busy and unused. */
+static
+void
+page_drop(int clean_ppn) {
+    /* Update the cleaned page information */
     KASSERT(clean_ppn != 0 && clean_ppn != -1);
-    struct cm_entry *cme= &k_coremap->cm_entries[clean_ppn];
+    struct cm_entry *cme = &k_coremap->cm_entries[clean_ppn];
     KASSERT(cme->cme_vaddr != 0);
-    struct pgtable *pde = cme->cme_as->as_pd[VADDR_TO_PT(cme->cme_vaddr)];
-    KASSERT(pde != NULL);
+    KASSERT(cme->cme_swap_location != 0 || cme->cme_vnode != NULL);
 
     /* Shoot down tlb */
-    if (cme->cme_tlb == 1) {
-        struct tlbshootdown t;
-        t.tlbs_cpu = cme->cme_owner_cpu;
-        t.tlbs_vaddr = cme->cme_vaddr;
-        t.tlbs_flush_all = false;
-        vm_tlbshootdown(&t);
-        while (cme->cme_tlb) {
-            wchan_sleep(k_coremap->cm_tlb_wchan, &k_coremap->cm_lock);
+    page_tlb_evict(clean_ppn);
+
+    /* A text page is dropped without a write, and read in again from
+     * its executable */
+    if (cme->cme_vnode != NULL) {
+        textcache_remove(clean_ppn);
+        k_vmstats.vms_text_drops++;
+    }
+
+    /* Point every PTE that maps the page at where it can be found */
+    spinlock_acquire(CM_LOCK(clean_ppn));
+    struct pt_entry *pte = page_pte(cme->cme_as, cme->cme_vaddr);
+    KASSERT(pte->pte_ppn == clean_ppn);
+    page_evict_pte(pte, cme);
+    while (cme->cme_rmap != NULL) {
+        struct cm_rmap *rm = cme->cme_rmap;
+        cme->cme_rmap = rm->rm_next;
+        pte = page_pte(rm->rm_as, rm->rm_vaddr);
+        KASSERT(pte->pte_ppn == clean_ppn);
+        page_evict_pte(pte, cme);
+        if (cme->cme_vnode == NULL && cme->cme_shm == NULL) {
+            swap_share_block(cme->cme_swap_location, k_swap_tracker);
         }
-        KASSERT(cme->cme_tlb == 0);
+        rmap_destroy(rm);
     }
 
-    /* Update PTE */
-    KASSERT(cme->cme_as->as_pd[VADDR_TO_PT(cme->cme_vaddr)]->
-        pt_ptes[VADDR_TO_PTE(cme->cme_vaddr)].pte_ppn == clean_ppn);
-    struct pt_entry *pte = &(pde->pt_ptes[VADDR_TO_PTE(cme->cme_vaddr)]);
+    /* A shared anonymous page's object takes over its swap block */
+    if (cme->cme_shm != NULL) {
+        struct shm_page *sp = &cme->cme_shm->so_pages[cme->cme_shm_index];
+        KASSERT(sp->sp_ppn == clean_ppn);
+        sp->sp_swap = cme->cme_swap_location;
+        sp->sp_ppn = 0;
+        cme->cme_shm = NULL;
+        cme->cme_shm_index = 0;
+    }
 
-    KASSERT(cme->cme_swap_location != 0);
-    pte->pte_ppn = cme->cme_swap_location;
-    pte->pte_present = 0;
-    KASSERT(pte->pte_padding == 0);
+    /* A page read ahead that never got used narrows its address space's
+     * read-around window. The address space lock isn't held; a lost
+     * update only costs the heuristic. */
+    if (cme->cme_readahead) {
+        k_vmstats.vms_readaround_waste++;
+        if (cme->cme_as->as_ra_window > 1) {
+            cme->cme_as->as_ra_window /= 2;
+        }
+        cme->cme_readahead = 0;
+    }
 
     /* Remove from coremap */
+    cm_set_dirty(clean_ppn, false);
     cme->cme_as = NULL;
     cme->cme_vaddr = 0;
     cme->cme_swap_location = 0;
-    cme->cme_owner_cpu = NULL; 
-    cme->cme_dirty = 0;
+    cme->cme_vnode = NULL;
+    cme->cme_refcount = 0;
     cme->cme_tlb = 0;
     cme->cme_kernel = 0;
     cme->cme_kpage = 0;
     cme->cme_exists = 1;
 
+    /* Anyone waiting on a PTE we just pointed at swap can go on */
+    wchan_wakeall(CM_STRIPE(clean_ppn)->cs_wchan, CM_LOCK(clean_ppn));
+    spinlock_release(CM_LOCK(clean_ppn));
+
+}
+
+int
+page_evict_frame(int ppn) {
+    if (!page_try_busy(ppn)) {
+        return -1;
+    }
+    if (page_clean(ppn, 0)) {
+        cm_unbusy(ppn);
+        return -1;
+    }
+    page_drop(ppn);
+    return ppn;
+}
+
+int 
+page_get(unsigned from_page_fault) {
+    /* Take a free page if there is one, and have the daemon free more
+     * before we run out */
+    int free_ppn = cm_get_page();
+    daemon_kick();
+    if (free_ppn >= 0) {
+        return free_ppn;
+    }
+
+    /* Zeroed frames are free too */
+    free_ppn = cm_take_zeroed_page();
+    if (free_ppn >= 0) {
+        return free_ppn;
+    }
+
+    /* So are frames other cpus have cached; take those before evicting */
+    cm_drain_caches();
+    free_ppn = cm_get_page();
+    if (free_ppn >= 0) {
+        return free_ppn;
+    }
+
+    return page_evict(from_page_fault);
+}
+
+int
+page_evict(unsigned from_page_fault) {
+    int clean_ppn = -1;
+
+    #ifdef USE_LAST_CLEAN_PAGING
+    /* Algorithm 1: look for a clean page first, if there isn't one
+       then evict a random page */
+    for (int i = 0; i < k_coremap->cm_num_pages; ++i) {
+        struct cm_entry *cme = &k_coremap->cm_entries[i];
+        spinlock_acquire(CM_LOCK(i));
+        if (cme->cme_dirty == 0 &&
+            cme->cme_kpage == 0 &&
+            cme->cme_busy == 0 &&
+            (cme->cme_swap_location != 0 || cme->cme_vnode != NULL)) {
+            clean_ppn = i;
+        }
+        spinlock_release(CM_LOCK(i));
+    }
+
+    /* Clean page found; it may have been written to since we looked */
+    bool clean = false;
+    if (clean_ppn >= 0 && random() % 10 >= 1 && page_try_busy(clean_ppn)) {
+        clean = (k_coremap->cm_entries[clean_ppn].cme_dirty == 0);
+    }
+    
+    /* No clean page found; write out a random non-kernel page */
+    else {
+        do {
+            clean_ppn = random() % k_coremap->cm_num_pages;
+        } while (!page_try_busy(clean_ppn));
+    }
+    if (!clean && k_coremap->cm_entries[clean_ppn].cme_vnode == NULL) {
+        int err = page_write_out(clean_ppn);
+        if (err) {
+            cm_unbusy(clean_ppn);
+            return -1;
+        }
+        if (from_page_fault)  k_vmstats.vms_write_page_faults++;
+    }
+
+    #endif
+
+    #ifdef USE_CLOCK_PAGING
+    /* Algorithm 2: WSClock; evict the first clean page the clockhead
+     * finds that wasn't used since it last came by, or else the oldest
+     * such dirty page */
+    clean_ppn = page_clock_victim();
+    if (page_clean(clean_ppn, from_page_fault)) {
+        cm_unbusy(clean_ppn);
+        return -1;
+    }
+    #endif
+
+    page_drop(clean_ppn);
     return clean_ppn;
 }
 
@@ -311,52 +856,429 @@ page_get(unsigned from_page_fault) {
 int 
 page_write_out(int ppn) {
     KASSERT(ppn > 0);
-    KASSERT(spinlock_do_i_hold(&k_coremap->cm_lock));
     struct cm_entry *cme= &k_coremap->cm_entries[ppn];
     KASSERT(cme->cme_kpage == 0);
     KASSERT(cme->cme_busy == 1);
 
-    /* Figure out where to write out the page */
+    /* Figure out where to write out the page. A block other address
+     * spaces still refer to keeps its contents for them. */
     off_t swap_location = cme->cme_swap_location;
+    if (swap_location != 0 &&
+        swap_unshare_block(swap_location, k_swap_tracker)) {
+        swap_location = 0;
+        spinlock_acquire(CM_LOCK(ppn));
+        cme->cme_swap_location = 0;
+        spinlock_release(CM_LOCK(ppn));
+    }
     if (swap_location == 0) {
-        struct pt_entry *pte = &cme->cme_as->as_pd[VADDR_TO_PT(cme->cme_vaddr)]
-            ->pt_ptes[VADDR_TO_PTE(cme->cme_vaddr)];
         swap_location = swap_find_free(k_swap_tracker);
         if (swap_location == 0)  panic("Swap location 0 was allocated");
         if (swap_location < 0)  return ENOMEM;
         KASSERT(cme->cme_vaddr != 0);
+        spinlock_acquire(CM_LOCK(ppn));
+        struct pt_entry *pte = page_pte(cme->cme_as, cme->cme_vaddr);
         pte->pte_zeroed = 0;
         KASSERT(pte->pte_ppn == ppn);
         KASSERT(pte->pte_padding == 0);
+        cme->cme_swap_location = swap_location;
+        spinlock_release(CM_LOCK(ppn));
     }
 
+    /* Take the page out of every tlb first, so nothing can write to it
+     * while it's being written out and get marked clean anyway */
+    page_tlb_evict(ppn);
+
     /* Write out the page */
-    spinlock_release(&k_coremap->cm_lock);
     if (swap_write(ppn, swap_location, k_swap_tracker)) {
         panic("swap write failed");
     }
-    spinlock_acquire(&k_coremap->cm_lock);
+    cme->cme_as->as_stats.ms_swapouts++;
 
     /* Mark page as clean */
-    if(cme->cme_dirty == 1) {
-        k_coremap->cm_num_dirty--;
+    spinlock_acquire(CM_LOCK(ppn));
+    cm_set_dirty(ppn, false);
+    spinlock_release(CM_LOCK(ppn));
+    
+    return 0;
+}
+
+
+int
+page_write_cluster(const int *ppns, unsigned npages) {
+    KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
+
+    unsigned done = 0;
+    while (done < npages) {
+        /* Take as long a run of blocks as swap has, up to the rest of
+         * the batch */
+        unsigned run;
+        off_t swap_location =
+            swap_find_run(k_swap_tracker, npages - done, &run);
+        if (swap_location == 0)  panic("Swap location 0 was allocated");
+        if (swap_location < 0) {
+            /* What got written is good; the rest stays dirty */
+            return done > 0 ? 0 : ENOMEM;
+        }
+
+        for (unsigned i = 0; i < run; i++) {
+            int ppn = ppns[done + i];
+            struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+            KASSERT(ppn > 0);
+            KASSERT(cme->cme_kpage == 0);
+            KASSERT(cme->cme_busy == 1);
+            KASSERT(cme->cme_vnode == NULL);
+            KASSERT(cme->cme_vaddr != 0);
+
+            spinlock_acquire(CM_LOCK(ppn));
+            int old_location = cme->cme_swap_location;
+            struct pt_entry *pte = page_pte(cme->cme_as, cme->cme_vaddr);
+            pte->pte_zeroed = 0;
+            KASSERT(pte->pte_ppn == ppn);
+            KASSERT(pte->pte_padding == 0);
+            cme->cme_swap_location = swap_location + i;
+            spinlock_release(CM_LOCK(ppn));
+
+            /* The copy in the old block is stale now */
+            if (old_location != 0) {
+                swap_destroy_block(old_location, k_swap_tracker);
+            }
+        }
+
+        /* As in page_write_out, nothing may write to the pages while
+         * they're being written out */
+        page_tlb_evict_batch(&ppns[done], run);
+
+        if (swap_write_run(&ppns[done], run, swap_location, k_swap_tracker)) {
+            panic("swap write failed");
+        }
+
+        for (unsigned i = 0; i < run; i++) {
+            int ppn = ppns[done + i];
+            struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+            cme->cme_as->as_stats.ms_swapouts++;
+            spinlock_acquire(CM_LOCK(ppn));
+            cm_set_dirty(ppn, false);
+            spinlock_release(CM_LOCK(ppn));
+        }
+
+        done += run;
     }
+
+    return 0;
+}
+
+
+int
+page_cow_break(vaddr_t vaddress, struct pt_entry *pte) {
+    struct addrspace *as = curproc->p_addrspace;
+    KASSERT(lock_do_i_hold(as->as_lock));
+    KASSERT(pte->pte_present && pte->pte_cow && pte->pte_writeable);
+
+    int old_ppn = pte->pte_ppn;
+    struct cm_entry *old_cme = &k_coremap->cm_entries[old_ppn];
+    KASSERT(old_cme->cme_busy);
+    KASSERT(page_mapped_by(old_ppn, as));
+
+    /* Nobody else shares the page anymore; take it over */
+    as->as_stats.ms_minor_faults++;
+    if (old_cme->cme_refcount == 1) {
+        pte->pte_cow = 0;
+        return 0;
+    }
+
+    /* Copy the page into an empty block in memory */
+    int new_ppn = page_get(1);
+    if (new_ppn < 0) {
+        return ENOMEM;
+    }
+    KASSERT(new_ppn != old_ppn);
+    struct cm_entry *cme = &k_coremap->cm_entries[new_ppn];
+    KASSERT(cme->cme_as == NULL && !cme->cme_kpage && cme->cme_busy);
+    memmove((void *)CM_INDEX_TO_KVADDR(new_ppn),
+        (const void *)CM_INDEX_TO_KVADDR(old_ppn),
+        PAGE_SIZE);
+
+    /* Update the coremap */
+    spinlock_acquire(CM_LOCK(new_ppn));
+    cme->cme_as = as;
+    cme->cme_vaddr = vaddress;
+    cme->cme_swap_location = 0;
+    cme->cme_rmap = NULL;
+    cme->cme_vnode = NULL;
+    cme->cme_shm = NULL;
+    cme->cme_shm_index = 0;
+    cme->cme_refcount = 1;
     cme->cme_dirty = 0;
-    cme->cme_swap_location = swap_location;
+    cme->cme_readahead = 0;
+    cme->cme_referenced = 0;
+    cme->cme_age = 0;
+    cme->cme_tlb = 0;
+    cme->cme_kernel = 0;
+    cme->cme_kpage = 0;
+    cme->cme_exists = 1;
+    spinlock_release(CM_LOCK(new_ppn));
 
-    /* Update tlb as clean */
-    /* Shoot down tlb */
-    if (cme->cme_tlb == 1) {
-        struct tlbshootdown t;
-        t.tlbs_cpu = cme->cme_owner_cpu;
-        t.tlbs_vaddr = cme->cme_vaddr;
-        t.tlbs_flush_all = false;
+    /* Update the PTE */
+    pte->pte_ppn = new_ppn;
+    pte->pte_cow = 0;
+    KASSERT(pte->pte_padding == 0);
+
+    /* Stop sharing the old page. Our tlb entry for it is on this cpu,
+     * and gets overwritten by the caller. */
+    spinlock_acquire(CM_LOCK(old_ppn));
+    KASSERT(old_cme->cme_refcount > 1);
+    page_drop_mapping(old_ppn, as, vaddress);
+    old_cme->cme_busy = 0;
+    wchan_wakeall(CM_STRIPE(old_ppn)->cs_wchan, CM_LOCK(old_ppn));
+    spinlock_release(CM_LOCK(old_ppn));
+
+    k_vmstats.vms_cow_faults++;
+    return 0;
+}
+
+
+void
+page_share(int ppn, struct addrspace *as, vaddr_t vaddr, struct cm_rmap *rm) {
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    KASSERT(cme->cme_busy && cme->cme_as != NULL && !cme->cme_kpage);
+    KASSERT(rm != NULL);
+
+    spinlock_acquire(CM_LOCK(ppn));
+    rm->rm_as = as;
+    rm->rm_vaddr = vaddr;
+    rm->rm_next = cme->cme_rmap;
+    cme->cme_rmap = rm;
+    cme->cme_refcount++;
+    spinlock_release(CM_LOCK(ppn));
+}
+
+
+void
+page_unmap(int ppn, struct addrspace *as, vaddr_t vaddr) {
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    KASSERT(cme->cme_busy);
+    KASSERT(cme->cme_kpage == 0 && cme->cme_kernel == 0);
+
+    /* Other address spaces still share the page; only drop our mapping */
+    if (cme->cme_refcount > 1) {
+        spinlock_acquire(CM_LOCK(ppn));
+        unsigned tlb = cme->cme_tlb;
+        spinlock_release(CM_LOCK(ppn));
+        if (tlb > 0) {
+            struct tlbshootdown t;
+            page_tlbs_init(&t);
+            page_tlbs_add(&t, vaddr, as->as_asid);
+            as_tlbshootdown(as, &t);
+        }
+        spinlock_acquire(CM_LOCK(ppn));
+        page_drop_mapping(ppn, as, vaddr);
+        spinlock_release(CM_LOCK(ppn));
+        return;
+    }
+
+    /* We're the last one. A shared anonymous page that other regions
+     * may still map goes back to its object. The object can't gain
+     * holders behind our back, since only a fork of a holder adds one;
+     * if it loses them, the last one frees the page with the object. */
+    KASSERT(cme->cme_as == as && cme->cme_vaddr == vaddr);
+    KASSERT(cme->cme_rmap == NULL);
+    page_tlb_evict(ppn);
+    if (cme->cme_shm != NULL && cme->cme_shm->so_refs > 1) {
+        /* Nothing could evict the frame once unmapped, so the page is
+         * written out and the object takes over its swap block, as on
+         * eviction; anyone waiting on the frame finds the object's
+         * page gone and reads it in again. Without room in swap the
+         * object keeps the frame instead. */
+        if (k_can_swap &&
+            ((!cme->cme_dirty && cme->cme_swap_location != 0) ||
+             page_write_out(ppn) == 0)) {
+            spinlock_acquire(CM_LOCK(ppn));
+            struct shm_page *sp =
+                &cme->cme_shm->so_pages[cme->cme_shm_index];
+            KASSERT(sp->sp_ppn == ppn && sp->sp_swap == 0);
+            sp->sp_swap = cme->cme_swap_location;
+            sp->sp_ppn = 0;
+            if (cme->cme_readahead) {
+                k_vmstats.vms_readaround_waste++;
+                cme->cme_readahead = 0;
+            }
+            cme->cme_shm = NULL;
+            cme->cme_shm_index = 0;
+            cme->cme_as = NULL;
+            cme->cme_vaddr = 0;
+            cme->cme_swap_location = 0;
+            cme->cme_refcount = 0;
+            cme->cme_tlb = 0;
+            wchan_wakeall(CM_STRIPE(ppn)->cs_wchan, CM_LOCK(ppn));
+            spinlock_release(CM_LOCK(ppn));
+            return;
+        }
+        spinlock_acquire(CM_LOCK(ppn));
+        if (cme->cme_readahead) {
+            k_vmstats.vms_readaround_waste++;
+            cme->cme_readahead = 0;
+        }
+        cme->cme_as = NULL;
+        cme->cme_vaddr = 0;
+        cme->cme_refcount = 0;
+        cme->cme_tlb = 0;
+        spinlock_release(CM_LOCK(ppn));
+        return;
+    }
+
+    /* Otherwise free the page */
+    if (cme->cme_swap_location > 0) {
+        swap_destroy_block(cme->cme_swap_location, k_swap_tracker);
+    }
+    if (cme->cme_vnode != NULL) {
+        textcache_remove(ppn);
+    }
+    spinlock_acquire(CM_LOCK(ppn));
+    if (cme->cme_readahead) {
+        k_vmstats.vms_readaround_waste++;
+        cme->cme_readahead = 0;
+    }
+    cm_set_dirty(ppn, false);
+    if (cme->cme_shm != NULL) {
+        struct shm_page *sp = &cme->cme_shm->so_pages[cme->cme_shm_index];
+        KASSERT(sp->sp_ppn == ppn && sp->sp_swap == 0);
+        sp->sp_ppn = 0;
+        cme->cme_shm = NULL;
+        cme->cme_shm_index = 0;
+    }
+    cme->cme_as = NULL;
+    cme->cme_vaddr = 0;
+    cme->cme_swap_location = 0;
+    cme->cme_vnode = NULL;
+    cme->cme_refcount = 0;
+    cme->cme_tlb = 0;
+    spinlock_release(CM_LOCK(ppn));
+}
+
+
+bool
+page_mapped_by(int ppn, struct addrspace *as) {
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    KASSERT(cme->cme_busy || spinlock_do_i_hold(CM_LOCK(ppn)));
+    if (cme->cme_as == as) {
+        return true;
+    }
+    for (struct cm_rmap *rm = cme->cme_rmap; rm != NULL; rm = rm->rm_next) {
+        if (rm->rm_as == as) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void
+page_tlb_evict(int ppn) {
+    page_tlb_evict_batch(&ppn, 1);
+}
+
+
+void
+page_tlb_evict_batch(const int *ppns, unsigned npages) {
+    KASSERT(curcpu->c_spinlocks == 0);
+
+    /* Gather every mapping into one shootdown, and the cpus that may
+     * hold them */
+    struct tlbshootdown t;
+    page_tlbs_init(&t);
+    uint32_t cpus = 0;
+    for (unsigned i = 0; i < npages; i++) {
+        int ppn = ppns[i];
+        struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+        KASSERT(cme->cme_busy);
+
+        spinlock_acquire(CM_LOCK(ppn));
+        unsigned tlb = cme->cme_tlb;
+        spinlock_release(CM_LOCK(ppn));
+        if (tlb == 0) {
+            continue;
+        }
+
+        page_tlbs_add(&t, cme->cme_vaddr, cme->cme_as->as_asid);
+        cpus |= as_tlb_cpus(cme->cme_as);
+
+        /* A shared page may sit in the tlb of any cpu one of its
+         * sharers ran on. Past a few sharers, flushing beats a
+         * shootdown apiece. */
+        if (cme->cme_refcount > PAGE_EVICT_MAX_SHOOTDOWNS) {
+            t.tlbs_flush_all = true;
+        }
+        for (struct cm_rmap *rm = cme->cme_rmap; rm != NULL;
+             rm = rm->rm_next) {
+            page_tlbs_add(&t, rm->rm_vaddr, rm->rm_as->as_asid);
+            cpus |= as_tlb_cpus(rm->rm_as);
+        }
+    }
+    if (cpus == 0) {
+        return;
+    }
+
+    /* One shootdown per cpu for the whole batch */
+    if (cpus & (1U << curcpu->c_number)) {
+        t.tlbs_cpu = curcpu->c_self;
         vm_tlbshootdown(&t);
+    }
+    ipi_tlbshootdown_mask(cpus, &t);
+
+    for (unsigned i = 0; i < npages; i++) {
+        int ppn = ppns[i];
+        struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+        spinlock_acquire(CM_LOCK(ppn));
         while (cme->cme_tlb) {
-            wchan_sleep(k_coremap->cm_tlb_wchan, &k_coremap->cm_lock);
+            wchan_sleep(CM_STRIPE(ppn)->cs_tlb_wchan, CM_LOCK(ppn));
         }
-        KASSERT(cme->cme_tlb == 0);
+        spinlock_release(CM_LOCK(ppn));
     }
-    
-    return 0;
+}
+
+
+void
+page_tlb_evict_range(struct addrspace *as, vaddr_t vaddr, unsigned npages) {
+    KASSERT(lock_do_i_hold(as->as_lock));
+    if (as->as_asid_gen == 0) {
+        /* never ran, so no tlb holds any of it */
+        return;
+    }
+
+    struct tlbshootdown t;
+    page_tlbs_init(&t);
+    if (npages > TLBSHOOTDOWN_ENTRIES) {
+        t.tlbs_asid = as->as_asid;
+        t.tlbs_flush_asid = true;
+    } else {
+        for (unsigned i = 0; i < npages; i++) {
+            page_tlbs_add(&t, vaddr + i * PAGE_SIZE, as->as_asid);
+        }
+    }
+    as_tlbshootdown(as, &t);
+}
+
+
+struct cm_rmap *
+rmap_create(void) {
+    KASSERT(!spinlock_do_i_hold(&k_coremap->cm_lock));
+    spinlock_acquire(&k_coremap->cm_lock);
+    struct cm_rmap *rm = k_coremap->cm_rmap_free;
+    if (rm != NULL) {
+        k_coremap->cm_rmap_free = rm->rm_next;
+    }
+    spinlock_release(&k_coremap->cm_lock);
+    if (rm == NULL) {
+        rm = kmalloc(sizeof(struct cm_rmap));
+    }
+    return rm;
+}
+
+
+void
+rmap_destroy(struct cm_rmap *rm) {
+    spinlock_acquire(&k_coremap->cm_lock);
+    rm->rm_next = k_coremap->cm_rmap_free;
+    k_coremap->cm_rmap_free = rm;
+    spinlock_release(&k_coremap->cm_lock);
 }
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/* This file keeps the objects behind shared anonymous mappings. */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include <shm.h>
+
+struct shm_object *
+shm_create(unsigned npages) {
+    KASSERT(npages > 0);
+    struct shm_object *so = kmalloc(sizeof(struct shm_object));
+    if (so == NULL) {
+        return NULL;
+    }
+    so->so_pages = kmalloc(npages * sizeof(struct shm_page));
+    if (so->so_pages == NULL) {
+        kfree(so);
+        return NULL;
+    }
+    so->so_lock = lock_create("shm_lock");
+    if (so->so_lock == NULL) {
+        kfree(so->so_pages);
+        kfree(so);
+        return NULL;
+    }
+    for (unsigned i = 0; i < npages; i++) {
+        so->so_pages[i].sp_ppn = 0;
+        so->so_pages[i].sp_swap = 0;
+    }
+    so->so_npages = npages;
+    so->so_refs = 1;
+    return so;
+}
+
+void
+shm_retain(struct shm_object *so) {
+    lock_acquire(so->so_lock);
+    KASSERT(so->so_refs > 0);
+    so->so_refs++;
+    lock_release(so->so_lock);
+}
+
+void
+shm_release(struct shm_object *so) {
+    lock_acquire(so->so_lock);
+    KASSERT(so->so_refs > 0);
+    so->so_refs--;
+    if (so->so_refs > 0) {
+        lock_release(so->so_lock);
+        return;
+    }
+    lock_release(so->so_lock);
+
+    /* Nothing maps the object anymore, so its frames are the ones it
+     * kept for itself */
+    for (unsigned i = 0; i < so->so_npages; i++) {
+        struct shm_page *sp = &so->so_pages[i];
+        if (sp->sp_ppn > 0) {
+            int ppn = sp->sp_ppn;
+            struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+            spinlock_acquire(CM_LOCK(ppn));
+            KASSERT(cme->cme_shm == so && cme->cme_shm_index == i);
+            KASSERT(cme->cme_as == NULL && !cme->cme_busy);
+            int swap_location = cme->cme_swap_location;
+            cm_set_dirty(ppn, false);
+            cme->cme_busy = 1;
+            cme->cme_shm = NULL;
+            cme->cme_swap_location = 0;
+            spinlock_release(CM_LOCK(ppn));
+            if (swap_location > 0) {
+                swap_destroy_block(swap_location, k_swap_tracker);
+            }
+            cm_put_page(ppn);
+        } else if (sp->sp_swap > 0) {
+            swap_destroy_block(sp->sp_swap, k_swap_tracker);
+        }
+    }
+
+    lock_destroy(so->so_lock);
+    kfree(so->so_pages);
+    kfree(so);
+}
@@ -33,12 +33,38 @@
 #include <vm.h>
 #include <kern/stat.h>
 #include <uio.h>
+#include <zcache.h>
+#include <cpu.h>
+#include <current.h>
+#include <spl.h>
+#include <vmstats.h>
 
 /* Swap space functions */
 static void can_swap(void) {
     KASSERT(k_can_swap);
 }
 
+/* Takes a block off the free map. Assumes the lock is held, or that
+ * swap isn't in use yet. */
+static void swap_mark(struct swap_tracker *swap, unsigned block) {
+    bitmap_mark(swap->st_bitmap, block);
+    if (swap->st_cluster_free[block / SWAP_CLUSTER]-- == SWAP_CLUSTER) {
+        swap->st_free_clusters--;
+    }
+    swap->st_free--;
+}
+
+
+/* Puts a block back on the free map. Assumes the lock is held. */
+static void swap_unmark(struct swap_tracker *swap, unsigned block) {
+    bitmap_unmark(swap->st_bitmap, block);
+    if (++swap->st_cluster_free[block / SWAP_CLUSTER] == SWAP_CLUSTER) {
+        swap->st_free_clusters++;
+    }
+    swap->st_free++;
+}
+
+
 void swap_init(struct swap_tracker **swap) {
     struct swap_tracker *new_swap = kmalloc(sizeof(struct swap_tracker));
     if (new_swap == NULL) {
@@ -61,7 +87,38 @@ void swap_init(struct swap_tracker **swap) {
     if (new_swap->st_bitmap == NULL) {
         panic("swap bitmap init failed");
     }
-    bitmap_mark(new_swap->st_bitmap, 0);
+
+    new_swap->st_refs = kmalloc(sizeof(uint16_t) * new_swap->st_size);
+    if (new_swap->st_refs == NULL) {
+        panic("swap refcount init failed");
+    }
+    for (int i = 0; i < new_swap->st_size; i++) {
+        new_swap->st_refs[i] = 0;
+    }
+
+    new_swap->st_nclusters = DIVROUNDUP(new_swap->st_size, SWAP_CLUSTER);
+    new_swap->st_cluster_free = kmalloc(new_swap->st_nclusters);
+    if (new_swap->st_cluster_free == NULL) {
+        panic("swap cluster map init failed");
+    }
+    new_swap->st_free_clusters = 0;
+    for (int i = 0; i < new_swap->st_nclusters; i++) {
+        int blocks = new_swap->st_size - i * SWAP_CLUSTER;
+        new_swap->st_cluster_free[i] =
+            blocks > SWAP_CLUSTER ? SWAP_CLUSTER : blocks;
+        if (blocks >= SWAP_CLUSTER) {
+            new_swap->st_free_clusters++;
+        }
+    }
+    new_swap->st_free = new_swap->st_size;
+    new_swap->st_reserved = 0;
+    new_swap->st_next = 0;
+
+    /* Block 0 means "not in swap" and is never handed out */
+    swap_mark(new_swap, 0);
+    new_swap->st_refs[0] = 1;
+
+    zcache_init(new_swap->st_vnode, new_swap->st_size);
     
     *swap = new_swap;
 
@@ -70,48 +127,290 @@ void swap_init(struct swap_tracker **swap) {
 
 
 off_t swap_find_free(struct swap_tracker *swap) {
+    unsigned got;
+    return swap_find_run(swap, 1, &got);
+}
+
+
+/* Reserves a wholly free cluster for a cpu. Returns false if there is
+ * none. */
+static bool swap_reserve(struct swap_tracker *swap, struct cpu *c) {
+    KASSERT(spinlock_do_i_hold(&swap->st_lock));
+    KASSERT(c->c_swap_left == 0);
+    if (swap->st_free_clusters == 0)  return false;
+
+    int k = swap->st_next;
+    while (swap->st_cluster_free[k] != SWAP_CLUSTER) {
+        if (++k >= swap->st_nclusters)  k = 0;
+    }
+    for (int i = 0; i < SWAP_CLUSTER; i++) {
+        swap_mark(swap, k * SWAP_CLUSTER + i);
+    }
+    swap->st_reserved += SWAP_CLUSTER;
+    swap->st_next = k + 1 < swap->st_nclusters ? k + 1 : 0;
+    c->c_swap_next = k * SWAP_CLUSTER;
+    c->c_swap_left = SWAP_CLUSTER;
+    return true;
+}
+
+
+/* Gives back the blocks a cpu has reserved but not used */
+static void swap_unreserve(struct swap_tracker *swap, struct cpu *c) {
+    KASSERT(spinlock_do_i_hold(&swap->st_lock));
+    for (unsigned i = 0; i < c->c_swap_left; i++) {
+        swap_unmark(swap, c->c_swap_next + i);
+    }
+    swap->st_reserved -= c->c_swap_left;
+    c->c_swap_left = 0;
+}
+
+
+/* Pieces a run together out of partly free clusters, when no cluster
+ * is wholly free. Takes the first run that is long enough, or the
+ * longest one there is. */
+static off_t swap_take_run(struct swap_tracker *swap, unsigned npages,
+    unsigned *got) {
+    KASSERT(spinlock_do_i_hold(&swap->st_lock));
+    if (swap->st_free == 0)  return -1;
+
+    unsigned start = 0, len = 0;
+    unsigned best = 0, best_len = 0;
+    int k = swap->st_next;
+    for (int i = 0; i < swap->st_nclusters && best_len < npages; i++, k++) {
+        if (k >= swap->st_nclusters) {
+            /* runs don't wrap around the end of swap */
+            k = 0;
+            len = 0;
+        }
+        if (swap->st_cluster_free[k] == 0) {
+            len = 0;
+            continue;
+        }
+        unsigned end = (k + 1) * SWAP_CLUSTER;
+        if (end > (unsigned)swap->st_size)  end = swap->st_size;
+        for (unsigned b = k * SWAP_CLUSTER; b < end && best_len < npages; b++) {
+            if (bitmap_isset(swap->st_bitmap, b)) {
+                len = 0;
+                continue;
+            }
+            if (len == 0)  start = b;
+            len++;
+            if (len > best_len) {
+                best = start;
+                best_len = len;
+            }
+        }
+    }
+    if (best_len == 0)  return -1;
+
+    for (unsigned i = 0; i < best_len; i++) {
+        swap_mark(swap, best + i);
+        swap->st_refs[best + i] = 1;
+    }
+    swap->st_next = (best + best_len) / SWAP_CLUSTER;
+    if (swap->st_next >= swap->st_nclusters)  swap->st_next = 0;
+    *got = best_len;
+    return (off_t)best;
+}
+
+
+off_t swap_find_run(struct swap_tracker *swap, unsigned npages,
+    unsigned *got) {
+    KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
     can_swap();
+    int spl = splhigh();
+    struct cpu *c = curcpu->c_self;
+    off_t location = -1;
+
     spinlock_acquire(&swap->st_lock);
-    unsigned index;
-    int err = bitmap_alloc(swap->st_bitmap, &index);
+
+    /* A run that doesn't fit in what's left of our cluster goes in a
+     * fresh one, so that it stays in one piece */
+    if (c->c_swap_left < npages && swap->st_free_clusters > 0) {
+        swap_unreserve(swap, c);
+        swap_reserve(swap, c);
+    }
+
+    if (c->c_swap_left > 0) {
+        unsigned n = npages < c->c_swap_left ? npages : c->c_swap_left;
+        location = c->c_swap_next;
+        for (unsigned i = 0; i < n; i++) {
+            swap->st_refs[location + i] = 1;
+        }
+        swap->st_reserved -= n;
+        c->c_swap_next += n;
+        c->c_swap_left -= n;
+        *got = n;
+    } else {
+        /* No cluster is wholly free. What other cpus reserved and
+         * haven't used is free all the same, so take it back before
+         * piecing a run together */
+        if (swap->st_reserved > 0) {
+            for (unsigned n = 0; n < cpu_count(); n++) {
+                swap_unreserve(swap, cpu_get(n));
+            }
+        }
+        location = swap_take_run(swap, npages, got);
+    }
+
     spinlock_release(&swap->st_lock);
-    if (err)  panic("Ran out of swap space");
-    return (off_t)index;
+    splx(spl);
+
+    if (location < 0) {
+        k_vmstats.vms_swap_full++;
+    }
+    return location;
 }
 
 
-int swap_read(int ppn, int swap_location, struct swap_tracker *swap) {
-    KASSERT(ppn > 0);
+void swap_print_stats(struct swap_tracker *swap) {
+    int largest = 0, len = 0;
+    spinlock_acquire(&swap->st_lock);
+    int size = swap->st_size;
+    int free = swap->st_free;
+    int reserved = swap->st_reserved;
+    int free_clusters = swap->st_free_clusters;
+    int nclusters = swap->st_nclusters;
+    for (int b = 0; b < size; b++) {
+        len = bitmap_isset(swap->st_bitmap, b) ? 0 : len + 1;
+        if (len > largest)  largest = len;
+    }
+    spinlock_release(&swap->st_lock);
+
+    int used = size - free - reserved;
+    int scattered = free - free_clusters * SWAP_CLUSTER;
+    kprintf("Swap blocks in use: %d of %d (%d%%)\n", used, size,
+        used * 100 / size);
+    kprintf("Swap blocks reserved by cpus: %d\n", reserved);
+    kprintf("Free swap clusters: %d of %d\n", free_clusters, nclusters);
+    kprintf("Free swap blocks outside free clusters: %d%%\n",
+        free == 0 ? 0 : scattered * 100 / free);
+    kprintf("Largest free swap run: %d blocks\n", largest);
+}
+
+
+/* Moves pages to or from a run of swap blocks in one transfer. Only
+ * transfers that reach the device are counted as swap writes. */
+static int swap_io(const int *ppns, unsigned npages, int swap_location,
+    struct swap_tracker *swap, enum uio_rw rw) {
+    KASSERT(npages > 0 && npages <= SWAP_CLUSTER);
     KASSERT(swap_location > 0);
     can_swap();
-    struct iovec iov;
+    struct iovec iov[SWAP_CLUSTER];
     struct uio myuio;
-    uio_kinit(&iov, &myuio, (void *)CM_INDEX_TO_KVADDR(ppn), PAGE_SIZE, 
-        swap_location * PAGE_SIZE, UIO_READ);
-    KASSERT(bitmap_isset(swap->st_bitmap, swap_location));
-    return VOP_READ(swap->st_vnode, &myuio);
+    for (unsigned i = 0; i < npages; i++) {
+        KASSERT(ppns[i] > 0);
+        KASSERT(bitmap_isset(swap->st_bitmap, swap_location + i));
+        iov[i].iov_kbase = (void *)CM_INDEX_TO_KVADDR(ppns[i]);
+        iov[i].iov_len = PAGE_SIZE;
+    }
+    myuio.uio_iov = iov;
+    myuio.uio_iovcnt = npages;
+    myuio.uio_offset = (off_t)swap_location * PAGE_SIZE;
+    myuio.uio_resid = npages * PAGE_SIZE;
+    myuio.uio_segflg = UIO_SYSSPACE;
+    myuio.uio_rw = rw;
+    myuio.uio_space = NULL;
+    if (rw == UIO_READ) {
+        return VOP_READ(swap->st_vnode, &myuio);
+    }
+    k_vmstats.vms_swap_writes++;
+    k_vmstats.vms_swap_pages_written += npages;
+    return VOP_WRITE(swap->st_vnode, &myuio);
+}
+
+
+/* Moves pages to or from a run of swap blocks. Blocks the compressed
+ * cache takes or holds skip the device; the rest go to it in as few
+ * transfers as the cached blocks between them allow. */
+static int swap_transfer(const int *ppns, unsigned npages, int swap_location,
+    struct swap_tracker *swap, enum uio_rw rw) {
+    unsigned start = 0;
+    for (unsigned i = 0; i < npages; i++) {
+        bool cached = rw == UIO_READ ?
+            zcache_load(swap_location + i, ppns[i]) :
+            zcache_store(swap_location + i, ppns[i]);
+        if (!cached) {
+            continue;
+        }
+        if (i > start) {
+            int result = swap_io(&ppns[start], i - start,
+                swap_location + start, swap, rw);
+            if (result)  return result;
+        }
+        start = i + 1;
+    }
+    if (npages > start) {
+        return swap_io(&ppns[start], npages - start, swap_location + start,
+            swap, rw);
+    }
+    return 0;
+}
+
+
+int swap_read(int ppn, int swap_location, struct swap_tracker *swap) {
+    return swap_transfer(&ppn, 1, swap_location, swap, UIO_READ);
 }
 
 
 int swap_write(int ppn, int swap_location, struct swap_tracker *swap) {
-    KASSERT(ppn > 0);
+    return swap_transfer(&ppn, 1, swap_location, swap, UIO_WRITE);
+}
+
+
+int swap_read_run(const int *ppns, unsigned npages, int swap_location,
+    struct swap_tracker *swap) {
+    return swap_transfer(ppns, npages, swap_location, swap, UIO_READ);
+}
+
+
+int swap_write_run(const int *ppns, unsigned npages, int swap_location,
+    struct swap_tracker *swap) {
+    return swap_transfer(ppns, npages, swap_location, swap, UIO_WRITE);
+}
+
+
+void swap_destroy_block(int swap_location, struct swap_tracker *swap) {
     KASSERT(swap_location > 0);
     can_swap();
-    struct iovec iov;
-    struct uio myuio;
-    uio_kinit(&iov, &myuio, (void *)CM_INDEX_TO_KVADDR(ppn), PAGE_SIZE, 
-        swap_location * PAGE_SIZE, UIO_WRITE);
+    spinlock_acquire(&swap->st_lock);
+    if (bitmap_isset(swap->st_bitmap, swap_location)) {
+        KASSERT(swap->st_refs[swap_location] > 0);
+        swap->st_refs[swap_location]--;
+        if (swap->st_refs[swap_location] == 0) {
+            /* Forget any cached copy before the block can be handed
+             * out again */
+            spinlock_release(&swap->st_lock);
+            zcache_drop(swap_location);
+            spinlock_acquire(&swap->st_lock);
+            swap_unmark(swap, swap_location);
+        }
+    }
+    spinlock_release(&swap->st_lock);
+}
+
+
+void swap_share_block(int swap_location, struct swap_tracker *swap) {
+    KASSERT(swap_location > 0);
+    can_swap();
+    spinlock_acquire(&swap->st_lock);
     KASSERT(bitmap_isset(swap->st_bitmap, swap_location));
-    return VOP_WRITE(swap->st_vnode, &myuio);
+    KASSERT(swap->st_refs[swap_location] < 0xffff);
+    swap->st_refs[swap_location]++;
+    spinlock_release(&swap->st_lock);
 }
 
 
-void swap_destroy_block(int swap_location, struct swap_tracker *swap) {
+bool swap_unshare_block(int swap_location, struct swap_tracker *swap) {
     KASSERT(swap_location > 0);
     can_swap();
+    bool dropped = false;
     spinlock_acquire(&swap->st_lock);
-    if (bitmap_isset(swap->st_bitmap, swap_location)) {
-        bitmap_unmark(swap->st_bitmap, swap_location);
+    KASSERT(bitmap_isset(swap->st_bitmap, swap_location));
+    if (swap->st_refs[swap_location] > 1) {
+        swap->st_refs[swap_location]--;
+        dropped = true;
     }
     spinlock_release(&swap->st_lock);
+    return dropped;
 }
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/* This file keeps the cache of executables' read-only pages that are
+ * shared by every process running the same program. */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <coremap.h>
+#include <textcache.h>
+#include <wchan.h>
+
+struct textcache k_textcache;
+
+static
+unsigned
+tc_hash(struct vnode *v, vaddr_t vaddr) {
+    return (((uintptr_t)v >> 4) ^ (vaddr / PAGE_SIZE)) % TC_BUCKETS;
+}
+
+/* Finds the entry for a page. Assumes the cache lock is held. */
+static
+struct tc_entry **
+tc_find(struct vnode *v, vaddr_t vaddr) {
+    KASSERT(spinlock_do_i_hold(&k_textcache.tc_lock));
+    struct tc_entry **prev = &k_textcache.tc_buckets[tc_hash(v, vaddr)];
+    while (*prev != NULL &&
+           ((*prev)->tce_vnode != v || (*prev)->tce_vaddr != vaddr)) {
+        prev = &(*prev)->tce_next;
+    }
+    return prev;
+}
+
+void
+textcache_init(void) {
+    spinlock_init(&k_textcache.tc_lock);
+    for (int i = 0; i < TC_BUCKETS; i++) {
+        k_textcache.tc_buckets[i] = NULL;
+    }
+}
+
+int
+textcache_get(struct vnode *v, vaddr_t vaddr) {
+    while (true) {
+        spinlock_acquire(&k_textcache.tc_lock);
+        struct tc_entry *e = *tc_find(v, vaddr);
+        int ppn = e == NULL ? -1 : e->tce_ppn;
+        spinlock_release(&k_textcache.tc_lock);
+        if (ppn < 0) {
+            return -1;
+        }
+
+        /* The frame may have been evicted, and even reused, since we
+         * looked; it's ours only if it still holds the page */
+        struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+        spinlock_acquire(CM_LOCK(ppn));
+        if (cme->cme_busy) {
+            wchan_sleep(CM_STRIPE(ppn)->cs_wchan, CM_LOCK(ppn));
+            spinlock_release(CM_LOCK(ppn));
+            continue;
+        }
+        if (cme->cme_as == NULL || cme->cme_vnode != v ||
+            cme->cme_vaddr != vaddr) {
+            spinlock_release(CM_LOCK(ppn));
+            continue;
+        }
+        cme->cme_busy = 1;
+        spinlock_release(CM_LOCK(ppn));
+        return ppn;
+    }
+}
+
+void
+textcache_add(struct vnode *v, vaddr_t vaddr, int ppn) {
+    KASSERT(k_coremap->cm_entries[ppn].cme_busy);
+    KASSERT(k_coremap->cm_entries[ppn].cme_vnode == v);
+
+    struct tc_entry *e = kmalloc(sizeof(struct tc_entry));
+    if (e == NULL) {
+        return;
+    }
+    e->tce_vnode = v;
+    e->tce_vaddr = vaddr;
+    e->tce_ppn = ppn;
+
+    spinlock_acquire(&k_textcache.tc_lock);
+    struct tc_entry **prev = tc_find(v, vaddr);
+    if (*prev == NULL) {
+        e->tce_next = NULL;
+        *prev = e;
+        e = NULL;
+    }
+    spinlock_release(&k_textcache.tc_lock);
+
+    /* someone else cached the page first */
+    if (e != NULL) {
+        kfree(e);
+    }
+}
+
+void
+textcache_remove(int ppn) {
+    struct cm_entry *cme = &k_coremap->cm_entries[ppn];
+    KASSERT(cme->cme_busy && cme->cme_vnode != NULL);
+
+    spinlock_acquire(&k_textcache.tc_lock);
+    struct tc_entry **prev = tc_find(cme->cme_vnode, cme->cme_vaddr);
+    struct tc_entry *e = *prev;
+    if (e != NULL && e->tce_ppn == ppn) {
+        *prev = e->tce_next;
+    } else {
+        e = NULL;
+    }
+    spinlock_release(&k_textcache.tc_lock);
+
+    if (e != NULL) {
+        kfree(e);
+    }
+}
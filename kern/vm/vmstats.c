@@ -30,6 +30,13 @@
 
 #include <vmstats.h>
 #include <lib.h>
+#include <coremap.h>
+#include <swap.h>
+#include <clock.h>
+#include <proc.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <kern/memstat.h>
 
 void
 vmstats_init(struct vmstats *vms)
@@ -38,7 +45,42 @@ vmstats_init(struct vmstats *vms)
     vms->vms_write_page_faults = 0;
     vms->vms_vm_faults = 0;
     vms->vms_daemon_runs = 0;
+    vms->vms_daemon_frees = 0;
     vms->vms_tlb_shootdowns = 0;
+    vms->vms_tlb_ipis = 0;
+    vms->vms_tlb_ipi_entries = 0;
+    vms->vms_tlb_coalesced = 0;
+    vms->vms_cow_faults = 0;
+    vms->vms_fork_swap_shares = 0;
+    vms->vms_tlb_flushes_avoided = 0;
+    vms->vms_tlb_entries_kept = 0;
+    vms->vms_tlb_fast_refills = 0;
+    vms->vms_frame_cache_hits = 0;
+    vms->vms_frame_cache_refills = 0;
+    vms->vms_frame_cache_drains = 0;
+    vms->vms_file_page_faults = 0;
+    vms->vms_text_shares = 0;
+    vms->vms_text_drops = 0;
+    vms->vms_shm_shares = 0;
+    vms->vms_shm_faults = 0;
+    vms->vms_advise_frees = 0;
+    vms->vms_advise_swap_frees = 0;
+    vms->vms_swap_writes = 0;
+    vms->vms_swap_pages_written = 0;
+    vms->vms_swap_full = 0;
+    vms->vms_zcache_stores = 0;
+    vms->vms_zcache_same_filled = 0;
+    vms->vms_zcache_bytes = 0;
+    vms->vms_zcache_rejects = 0;
+    vms->vms_zcache_hits = 0;
+    vms->vms_zcache_writebacks = 0;
+    vms->vms_readaround_pages = 0;
+    vms->vms_readaround_hits = 0;
+    vms->vms_readaround_waste = 0;
+    vms->vms_clock_clean_evictions = 0;
+    vms->vms_zero_pool_hits = 0;
+    vms->vms_zero_pool_misses = 0;
+    vms->vms_kpage_evictions = 0;
 }
 
 int
@@ -57,6 +99,80 @@ vmstats_report(int n, char **a)
     (void) a;
     struct vmstats *vms = &k_vmstats;
     kprintf("Number of page faults: %d\nNumber of page faults that required a synchronous write: %d\nNumber of vm faults: %d\nNumber of TLB shootdowns %d\nNumber of daemon runs: %d\n", vms->vms_page_faults, vms->vms_write_page_faults, vms->vms_vm_faults, vms->vms_tlb_shootdowns, vms->vms_daemon_runs);
+    kprintf("Number of frames freed by the daemon: %d\n", vms->vms_daemon_frees);
+    kprintf("Number of TLB shootdowns sent: %d\nNumber of mappings sent in them: %d\nNumber of shootdown queues coalesced into flushes: %d\n", vms->vms_tlb_ipis, vms->vms_tlb_ipi_entries, vms->vms_tlb_coalesced);
+    kprintf("Number of copy-on-write copies: %d\n", vms->vms_cow_faults);
+    kprintf("Number of swapped pages shared by fork: %d\n", vms->vms_fork_swap_shares);
+    kprintf("Number of TLB flushes avoided: %d\nNumber of TLB entries kept across switches: %d\n", vms->vms_tlb_flushes_avoided, vms->vms_tlb_entries_kept);
+    kprintf("Number of TLB misses refilled without locking: %d\n", vms->vms_tlb_fast_refills);
+    kprintf("Number of frame cache hits: %d\nNumber of frame cache refills: %d\nNumber of frame cache drains: %d\n", vms->vms_frame_cache_hits, vms->vms_frame_cache_refills, vms->vms_frame_cache_drains);
+    kprintf("Number of page faults read from executables: %d\n", vms->vms_file_page_faults);
+    kprintf("Number of shared text page mappings: %d\nNumber of text pages dropped: %d\n", vms->vms_text_shares, vms->vms_text_drops);
+    kprintf("Number of shared memory page mappings: %d\nNumber of shared memory pages brought in: %d\n", vms->vms_shm_shares, vms->vms_shm_faults);
+    kprintf("Number of frames released by madvise: %d\nNumber of swap blocks released by madvise: %d\n", vms->vms_advise_frees, vms->vms_advise_swap_frees);
+    kprintf("Number of swap writes: %d\nNumber of pages written to swap: %d\n", vms->vms_swap_writes, vms->vms_swap_pages_written);
+    kprintf("Number of times swap was full: %d\n", vms->vms_swap_full);
+    if (k_can_swap) {
+        swap_print_stats(k_swap_tracker);
+    }
+    uint64_t zc_size = (uint64_t)vms->vms_zcache_stores * PAGE_SIZE;
+    kprintf("Number of pages put in the compressed swap cache: %d\nNumber of them that were same-filled: %d\nNumber of pages that didn't compress: %d\nSize of cached pages after compression: %d%%\n", vms->vms_zcache_stores, vms->vms_zcache_same_filled, vms->vms_zcache_rejects, zc_size == 0 ? 0 : (int)((uint64_t)vms->vms_zcache_bytes * 100 / zc_size));
+    kprintf("Number of swap reads avoided: %d\nNumber of swap writes avoided: %d\n", vms->vms_zcache_hits, vms->vms_zcache_stores - vms->vms_zcache_writebacks);
+    kprintf("Number of pages read around swap faults: %d\nNumber of read-around hits: %d\nNumber of read-around pages wasted: %d\n", vms->vms_readaround_pages, vms->vms_readaround_hits, vms->vms_readaround_waste);
+    kprintf("Number of clean pages evicted by the clock: %d\n", vms->vms_clock_clean_evictions);
+    kprintf("Number of zeroed frames taken: %d\nNumber of times no zeroed frame was ready: %d\n", vms->vms_zero_pool_hits, vms->vms_zero_pool_misses);
+    kprintf("Number of user pages evicted for kernel blocks: %d\n", vms->vms_kpage_evictions);
+    cm_print_fragmentation();
     return 0;
 }
 
+int
+vmstats_proc_report(int n, char **a)
+{
+    (void) n;
+    (void) a;
+    kprintf("  pid resident  swapped   tlb flt minor flt major flt  swapins swapouts  >=1ms name\n");
+    lock_acquire(k_proctable->pt_lock);
+    for (int i = 0; i < PROC_MAX; i++) {
+        struct proc *p = k_proctable->pt_procs[i];
+        if (p == NULL)  continue;
+        spinlock_acquire(&p->p_lock);
+        struct addrspace *as = p->p_addrspace;
+        if (as != NULL)  as_pin(as);
+        spinlock_release(&p->p_lock);
+        if (as == NULL)  continue;
+
+        struct memstat ms;
+        as_memstat(as, &ms);
+        as_unpin(as);
+        /* faults that took 1024us or more */
+        uint32_t slow = 0;
+        for (int b = 4; b < MS_LATENCY_BUCKETS; b++) {
+            slow += ms.ms_latency[b];
+        }
+        kprintf("%5d %8u %8u %9u %9u %9u %8u %8u %6u %s\n", p->p_pid,
+                ms.ms_resident, ms.ms_swapped, ms.ms_tlb_faults,
+                ms.ms_minor_faults, ms.ms_major_faults, ms.ms_swapins,
+                ms.ms_swapouts, slow, p->p_name);
+    }
+    lock_release(k_proctable->pt_lock);
+    return 0;
+}
+
+void
+vmstats_fault_latency(struct memstat *ms, const struct timespec *start)
+{
+    struct timespec now, took;
+    gettime(&now);
+    timespec_sub(&now, start, &took);
+    uint64_t usec = (uint64_t)took.tv_sec * 1000000 + took.tv_nsec / 1000;
+
+    /* buckets are a factor of 4 apart, starting at 16us */
+    unsigned b = 0;
+    uint64_t limit = 16;
+    while (b < MS_LATENCY_BUCKETS - 1 && usec >= limit) {
+        b++;
+        limit <<= 2;
+    }
+    ms->ms_latency[b]++;
+}
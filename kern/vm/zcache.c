@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/* This file keeps the compressed cache of swap blocks that sits in
+ * front of the swap device. */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <vmstats.h>
+#include <zcache.h>
+
+struct zcache k_zcache;
+
+/*
+ * A compressed page is a 2-bit tag for each word, followed by what the
+ * tags need: nothing for a zero word, a dictionary index for a word
+ * that is in the dictionary, an index and the low bits for one that
+ * only matches a dictionary word's high bits, and the whole word
+ * otherwise. The dictionary slot is picked by hashing the high bits.
+ */
+#define ZC_WORDS (PAGE_SIZE / sizeof(uint32_t))
+#define ZC_TAG_BYTES (ZC_WORDS / 4)
+#define ZC_DICT 16
+#define ZC_LOW_BITS 10
+#define ZC_LOW_MASK ((1U << ZC_LOW_BITS) - 1)
+#define ZC_HASH(w) ((((w) >> ZC_LOW_BITS) * 2654435761U) >> 28)
+
+#define ZC_ZERO 0
+#define ZC_EXACT 1
+#define ZC_PARTIAL 2
+#define ZC_MISS 3
+
+/* Compresses a page into DST. Returns the length, or 0 if it comes out
+ * longer than ZC_MAX_LEN. */
+static
+unsigned
+zc_compress(const uint32_t *src, uint8_t *dst) {
+    uint32_t dict[ZC_DICT];
+    bzero(dict, sizeof(dict));
+    bzero(dst, ZC_TAG_BYTES);
+    unsigned len = ZC_TAG_BYTES;
+    for (unsigned i = 0; i < ZC_WORDS; i++) {
+        uint32_t w = src[i];
+        unsigned tag = ZC_ZERO;
+        if (w != 0) {
+            unsigned h = ZC_HASH(w);
+            if (dict[h] == w) {
+                tag = ZC_EXACT;
+            } else if ((dict[h] >> ZC_LOW_BITS) == (w >> ZC_LOW_BITS)) {
+                tag = ZC_PARTIAL;
+            } else {
+                tag = ZC_MISS;
+            }
+            if (len + 4 > ZC_MAX_LEN) {
+                return 0;
+            }
+            if (tag == ZC_EXACT) {
+                dst[len++] = h;
+            } else if (tag == ZC_PARTIAL) {
+                uint32_t v = (h << ZC_LOW_BITS) | (w & ZC_LOW_MASK);
+                dst[len++] = v & 0xff;
+                dst[len++] = v >> 8;
+            } else {
+                dst[len++] = w & 0xff;
+                dst[len++] = (w >> 8) & 0xff;
+                dst[len++] = (w >> 16) & 0xff;
+                dst[len++] = w >> 24;
+            }
+            dict[h] = w;
+        }
+        dst[i / 4] |= tag << ((i % 4) * 2);
+    }
+    return len;
+}
+
+/* Undoes zc_compress */
+static
+void
+zc_decompress(const uint8_t *src, uint32_t *dst) {
+    uint32_t dict[ZC_DICT];
+    bzero(dict, sizeof(dict));
+    const uint8_t *p = src + ZC_TAG_BYTES;
+    for (unsigned i = 0; i < ZC_WORDS; i++) {
+        unsigned tag = (src[i / 4] >> ((i % 4) * 2)) & 3;
+        uint32_t w = 0;
+        if (tag == ZC_EXACT) {
+            w = dict[*p++];
+        } else if (tag == ZC_PARTIAL) {
+            uint32_t v = p[0] | (p[1] << 8);
+            p += 2;
+            unsigned h = v >> ZC_LOW_BITS;
+            w = (dict[h] & ~ZC_LOW_MASK) | (v & ZC_LOW_MASK);
+            dict[h] = w;
+        } else if (tag == ZC_MISS) {
+            w = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+            p += 4;
+            dict[ZC_HASH(w)] = w;
+        }
+        dst[i] = w;
+    }
+}
+
+/* Finds N free chunks in a row in the pool. Returns the first, or -1. */
+static
+int
+zc_find_chunks(unsigned n) {
+    unsigned len = 0;
+    for (unsigned i = 0; i < k_zcache.zc_nchunks; i++) {
+        if (bitmap_isset(k_zcache.zc_chunks, i)) {
+            len = 0;
+            continue;
+        }
+        if (++len == n) {
+            return i + 1 - n;
+        }
+    }
+    return -1;
+}
+
+/* Takes an entry off the list of cached pages */
+static
+void
+zc_unlink(int e) {
+    struct zc_entry *ze = &k_zcache.zc_entries[e];
+    if (ze->ze_prev >= 0) {
+        k_zcache.zc_entries[ze->ze_prev].ze_next = ze->ze_next;
+    } else {
+        k_zcache.zc_oldest = ze->ze_next;
+    }
+    if (ze->ze_next >= 0) {
+        k_zcache.zc_entries[ze->ze_next].ze_prev = ze->ze_prev;
+    } else {
+        k_zcache.zc_newest = ze->ze_prev;
+    }
+}
+
+/* Forgets a cached page */
+static
+void
+zc_remove(int e) {
+    KASSERT(lock_do_i_hold(k_zcache.zc_lock));
+    struct zc_entry *ze = &k_zcache.zc_entries[e];
+    KASSERT(ze->ze_location > 0);
+    unsigned nchunks = DIVROUNDUP(ze->ze_len, ZC_CHUNK);
+    for (unsigned i = 0; i < nchunks; i++) {
+        bitmap_unmark(k_zcache.zc_chunks, ze->ze_chunk + i);
+    }
+    zc_unlink(e);
+    k_zcache.zc_index[ze->ze_location] = -1;
+    ze->ze_location = 0;
+    ze->ze_next = k_zcache.zc_free;
+    k_zcache.zc_free = e;
+}
+
+/* Writes the oldest cached page to its block on disk and forgets it.
+ * Returns false if nothing is cached. */
+static
+bool
+zc_writeback_oldest(void) {
+    KASSERT(lock_do_i_hold(k_zcache.zc_lock));
+    int e = k_zcache.zc_oldest;
+    if (e < 0) {
+        return false;
+    }
+    struct zc_entry *ze = &k_zcache.zc_entries[e];
+    uint32_t *words = (uint32_t *)k_zcache.zc_page;
+    if (ze->ze_len == 0) {
+        for (unsigned i = 0; i < ZC_WORDS; i++) {
+            words[i] = ze->ze_fill;
+        }
+    } else {
+        zc_decompress((uint8_t *)k_zcache.zc_pool + ze->ze_chunk * ZC_CHUNK,
+                      words);
+    }
+
+    struct iovec iov;
+    struct uio ku;
+    uio_kinit(&iov, &ku, words, PAGE_SIZE,
+              (off_t)ze->ze_location * PAGE_SIZE, UIO_WRITE);
+    if (VOP_WRITE(k_zcache.zc_vnode, &ku)) {
+        panic("swap write failed");
+    }
+    zc_remove(e);
+    k_vmstats.vms_zcache_writebacks++;
+    return true;
+}
+
+void
+zcache_init(struct vnode *v, int nblocks) {
+    unsigned npages = k_coremap->cm_num_pages / ZC_POOL_FRACTION;
+    if (npages == 0) {
+        npages = 1;
+    }
+    k_zcache.zc_lock = lock_create("zcache_lock");
+    k_zcache.zc_pool = kmalloc(npages * PAGE_SIZE);
+    k_zcache.zc_nchunks = npages * PAGE_SIZE / ZC_CHUNK;
+    k_zcache.zc_chunks = bitmap_create(k_zcache.zc_nchunks);
+    k_zcache.zc_nentries = k_zcache.zc_nchunks;
+    k_zcache.zc_entries =
+        kmalloc(sizeof(struct zc_entry) * k_zcache.zc_nentries);
+    k_zcache.zc_index = kmalloc(sizeof(int) * nblocks);
+    k_zcache.zc_buf = kmalloc(PAGE_SIZE);
+    k_zcache.zc_page = kmalloc(PAGE_SIZE);
+    if (k_zcache.zc_lock == NULL || k_zcache.zc_pool == NULL ||
+        k_zcache.zc_chunks == NULL || k_zcache.zc_entries == NULL ||
+        k_zcache.zc_index == NULL || k_zcache.zc_buf == NULL ||
+        k_zcache.zc_page == NULL) {
+        panic("zcache init failed");
+    }
+
+    k_zcache.zc_free = -1;
+    for (int e = k_zcache.zc_nentries - 1; e >= 0; e--) {
+        k_zcache.zc_entries[e].ze_location = 0;
+        k_zcache.zc_entries[e].ze_next = k_zcache.zc_free;
+        k_zcache.zc_free = e;
+    }
+    k_zcache.zc_oldest = -1;
+    k_zcache.zc_newest = -1;
+    for (int i = 0; i < nblocks; i++) {
+        k_zcache.zc_index[i] = -1;
+    }
+    k_zcache.zc_nblocks = nblocks;
+    k_zcache.zc_vnode = v;
+}
+
+bool
+zcache_store(int location, int ppn) {
+    KASSERT(location > 0 && location < k_zcache.zc_nblocks);
+    lock_acquire(k_zcache.zc_lock);
+    if (k_zcache.zc_index[location] >= 0) {
+        zc_remove(k_zcache.zc_index[location]);
+    }
+
+    /* See if the page is one word over and over, or else compress it */
+    const uint32_t *words = (const uint32_t *)CM_INDEX_TO_KVADDR(ppn);
+    bool same = true;
+    for (unsigned i = 1; i < ZC_WORDS && same; i++) {
+        same = (words[i] == words[0]);
+    }
+    unsigned len = 0;
+    if (!same) {
+        len = zc_compress(words, (uint8_t *)k_zcache.zc_buf);
+        if (len == 0) {
+            k_vmstats.vms_zcache_rejects++;
+            lock_release(k_zcache.zc_lock);
+            return false;
+        }
+    }
+    unsigned nchunks = DIVROUNDUP(len, ZC_CHUNK);
+    if (nchunks > k_zcache.zc_nchunks) {
+        k_vmstats.vms_zcache_rejects++;
+        lock_release(k_zcache.zc_lock);
+        return false;
+    }
+
+    /* Make room by writing the oldest pages out to the disk */
+    while (k_zcache.zc_free < 0) {
+        zc_writeback_oldest();
+    }
+    int chunk = 0;
+    if (nchunks > 0) {
+        while ((chunk = zc_find_chunks(nchunks)) < 0) {
+            bool wrote = zc_writeback_oldest();
+            KASSERT(wrote);
+        }
+    }
+
+    int e = k_zcache.zc_free;
+    struct zc_entry *ze = &k_zcache.zc_entries[e];
+    k_zcache.zc_free = ze->ze_next;
+    for (unsigned i = 0; i < nchunks; i++) {
+        bitmap_mark(k_zcache.zc_chunks, chunk + i);
+    }
+    memcpy(k_zcache.zc_pool + chunk * ZC_CHUNK, k_zcache.zc_buf, len);
+    ze->ze_location = location;
+    ze->ze_chunk = chunk;
+    ze->ze_len = len;
+    ze->ze_fill = words[0];
+    ze->ze_prev = k_zcache.zc_newest;
+    ze->ze_next = -1;
+    if (k_zcache.zc_newest >= 0) {
+        k_zcache.zc_entries[k_zcache.zc_newest].ze_next = e;
+    } else {
+        k_zcache.zc_oldest = e;
+    }
+    k_zcache.zc_newest = e;
+    k_zcache.zc_index[location] = e;
+
+    k_vmstats.vms_zcache_stores++;
+    if (same) {
+        k_vmstats.vms_zcache_same_filled++;
+    }
+    k_vmstats.vms_zcache_bytes += len;
+    lock_release(k_zcache.zc_lock);
+    return true;
+}
+
+bool
+zcache_load(int location, int ppn) {
+    KASSERT(location > 0 && location < k_zcache.zc_nblocks);
+    lock_acquire(k_zcache.zc_lock);
+    int e = k_zcache.zc_index[location];
+    if (e < 0) {
+        lock_release(k_zcache.zc_lock);
+        return false;
+    }
+    struct zc_entry *ze = &k_zcache.zc_entries[e];
+    uint32_t *words = (uint32_t *)CM_INDEX_TO_KVADDR(ppn);
+    if (ze->ze_len == 0) {
+        for (unsigned i = 0; i < ZC_WORDS; i++) {
+            words[i] = ze->ze_fill;
+        }
+    } else {
+        zc_decompress((uint8_t *)k_zcache.zc_pool + ze->ze_chunk * ZC_CHUNK,
+                      words);
+    }
+    k_vmstats.vms_zcache_hits++;
+    lock_release(k_zcache.zc_lock);
+    return true;
+}
+
+void
+zcache_drop(int location) {
+    KASSERT(location > 0 && location < k_zcache.zc_nblocks);
+    /* Nobody else can cache a block that is being freed, so a block
+     * that isn't cached now won't be before we're done */
+    if (k_zcache.zc_index[location] < 0) {
+        return;
+    }
+    lock_acquire(k_zcache.zc_lock);
+    if (k_zcache.zc_index[location] >= 0) {
+        zc_remove(k_zcache.zc_index[location]);
+    }
+    lock_release(k_zcache.zc_lock);
+}
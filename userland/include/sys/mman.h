@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+
+/*
+ * Get the protection and flag #defines from the kernel
+ */
+#include <kern/mman.h>
+
+/* What mmap returns on error */
+#define MAP_FAILED ((void *)-1)
+
+/*
+ * mmap maps LEN bytes of the open file FILEHANDLE, starting at offset
+ * OFFSET, or zero-filled memory if MAP_ANON is given. The kernel
+ * picks the address; ADDR is only a hint and is ignored. OFFSET must
+ * be a multiple of the page size.
+ *
+ * PROT may combine PROT_READ, PROT_WRITE and PROT_EXEC, but a mapping
+ * can always be read and executed; only PROT_WRITE makes a difference.
+ * PROT_NONE isn't supported and, like any other bit, fails with EINVAL.
+ *
+ * munmap unmaps every mapping in the given range. A mapping that is
+ * only partly in the range can't be unmapped.
+ *
+ * madvise with MADV_DONTNEED or MADV_FREE gives back the memory behind
+ * the pages in the given range. They stay mapped, and read as zeros
+ * (or as the file, for a private file mapping) when next touched.
+ * Shared mappings are left alone. ADDR must be page-aligned.
+ */
+void *mmap(void *addr, size_t len, int prot, int flags, int filehandle,
+	   off_t offset);
+int munmap(void *addr, size_t len);
+int madvise(void *addr, size_t len, int advice);
+
+
+#endif /* _SYS_MMAN_H_ */
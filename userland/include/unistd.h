@@ -57,6 +57,10 @@
  *     fstat:    sys/stat.h
  *     lstat:    sys/stat.h
  *     mkdir:    sys/stat.h
+ *     mmap:     sys/mman.h
+ *     munmap:   sys/mman.h
+ *     madvise:  sys/mman.h
+ *     memstat:  sys/memstat.h
  *
  * If this were standard Unix, more prototypes would go in other
  * header files as well, as follows:
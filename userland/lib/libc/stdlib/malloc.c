@@ -34,11 +34,18 @@
  * easy to follow. It performs abysmally if the heap becomes larger than
  * physical memory. To get (much) better out-of-core performance, port
  * the kernel's malloc. :-)
+ *
+ * Memory given back with free is returned to the system two ways: a
+ * large enough free block at the top of the heap is cut off with a
+ * negative sbrk, and the whole pages inside any other large free block
+ * are handed back with madvise. Those pages stay part of the heap and
+ * come back zero-filled when next touched.
  */
 
 #include <stdlib.h>
 #include <stdint.h>  // for uintptr_t on non-OS/161 platforms
 #include <unistd.h>
+#include <sys/mman.h>
 #include <err.h>
 #include <assert.h>
 
@@ -147,6 +154,19 @@ static size_t __malloc_pagesize;
 #define PAGE_SIZE 4096
 #endif
 
+/*
+ * Thresholds for giving memory back. MRELEASE_PAGES is the fewest
+ * whole free pages worth an madvise call; MTRIM_PAGES is the fewest
+ * worth shrinking the heap for. Trimming only larger runs keeps a
+ * program that frees and reallocates the top block from calling sbrk
+ * back and forth.
+ */
+#define MRELEASE_PAGES 4
+#define MTRIM_PAGES 16
+
+#define M_PAGEDOWN(a)	((a) / PAGE_SIZE * PAGE_SIZE)
+#define M_PAGEUP(a)	M_PAGEDOWN((a) + PAGE_SIZE - 1)
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -527,6 +547,70 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
 }
 
+/*
+ * Shrink the heap if the free block mh at the top of it is large
+ * enough. The block keeps whatever of it is below the first page
+ * boundary it can be cut at, or goes away entirely if it starts on
+ * one. Returns the block, or NULL if it went away.
+ */
+static
+struct mheader *
+__malloc_trim(struct mheader *mh)
+{
+	uintptr_t start = (uintptr_t)mh;
+	uintptr_t top;
+
+	assert(!mh->mh_inuse && M_NEXT(mh) == (struct mheader *)__heaptop);
+
+	/* whatever of the block is left needs room for a header and data */
+	top = M_PAGEUP(start);
+	if (top != start && top - start < 2*MBLOCKSIZE) {
+		top += PAGE_SIZE;
+	}
+	if (top >= __heaptop || __heaptop - top < MTRIM_PAGES * PAGE_SIZE) {
+		return mh;
+	}
+
+	if (sbrk(-(intptr_t)(__heaptop - top)) == (void *)-1) {
+		/* keep the memory; nothing depends on giving it back */
+		return mh;
+	}
+	__heaptop = top;
+
+	if (top == start) {
+		return NULL;
+	}
+	mh->mh_nextblock = M_MKFIELD(top - start);
+	return mh;
+}
+
+/*
+ * Give back the whole pages of the free block mh, limited to those
+ * that overlap the range [lo, hi) freed just now. The rest of the
+ * block was given back when it was freed, if it was big enough to be.
+ * The headers on either side of the data are never in those pages.
+ */
+static
+void
+__malloc_release(struct mheader *mh, uintptr_t lo, uintptr_t hi)
+{
+	uintptr_t start = M_PAGEUP((uintptr_t)M_DATA(mh));
+	uintptr_t end = M_PAGEDOWN((uintptr_t)M_NEXT(mh));
+
+	if (start < M_PAGEDOWN(lo)) {
+		start = M_PAGEDOWN(lo);
+	}
+	if (end > M_PAGEUP(hi)) {
+		end = M_PAGEUP(hi);
+	}
+	if (end <= start || end - start < MRELEASE_PAGES * PAGE_SIZE) {
+		return;
+	}
+
+	/* only advice; if it fails the pages just stay where they are */
+	(void)madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
 /*
  * The actual free() implementation.
  */
@@ -534,6 +618,7 @@ void
 free(void *x)
 {
 	struct mheader *mh, *mhnext, *mhprev;
+	uintptr_t lo, hi, plo, phi;
 
 	if (x==NULL) {
 		/* safest practice */
@@ -569,8 +654,22 @@ free(void *x)
 	/* mark it free */
 	mh->mh_inuse = 0;
 
-	/* wipe it */
-	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
+	/*
+	 * Wipe it. Whole pages that are about to be given back are
+	 * skipped, so as not to touch them (and maybe page them in)
+	 * just before throwing them away; they come back zeroed.
+	 */
+	lo = (uintptr_t)mh;
+	hi = (uintptr_t)M_NEXT(mh);
+	plo = M_PAGEUP((uintptr_t)M_DATA(mh));
+	phi = M_PAGEDOWN(hi);
+	if (phi > plo && phi - plo >= MRELEASE_PAGES * PAGE_SIZE) {
+		__malloc_deadbeef(M_DATA(mh), plo - (uintptr_t)M_DATA(mh));
+		__malloc_deadbeef((void *)phi, hi - phi);
+	}
+	else {
+		__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
+	}
 
 	/* Try merging with the block above (but not if we're at the top) */
 	mhnext = M_NEXT(mh);
@@ -582,6 +681,17 @@ free(void *x)
 	if (mh != (struct mheader *)__heapbase) {
 		mhprev = M_PREV(mh);
 		__malloc_trymerge(mhprev, mh);
+		if (!mhprev->mh_inuse) {
+			mh = mhprev;
+		}
+	}
+
+	/* Give back what we can: the top of the heap, or whole pages */
+	if (M_NEXT(mh) == (struct mheader *)__heaptop) {
+		mh = __malloc_trim(mh);
+	}
+	if (mh != NULL) {
+		__malloc_release(mh, lo, hi);
 	}
 
 #ifdef MALLOCDEBUG
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * faultbench - measure page fault throughput as more processes fault
+ * at once.
+ *
+ * For 1, 2, 4, and 8 processes, forks that many children, each of
+ * which grows its heap and touches every new page, so each touch is a
+ * fault on a page of its own address space. The faults in different
+ * processes are independent, so with enough cpus the aggregate rate
+ * should grow with the number of processes. Run it under sys161
+ * configured with 1, 2, 4, and 8 cpus to see how the fault path
+ * scales.
+ *
+ * Usage: faultbench [pages-per-process]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/wait.h>
+#include <test/timer.h>
+
+#define PAGESIZE 4096
+#define DEFAULT_PAGES 256
+
+/* Numbers of processes faulting at once */
+static const unsigned nprocs[] = { 1, 2, 4, 8 };
+#define NUMRUNS (sizeof(nprocs) / sizeof(nprocs[0]))
+
+static
+void
+fault_pages(unsigned pages)
+{
+	char *p;
+	unsigned i;
+
+	p = sbrk(pages * PAGESIZE);
+	if (p == (void *)-1) {
+		err(1, "sbrk");
+	}
+	for (i=0; i<pages; i++) {
+		p[i * PAGESIZE] = (char)i;
+	}
+}
+
+static
+unsigned long
+time_faults(unsigned procs, unsigned pages)
+{
+	struct timer t;
+	pid_t pids[8];
+	unsigned i;
+	int status;
+
+	timer_start(&t);
+	for (i=0; i<procs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			fault_pages(pages);
+			_exit(0);
+		}
+	}
+	for (i=0; i<procs; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			errx(1, "child %d failed", pids[i]);
+		}
+	}
+	return timer_usec(&t);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned pages = DEFAULT_PAGES;
+	unsigned i;
+	unsigned long usec, faults;
+
+	if (argc > 1) {
+		pages = atoi(argv[1]);
+		if (pages == 0) {
+			errx(1, "Usage: faultbench [pages-per-process]");
+		}
+	}
+
+	printf("faultbench: %u pages per process\n", pages);
+	printf("%8s %10s %12s %12s\n", "procs", "faults", "total(us)",
+	       "faults/sec");
+	for (i=0; i<NUMRUNS; i++) {
+		usec = time_faults(nprocs[i], pages);
+		faults = (unsigned long)nprocs[i] * pages;
+		printf("%8u %10lu %12lu %12lu\n", nprocs[i], faults, usec,
+		       usec == 0 ? 0 :
+		       (unsigned long)((faults * 1000000ULL) / usec));
+	}
+
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * forkbench - measure fork latency as the parent's memory grows.
+ *
+ * The parent touches an increasing number of heap pages, then times
+ * a batch of fork/_exit/waitpid round trips at each size. With
+ * copy-on-write fork the per-fork cost should track the size of the
+ * page table rather than the amount of memory the parent has resident.
+ *
+ * Usage: forkbench [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/wait.h>
+#include <test/timer.h>
+
+#define PAGESIZE 4096
+#define DEFAULT_ITERATIONS 16
+
+/* Resident sizes to measure, in pages */
+static const unsigned sizes[] = { 0, 16, 64, 256, 512 };
+#define NUMSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static
+void
+grow(char **base, unsigned *have, unsigned want)
+{
+	char *p;
+
+	if (want <= *have) {
+		return;
+	}
+	p = sbrk((want - *have) * PAGESIZE);
+	if (p == (void *)-1) {
+		err(1, "sbrk");
+	}
+	if (*base == NULL) {
+		*base = p;
+	}
+	/* touch every new page so it is resident */
+	for (; *have < want; (*have)++) {
+		(*base)[*have * PAGESIZE] = (char)*have;
+	}
+}
+
+static
+unsigned long
+time_forks(unsigned iterations)
+{
+	struct timer t;
+	unsigned i;
+	pid_t pid;
+	int status;
+
+	timer_start(&t);
+	for (i=0; i<iterations; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			errx(1, "child %d failed", pid);
+		}
+	}
+	return timer_usec(&t);
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned iterations = DEFAULT_ITERATIONS;
+	unsigned i, have = 0;
+	unsigned long usec;
+	char *base = NULL;
+
+	if (argc > 1) {
+		iterations = atoi(argv[1]);
+		if (iterations == 0) {
+			errx(1, "Usage: forkbench [iterations]");
+		}
+	}
+
+	printf("forkbench: %u forks per size\n", iterations);
+	printf("%8s %12s %12s\n", "pages", "total(us)", "fork(us)");
+	for (i=0; i<NUMSIZES; i++) {
+		grow(&base, &have, sizes[i]);
+		usec = time_forks(iterations);
+		printf("%8u %12lu %12lu\n", sizes[i], usec, usec / iterations);
+	}
+
+	return 0;
+}
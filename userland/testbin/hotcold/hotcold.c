@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * hotcold - measure how well page replacement keeps a hot working set
+ * in memory while a larger cold set streams through.
+ *
+ * Grows the heap by a small hot set and a cold set bigger than memory.
+ * Then, for each chunk of the cold set it touches, it touches every
+ * page of the hot set again. A replacement policy that notices which
+ * pages are in use keeps the hot set resident, so only the cold set
+ * faults; one that doesn't evicts hot pages as readily as cold ones.
+ *
+ * User programs can't see the kernel's fault counts, so a touch that
+ * takes longer than MAJOR_USEC is counted as a major fault: nothing
+ * but a disk read takes that long. Compare the counts across kernels
+ * (and against "vmstats" in the kernel menu) to see the change.
+ *
+ * Usage: hotcold [hot-pages [cold-pages]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <test/timer.h>
+
+#define PAGESIZE 4096
+#define DEFAULT_HOT 64
+#define DEFAULT_COLD 2048
+#define CHUNK 64
+#define ROUNDS 4
+#define MAJOR_USEC 500
+
+/* Touches a page; returns 1 if it took long enough to be a major fault */
+static
+unsigned
+touch(volatile char *p, unsigned long *usec)
+{
+	struct timer t;
+	unsigned long elapsed;
+
+	timer_start(&t);
+	(*p)++;
+	elapsed = timer_usec(&t);
+	*usec += elapsed;
+	return elapsed >= MAJOR_USEC;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned hot = DEFAULT_HOT, cold = DEFAULT_COLD;
+	unsigned r, c, i;
+	unsigned hotmajor, coldmajor;
+	unsigned long hotusec, coldusec;
+	char *hotp, *coldp;
+
+	if (argc > 1) {
+		hot = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		cold = atoi(argv[2]);
+	}
+	if (hot == 0 || cold == 0) {
+		errx(1, "Usage: hotcold [hot-pages [cold-pages]]");
+	}
+
+	hotp = sbrk(hot * PAGESIZE);
+	if (hotp == (void *)-1) {
+		err(1, "sbrk");
+	}
+	coldp = sbrk(cold * PAGESIZE);
+	if (coldp == (void *)-1) {
+		err(1, "sbrk");
+	}
+
+	printf("hotcold: %u hot pages, %u cold pages\n", hot, cold);
+	printf("%8s %12s %12s %12s %12s\n", "round", "hot majors",
+	       "hot(us)", "cold majors", "cold(us)");
+	for (r=0; r<ROUNDS; r++) {
+		hotmajor = coldmajor = 0;
+		hotusec = coldusec = 0;
+		for (c=0; c<cold; c+=CHUNK) {
+			for (i=c; i<cold && i<c+CHUNK; i++) {
+				coldmajor += touch(&coldp[i * PAGESIZE],
+						   &coldusec);
+			}
+			for (i=0; i<hot; i++) {
+				hotmajor += touch(&hotp[i * PAGESIZE],
+						  &hotusec);
+			}
+		}
+		printf("%8u %12u %12lu %12u %12lu\n", r, hotmajor, hotusec,
+		       coldmajor, coldusec);
+	}
+
+	return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * memstat - print the memory use and paging counts of a process.
+ *
+ * With a pid, prints that process's counts. Without one, checks its
+ * own: it touches the given number of fresh heap pages (64 by default)
+ * and makes sure each of them shows up as a resident page and a page
+ * fault, then prints the counts.
+ *
+ * Usage: memstat [-p pid] [npages]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/memstat.h>
+
+#define DEFAULT_PAGES 64
+#define PAGE 4096
+
+static
+void
+print(pid_t pid, const struct memstat *ms)
+{
+	static const char *const limits[MS_LATENCY_BUCKETS] = {
+		"16us", "64us", "256us", "1ms", "4ms", "16ms", "64ms", "more",
+	};
+	unsigned i;
+
+	printf("pid %d\n", pid);
+	printf("  resident pages:  %u\n", ms->ms_resident);
+	printf("  swapped pages:   %u\n", ms->ms_swapped);
+	printf("  tlb faults:      %u\n", ms->ms_tlb_faults);
+	printf("  minor faults:    %u\n", ms->ms_minor_faults);
+	printf("  major faults:    %u\n", ms->ms_major_faults);
+	printf("  swap-ins:        %u\n", ms->ms_swapins);
+	printf("  swap-outs:       %u\n", ms->ms_swapouts);
+	printf("  fault latency:\n");
+	for (i = 0; i < MS_LATENCY_BUCKETS; i++) {
+		printf("    %s%-6s %u\n", i + 1 < MS_LATENCY_BUCKETS ? "<" : " ",
+		       limits[i], ms->ms_latency[i]);
+	}
+}
+
+static
+void
+selftest(unsigned npages)
+{
+	struct memstat before, after;
+	char *p;
+	unsigned i, faults;
+
+	if (memstat(0, &before) < 0) {
+		err(1, "memstat");
+	}
+
+	p = sbrk(npages * PAGE);
+	if (p == (void *)-1) {
+		err(1, "sbrk");
+	}
+	for (i = 0; i < npages; i++) {
+		p[i * PAGE] = (char)i;
+	}
+
+	if (memstat(0, &after) < 0) {
+		err(1, "memstat");
+	}
+	faults = (after.ms_minor_faults + after.ms_major_faults) -
+		(before.ms_minor_faults + before.ms_major_faults);
+	if (faults < npages) {
+		errx(1, "touched %u pages but only %u page faults counted",
+		     npages, faults);
+	}
+	if (after.ms_resident + after.ms_swapped <
+	    before.ms_resident + npages) {
+		errx(1, "touched %u pages but only %u more are resident",
+		     npages, after.ms_resident - before.ms_resident);
+	}
+	print(getpid(), &after);
+	printf("memstat: %u pages passed\n", npages);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct memstat ms;
+	pid_t pid;
+
+	if (argc == 3 && !strcmp(argv[1], "-p")) {
+		pid = atoi(argv[2]);
+		if (memstat(pid, &ms) < 0) {
+			err(1, "memstat %d", pid);
+		}
+		print(pid, &ms);
+		return 0;
+	}
+	if (argc > 2) {
+		errx(1, "Usage: memstat [-p pid] [npages]");
+	}
+	selftest(argc == 2 ? (unsigned)atoi(argv[1]) : DEFAULT_PAGES);
+	return 0;
+}
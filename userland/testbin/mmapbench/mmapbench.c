@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmapbench - compare scanning a file with read() against scanning it
+ * through mmap().
+ *
+ * Creates a file of the given size (1 MB by default, about what bigfile
+ * makes), then sums its bytes twice: once reading it 512 bytes at a
+ * time, and once through a private read-only mapping. Both sums must
+ * agree. Finally it changes the file through a shared writeable
+ * mapping and checks with read() that the change was written back.
+ *
+ * The file has to be on a file system that supports mmap, such as
+ * SFS.
+ *
+ * Usage: mmapbench <filename> [size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <test/timer.h>
+
+#define DEFAULT_SIZE (1024 * 1024)
+#define CHUNK 512
+
+static char buf[CHUNK];
+
+static
+void
+report(const char *what, size_t size, unsigned long usec)
+{
+	printf("%-8s %10lu us %10lu KB/s\n", what, usec,
+	       usec == 0 ? 0 :
+	       (unsigned long)(((unsigned long long)size * 1000000ULL / 1024)
+			       / usec));
+}
+
+static
+void
+make_file(const char *filename, size_t size)
+{
+	size_t done, i;
+	ssize_t len;
+	int fd;
+
+	fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC);
+	if (fd < 0) {
+		err(1, "%s: create", filename);
+	}
+	for (done = 0; done < size; done += CHUNK) {
+		for (i = 0; i < CHUNK; i++) {
+			buf[i] = (char)(done + i * 7);
+		}
+		len = write(fd, buf, CHUNK);
+		if (len != CHUNK) {
+			err(1, "%s: write", filename);
+		}
+	}
+	close(fd);
+}
+
+static
+unsigned long
+scan_read(const char *filename, size_t size)
+{
+	unsigned long sum = 0;
+	size_t done, i;
+	ssize_t len;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", filename);
+	}
+	for (done = 0; done < size; done += len) {
+		len = read(fd, buf, CHUNK);
+		if (len <= 0) {
+			err(1, "%s: read", filename);
+		}
+		for (i = 0; i < (size_t)len; i++) {
+			sum += (unsigned char)buf[i];
+		}
+	}
+	close(fd);
+	return sum;
+}
+
+static
+unsigned long
+scan_mmap(const char *filename, size_t size)
+{
+	unsigned long sum = 0;
+	unsigned char *p;
+	size_t i;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", filename);
+	}
+	p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap", filename);
+	}
+	close(fd);
+	for (i = 0; i < size; i++) {
+		sum += p[i];
+	}
+	if (munmap(p, size) < 0) {
+		err(1, "munmap");
+	}
+	return sum;
+}
+
+static
+void
+check_writeback(const char *filename, size_t size)
+{
+	char *p;
+	size_t pos;
+	int fd;
+
+	fd = open(filename, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", filename);
+	}
+	p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap", filename);
+	}
+	pos = size / 2 + 3;
+	p[pos] = 'm';
+	if (munmap(p, size) < 0) {
+		err(1, "munmap");
+	}
+
+	if (lseek(fd, pos, SEEK_SET) < 0) {
+		err(1, "%s: lseek", filename);
+	}
+	if (read(fd, buf, 1) != 1) {
+		err(1, "%s: read", filename);
+	}
+	close(fd);
+	if (buf[0] != 'm') {
+		errx(1, "shared mapping was not written back");
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *filename;
+	size_t size = DEFAULT_SIZE;
+	unsigned long readsum, mmapsum, usec;
+	struct timer t;
+
+	if (argc < 2 || argc > 3) {
+		errx(1, "Usage: mmapbench <filename> [size]");
+	}
+	filename = argv[1];
+	if (argc == 3) {
+		size = atoi(argv[2]);
+	}
+	size = (size + CHUNK - 1) / CHUNK * CHUNK;
+	if (size == 0) {
+		errx(1, "Really?");
+	}
+
+	printf("mmapbench: scanning %u bytes\n", size);
+	make_file(filename, size);
+
+	timer_start(&t);
+	readsum = scan_read(filename, size);
+	usec = timer_usec(&t);
+	report("read", size, usec);
+
+	timer_start(&t);
+	mmapsum = scan_mmap(filename, size);
+	usec = timer_usec(&t);
+	report("mmap", size, usec);
+
+	if (readsum != mmapsum) {
+		errx(1, "sums differ: read %lu, mmap %lu", readsum, mmapsum);
+	}
+
+	check_writeback(filename, size);
+	printf("mmapbench: passed\n");
+
+	return 0;
+}
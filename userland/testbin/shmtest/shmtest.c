@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * shmtest - check that shared anonymous memory is shared across fork,
+ * and that private anonymous memory is not.
+ *
+ * Maps the given number of pages (64 by default) of shared and of
+ * private zero-filled memory, and touches half of each. Then it forks:
+ * the child checks what the parent wrote, writes every page of both
+ * mappings, and exits. The parent must see all of the child's writes
+ * to the shared mapping and none of its writes to the private one.
+ * Asking for more pages than fit in memory makes the shared pages go
+ * through swap on the way.
+ *
+ * Usage: shmtest [npages]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define DEFAULT_PAGES 64
+#define PAGE 4096
+
+static
+void
+fill(int *p, unsigned npages, unsigned from, int base)
+{
+	unsigned i;
+
+	for (i = from; i < npages; i++) {
+		p[i * PAGE / sizeof(int)] = base + (int)i;
+		p[(i + 1) * PAGE / sizeof(int) - 1] = base - (int)i;
+	}
+}
+
+static
+void
+check(const int *p, unsigned npages, int base, const char *what)
+{
+	unsigned i;
+
+	for (i = 0; i < npages; i++) {
+		if (p[i * PAGE / sizeof(int)] != base + (int)i ||
+		    p[(i + 1) * PAGE / sizeof(int) - 1] != base - (int)i) {
+			errx(1, "%s: page %u is wrong", what, i);
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned npages = DEFAULT_PAGES;
+	int *shared, *private;
+	pid_t pid;
+	int status;
+
+	if (argc > 2) {
+		errx(1, "Usage: shmtest [npages]");
+	}
+	if (argc == 2) {
+		npages = atoi(argv[1]);
+	}
+	if (npages < 2) {
+		errx(1, "need at least 2 pages");
+	}
+
+	shared = mmap(NULL, npages * PAGE, PROT_READ|PROT_WRITE,
+		      MAP_SHARED|MAP_ANON, -1, 0);
+	if (shared == MAP_FAILED) {
+		err(1, "mmap shared");
+	}
+	private = mmap(NULL, npages * PAGE, PROT_READ|PROT_WRITE,
+		       MAP_PRIVATE|MAP_ANON, -1, 0);
+	if (private == MAP_FAILED) {
+		err(1, "mmap private");
+	}
+
+	/* Touch half, so some pages are in memory at fork and some are not */
+	fill(shared, npages / 2, 0, 1000);
+	fill(private, npages / 2, 0, 1000);
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		check(shared, npages / 2, 1000, "child, shared");
+		check(private, npages / 2, 1000, "child, private");
+		fill(shared, npages, 0, 5000);
+		fill(private, npages, 0, 5000);
+		_exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+
+	check(shared, npages, 5000, "parent, shared");
+	check(private, npages / 2, 1000, "parent, private");
+
+	if (munmap(shared, npages * PAGE) < 0) {
+		err(1, "munmap shared");
+	}
+	if (munmap(private, npages * PAGE) < 0) {
+		err(1, "munmap private");
+	}
+
+	printf("shmtest: %u pages passed\n", npages);
+	return 0;
+}
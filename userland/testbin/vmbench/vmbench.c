@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * vmbench - time the basic costs of the VM system, one at a time.
+ *
+ * Each test times one kind of operation, repeated over many pages,
+ * and is run several times over:
+ *
+ *    zerofill  first touch of fresh heap pages (zero-fill faults)
+ *    tlb       touching resident pages in a pattern the tlb can't
+ *              hold, so every touch is a tlb refill
+ *    major     touching pages that were pushed out to swap by touching
+ *              a larger region after them
+ *    fork      fork, _exit and waitpid with a small resident heap
+ *    sbrkgrow  growing the heap a page at a time
+ *    sbrkshrink shrinking the heap a page at a time, freeing resident
+ *              pages
+ *    madvise   giving back resident heap pages with madvise, a few
+ *              pages at a time, without shrinking the heap
+ *
+ * Times come from __time, which counts in nanoseconds. The major
+ * fault test counts the faults it actually caused with memstat, since
+ * how many pages really went to swap depends on the memory size; give
+ * it a larger region with -m if it reports none. The madvise test
+ * likewise counts the resident pages it got rid of.
+ *
+ * Every run prints one line of key=value pairs, and every test a
+ * summary line, so results can be collected and compared by script:
+ *
+ *    vmbench test=zerofill run=1 ops=256 ns=1843000 ns_per_op=7199
+ *    vmbench test=zerofill runs=5 min=7001 median=7199 max=8123
+ *
+ * Usage: vmbench [-r runs] [-n pages] [-m swap-pages] [test ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/memstat.h>
+#include <test/timer.h>
+
+#define PAGESIZE 4096
+#define DEFAULT_RUNS 5
+#define DEFAULT_PAGES 256
+#define DEFAULT_SWAP_PAGES 1024
+#define MAX_RUNS 32
+#define TLB_PASSES 16
+#define FORK_PAGES 64
+#define FORKS 16
+#define ADVISE_PAGES 4
+
+static unsigned npages = DEFAULT_PAGES;
+static unsigned swappages = DEFAULT_SWAP_PAGES;
+
+static
+char *
+grow(unsigned pages)
+{
+	char *p;
+
+	p = sbrk(pages * PAGESIZE);
+	if (p == (void *)-1) {
+		err(1, "sbrk");
+	}
+	return p;
+}
+
+static
+void
+shrink(unsigned pages)
+{
+	if (sbrk(-(int)(pages * PAGESIZE)) == (void *)-1) {
+		err(1, "sbrk");
+	}
+}
+
+static
+void
+touch(char *p, unsigned pages)
+{
+	unsigned i;
+
+	for (i = 0; i < pages; i++) {
+		p[i * PAGESIZE] = (char)i;
+	}
+}
+
+/* The tests: each runs once, returns the time taken, and sets *ops */
+
+static
+unsigned long long
+bench_zerofill(unsigned *ops)
+{
+	struct timer t;
+	unsigned long long ns;
+	char *p;
+
+	p = grow(npages);
+	timer_start(&t);
+	touch(p, npages);
+	ns = timer_ns(&t);
+	shrink(npages);
+	*ops = npages;
+	return ns;
+}
+
+static
+unsigned long long
+bench_tlb(unsigned *ops)
+{
+	struct timer t;
+	unsigned long long ns;
+	volatile char *p;
+	unsigned i, pass;
+	char sum = 0;
+
+	p = grow(npages);
+	touch((char *)p, npages);
+
+	/* Every page in turn, many more pages than the tlb has entries */
+	timer_start(&t);
+	for (pass = 0; pass < TLB_PASSES; pass++) {
+		for (i = 0; i < npages; i++) {
+			sum += p[i * PAGESIZE];
+		}
+	}
+	ns = timer_ns(&t);
+	(void)sum;
+	shrink(npages);
+	*ops = TLB_PASSES * npages;
+	return ns;
+}
+
+static
+unsigned long long
+bench_major(unsigned *ops)
+{
+	struct memstat before, after;
+	struct timer t;
+	unsigned long long ns;
+	volatile char *p;
+	unsigned i;
+	char sum = 0;
+
+	p = grow(npages);
+	touch((char *)p, npages);
+
+	/* Push the pages out by touching more than fits after them */
+	touch(grow(swappages), swappages);
+
+	if (memstat(0, &before) < 0) {
+		err(1, "memstat");
+	}
+	timer_start(&t);
+	for (i = 0; i < npages; i++) {
+		sum += p[i * PAGESIZE];
+	}
+	ns = timer_ns(&t);
+	if (memstat(0, &after) < 0) {
+		err(1, "memstat");
+	}
+	(void)sum;
+	shrink(swappages);
+	shrink(npages);
+	*ops = after.ms_major_faults - before.ms_major_faults;
+	return ns;
+}
+
+static
+unsigned long long
+bench_fork(unsigned *ops)
+{
+	struct timer t;
+	unsigned long long ns;
+	unsigned i;
+	pid_t pid;
+	int status;
+
+	touch(grow(FORK_PAGES), FORK_PAGES);
+	timer_start(&t);
+	for (i = 0; i < FORKS; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			_exit(0);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			errx(1, "child %d failed", pid);
+		}
+	}
+	ns = timer_ns(&t);
+	shrink(FORK_PAGES);
+	*ops = FORKS;
+	return ns;
+}
+
+static
+unsigned long long
+bench_sbrkgrow(unsigned *ops)
+{
+	struct timer t;
+	unsigned long long ns;
+	unsigned i;
+
+	timer_start(&t);
+	for (i = 0; i < npages; i++) {
+		grow(1);
+	}
+	ns = timer_ns(&t);
+	shrink(npages);
+	*ops = npages;
+	return ns;
+}
+
+static
+unsigned long long
+bench_sbrkshrink(unsigned *ops)
+{
+	struct timer t;
+	unsigned long long ns;
+	unsigned i;
+
+	touch(grow(npages), npages);
+	timer_start(&t);
+	for (i = 0; i < npages; i++) {
+		shrink(1);
+	}
+	ns = timer_ns(&t);
+	*ops = npages;
+	return ns;
+}
+
+static
+unsigned long long
+bench_madvise(unsigned *ops)
+{
+	struct memstat before, after;
+	struct timer t;
+	unsigned long long ns;
+	unsigned i, released;
+	char *p;
+
+	released = npages / ADVISE_PAGES * ADVISE_PAGES;
+	p = grow(npages);
+	touch(p, npages);
+	if (memstat(0, &before) < 0) {
+		err(1, "memstat");
+	}
+	timer_start(&t);
+	for (i = 0; i < released; i += ADVISE_PAGES) {
+		if (madvise(p + i * PAGESIZE, ADVISE_PAGES * PAGESIZE,
+			    MADV_DONTNEED) < 0) {
+			err(1, "madvise");
+		}
+	}
+	ns = timer_ns(&t);
+	if (memstat(0, &after) < 0) {
+		err(1, "memstat");
+	}
+
+	/* The pages have to come back zeroed */
+	for (i = 0; i < released; i++) {
+		if (p[i * PAGESIZE] != 0) {
+			errx(1, "page %u not zero after madvise", i);
+		}
+	}
+	shrink(npages);
+	*ops = before.ms_resident - after.ms_resident;
+	return ns;
+}
+
+static const struct {
+	const char *name;
+	unsigned long long (*run)(unsigned *ops);
+} tests[] = {
+	{ "zerofill", bench_zerofill },
+	{ "tlb", bench_tlb },
+	{ "major", bench_major },
+	{ "fork", bench_fork },
+	{ "sbrkgrow", bench_sbrkgrow },
+	{ "sbrkshrink", bench_sbrkshrink },
+	{ "madvise", bench_madvise },
+};
+#define NUMTESTS (sizeof(tests) / sizeof(tests[0]))
+
+static
+void
+sort(unsigned long *v, unsigned n)
+{
+	unsigned i, j;
+	unsigned long tmp;
+
+	for (i = 1; i < n; i++) {
+		for (j = i; j > 0 && v[j - 1] > v[j]; j--) {
+			tmp = v[j];
+			v[j] = v[j - 1];
+			v[j - 1] = tmp;
+		}
+	}
+}
+
+static
+void
+runtest(unsigned which, unsigned runs)
+{
+	unsigned long per_op[MAX_RUNS];
+	unsigned long long ns;
+	unsigned i, ops;
+
+	for (i = 0; i < runs; i++) {
+		ns = tests[which].run(&ops);
+		per_op[i] = ops == 0 ? 0 : (unsigned long)(ns / ops);
+		printf("vmbench test=%s run=%u ops=%u ns=%llu ns_per_op=%lu\n",
+		       tests[which].name, i + 1, ops, ns, per_op[i]);
+	}
+	sort(per_op, runs);
+	printf("vmbench test=%s runs=%u min=%lu median=%lu max=%lu\n",
+	       tests[which].name, runs, per_op[0], per_op[runs / 2],
+	       per_op[runs - 1]);
+}
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: vmbench [-r runs] [-n pages] [-m swap-pages] "
+	     "[test ...]");
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned runs = DEFAULT_RUNS;
+	unsigned i;
+	int arg, found;
+
+	for (arg = 1; arg < argc && argv[arg][0] == '-'; arg++) {
+		if (arg + 1 == argc) {
+			usage();
+		}
+		if (!strcmp(argv[arg], "-r")) {
+			runs = atoi(argv[++arg]);
+		} else if (!strcmp(argv[arg], "-n")) {
+			npages = atoi(argv[++arg]);
+		} else if (!strcmp(argv[arg], "-m")) {
+			swappages = atoi(argv[++arg]);
+		} else {
+			usage();
+		}
+	}
+	if (runs == 0 || runs > MAX_RUNS || npages == 0 || swappages == 0) {
+		usage();
+	}
+
+	if (arg == argc) {
+		for (i = 0; i < NUMTESTS; i++) {
+			runtest(i, runs);
+		}
+		return 0;
+	}
+	for (; arg < argc; arg++) {
+		found = 0;
+		for (i = 0; i < NUMTESTS; i++) {
+			if (!strcmp(argv[arg], tests[i].name)) {
+				runtest(i, runs);
+				found = 1;
+			}
+		}
+		if (!found) {
+			errx(1, "%s: no such test", argv[arg]);
+		}
+	}
+	return 0;
+}